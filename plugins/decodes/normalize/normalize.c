@@ -32,6 +32,7 @@
 
 #include <libprelude/prelude.h>
 #include "prelude-manager.h"
+#include "pmsg-to-idmef.h"
 
 
 int normalize_LTX_prelude_plugin_version(void);
@@ -44,7 +45,12 @@ static prelude_bool_t normalize_to_ipv6 = FALSE;
 
 
 
-static int sanitize_service_protocol(idmef_service_t *service)
+/*
+ * Each sanitize function set *modified before it change the message,
+ * so that unchanged messages can be forwarded as received, and that a
+ * change failing halfway is still accounted.
+ */
+static int sanitize_service_protocol(idmef_service_t *service, prelude_bool_t *modified)
 {
         int ret;
         uint8_t *ipn;
@@ -57,7 +63,12 @@ static int sanitize_service_protocol(idmef_service_t *service)
         ipn = idmef_service_get_iana_protocol_number(service);
         if ( ipn ) {
                 proto = getprotobynumber(*ipn);
-                if ( proto ) {
+                str = idmef_service_get_iana_protocol_name(service);
+
+                if ( proto && ! (str && prelude_string_get_string(str) &&
+                                 strcmp(prelude_string_get_string(str), proto->p_name) == 0) ) {
+                        *modified = TRUE;
+
                         ret = idmef_service_new_iana_protocol_name(service, &str);
                         if ( ret < 0 )
                                 return ret;
@@ -70,11 +81,15 @@ static int sanitize_service_protocol(idmef_service_t *service)
 
         else if ( (str = idmef_service_get_iana_protocol_name(service)) && ! prelude_string_is_empty(str) ) {
                 proto = getprotobyname(prelude_string_get_string(str));
-                if ( proto )
+                if ( proto ) {
+                        *modified = TRUE;
                         idmef_service_set_iana_protocol_number(service, proto->p_proto);
+                }
         }
 
         if ( ! idmef_service_get_port(service) && ! idmef_service_get_name(service) ) {
+                *modified = TRUE;
+
                 ret = idmef_service_new_name(service, &str);
                 if ( ret < 0 )
                         return ret;
@@ -122,7 +137,7 @@ static void sanitize_address_string(idmef_address_t *addr, const char *str, prel
 }
 
 
-static void sanitize_address(idmef_address_t *addr)
+static void sanitize_address(idmef_address_t *addr, prelude_bool_t *modified)
 {
         int ret;
         const char *str;
@@ -142,17 +157,20 @@ static void sanitize_address(idmef_address_t *addr)
 
         ret = sscanf(str + ((ipv6_prefix) ? 7 : 0), "%d.%d.%d.%d", &a, &b, &c, &d);
         if ( ret == 4 ) {
+                *modified = TRUE;
                 idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_IPV4_ADDR);
                 return sanitize_address_string(addr, str, ipv6_prefix);
         }
 
         ret = sscanf(str, "%255[^@]@%255s", buf1, buf2);
         if ( ret == 2 ) {
+                *modified = TRUE;
                 idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_E_MAIL);
                 return;
         }
 
         if ( (str = strchr(str, ':')) && strchr(str + 1, ':') ) {
+                *modified = TRUE;
                 idmef_address_set_category(addr, IDMEF_ADDRESS_CATEGORY_IPV6_ADDR);
                 return;
         }
@@ -160,7 +178,7 @@ static void sanitize_address(idmef_address_t *addr)
 
 
 
-static int sanitize_node(idmef_node_t *node)
+static int sanitize_node(idmef_node_t *node, prelude_bool_t *modified)
 {
         const char *str;
         prelude_string_t *pstr;
@@ -170,17 +188,19 @@ static int sanitize_node(idmef_node_t *node)
 
                 pstr = idmef_address_get_address(address);
                 if ( ! pstr ) {
+                        *modified = TRUE;
                         idmef_address_destroy(address); address = NULL;
                         continue;
                 }
 
                 str = prelude_string_get_string(pstr);
                 if ( ! str || ! *str ) {
+                        *modified = TRUE;
                         idmef_address_destroy(address); address = NULL;
                         continue;
                 }
 
-                sanitize_address(address);
+                sanitize_address(address, modified);
         }
 
         if ( ! idmef_node_get_next_address(node, NULL) && ! idmef_node_get_name(node) )
@@ -191,7 +211,31 @@ static int sanitize_node(idmef_node_t *node)
 
 
 
-static void sanitize_alert(idmef_alert_t *alert)
+/*
+ * The manager analyzer is reused by every message decoded by this
+ * thread, and is left alone.
+ */
+static void sanitize_analyzer(idmef_analyzer_t *analyzer, prelude_bool_t *modified)
+{
+        int ret;
+        idmef_node_t *node;
+
+        if ( pmsg_to_idmef_is_manager_analyzer(analyzer) )
+                return;
+
+        node = idmef_analyzer_get_node(analyzer);
+        if ( node ) {
+                ret = sanitize_node(node, modified);
+                if ( ret < 0 ) {
+                        *modified = TRUE;
+                        idmef_analyzer_set_node(analyzer, NULL);
+                }
+        }
+}
+
+
+
+static int sanitize_alert(idmef_alert_t *alert, prelude_bool_t *modified)
 {
         int ret;
         idmef_node_t *node;
@@ -200,62 +244,58 @@ static void sanitize_alert(idmef_alert_t *alert)
         idmef_analyzer_t *analyzer = NULL;
 
         if ( ! alert )
-                return;
+                return 0;
 
-        while ( (analyzer = idmef_alert_get_next_analyzer(alert, analyzer)) ) {
-                node = idmef_analyzer_get_node(analyzer);
-                if ( node ) {
-                        ret = sanitize_node(node);
-                        if ( ret < 0 )
-                                idmef_analyzer_set_node(analyzer, NULL);
-                }
-        }
+        while ( (analyzer = idmef_alert_get_next_analyzer(alert, analyzer)) )
+                sanitize_analyzer(analyzer, modified);
 
         while ( (src = idmef_alert_get_next_source(alert, src)) ) {
 
-                sanitize_service_protocol(idmef_source_get_service(src));
+                ret = sanitize_service_protocol(idmef_source_get_service(src), modified);
+                if ( ret < 0 )
+                        return ret;
 
                 node = idmef_source_get_node(src);
                 if ( node ) {
-                        ret = sanitize_node(node);
-                        if ( ret < 0 )
+                        ret = sanitize_node(node, modified);
+                        if ( ret < 0 ) {
+                                *modified = TRUE;
                                 idmef_source_set_node(src, NULL);
+                        }
                 }
         }
 
 
         while ( (dst = idmef_alert_get_next_target(alert, dst)) ) {
 
-                sanitize_service_protocol(idmef_target_get_service(dst));
+                ret = sanitize_service_protocol(idmef_target_get_service(dst), modified);
+                if ( ret < 0 )
+                        return ret;
 
                 node = idmef_target_get_node(dst);
                 if ( node ) {
-                        ret = sanitize_node(node);
-                        if ( ret < 0 )
+                        ret = sanitize_node(node, modified);
+                        if ( ret < 0 ) {
+                                *modified = TRUE;
                                 idmef_target_set_node(dst, NULL);
+                        }
                 }
         }
+
+        return 0;
 }
 
 
 
-static void sanitize_heartbeat(idmef_heartbeat_t *heartbeat)
+static void sanitize_heartbeat(idmef_heartbeat_t *heartbeat, prelude_bool_t *modified)
 {
-        int ret;
-        idmef_node_t *node;
         idmef_analyzer_t *analyzer = NULL;
 
         if ( ! heartbeat )
                 return;
 
-        while ( (analyzer = idmef_heartbeat_get_next_analyzer(heartbeat, analyzer)) ) {
-                node = idmef_analyzer_get_node(analyzer);
-                if ( node ) {
-                        ret = sanitize_node(node);
-                        if ( ret < 0 )
-                                idmef_analyzer_set_node(analyzer, NULL);
-                }
-        }
+        while ( (analyzer = idmef_heartbeat_get_next_analyzer(heartbeat, analyzer)) )
+                sanitize_analyzer(analyzer, modified);
 }
 
 
@@ -263,12 +303,18 @@ static void sanitize_heartbeat(idmef_heartbeat_t *heartbeat)
 
 static int normalize_run(prelude_msg_t *msg, idmef_message_t *idmef)
 {
+        int ret = 0;
+        prelude_bool_t modified = FALSE;
+
         if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT )
-                sanitize_alert(idmef_message_get_alert(idmef));
+                ret = sanitize_alert(idmef_message_get_alert(idmef), &modified);
         else
-                sanitize_heartbeat(idmef_message_get_heartbeat(idmef));
+                sanitize_heartbeat(idmef_message_get_heartbeat(idmef), &modified);
 
-        return 0;
+        if ( modified )
+                pmsg_forward_set_modified(idmef);
+
+        return ret;
 }
 
 
@@ -301,6 +347,7 @@ int normalize_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_opt
 
         prelude_plugin_set_name(&normalize, "Normalize");
         manager_decode_plugin_set_running_func(&normalize, normalize_run);
+        manager_decode_plugin_set_concurrency(&normalize, MANAGER_PLUGIN_CONCURRENCY_INSTANCE);
         prelude_plugin_entry_set_plugin(pe, (void *) &normalize);
 
         prelude_option_add(root_opt, &opt, PRELUDE_OPTION_TYPE_CFG,
@@ -64,6 +64,18 @@ static int process_message(idmef_message_t *msg, void *priv)
 }
 
 
+/*
+ * The filter has no side effect, let the manager know which part of
+ * the message it look at.
+ */
+static void update_hook_criteria(filter_plugin_t *plugin)
+{
+        if ( plugin->hook )
+                manager_filter_hook_set_criteria(plugin->hook, plugin->criteria);
+}
+
+
+
 static int get_filter_hook(prelude_option_t *opt, prelude_string_t *out, void *context)
 {
         int ret = 0;
@@ -119,6 +131,8 @@ static int set_filter_hook(prelude_option_t *opt, const char *optarg, prelude_st
         manager_filter_new_hook(&plugin->hook, context, MANAGER_FILTER_CATEGORY_PLUGIN, ptr, plugin);
 
  success:
+        update_hook_criteria(plugin);
+
         if ( plugin->hook_str )
                 free(plugin->hook_str);
 
@@ -144,6 +158,7 @@ static int add_criteria(filter_plugin_t *plugin, const char *criteria)
                 idmef_criteria_destroy(plugin->criteria);
 
         plugin->criteria = new;
+        update_hook_criteria(plugin);
 
         return 0;
 }
@@ -196,6 +211,7 @@ err:
                 idmef_criteria_destroy(plugin->criteria);
 
         plugin->criteria = criteria;
+        update_hook_criteria(plugin);
 
         return ret;
 }
@@ -293,6 +309,7 @@ int idmef_criteria_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *roo
         prelude_plugin_set_name(&filter_plugin, "IDMEF-Criteria");
         prelude_plugin_set_destroy_func(&filter_plugin, filter_destroy);
         manager_filter_plugin_set_running_func(&filter_plugin, process_message);
+        manager_filter_plugin_set_concurrency(&filter_plugin, MANAGER_PLUGIN_CONCURRENCY_REENTRANT);
 
         prelude_plugin_entry_set_plugin(pe, (void *) &filter_plugin);
 
@@ -0,0 +1,466 @@
+/*****
+*
+* Copyright (C) 2007 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "prelude-manager.h"
+#include "pmsg-to-idmef.h"
+#include <libprelude/idmef-message-id.h>
+
+
+int pre_decode_LTX_prelude_plugin_version(void);
+int pre_decode_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *data);
+
+
+typedef struct {
+        prelude_list_t list;
+        char *value;
+        size_t len;
+} string_elem_t;
+
+
+/*
+ * Predicates checked on the raw message, all of them have to match
+ * for the message to be decoded.
+ */
+typedef struct {
+        prelude_bool_t have_type;
+        uint8_t type;
+
+        prelude_msg_priority_t priority;
+        uint32_t require;
+        char *require_str;
+
+        prelude_list_t exclude_analyzerid;
+        prelude_list_t exclude_classification;
+
+        manager_filter_hook_t *hook;
+} filter_plugin_t;
+
+
+
+static manager_filter_plugin_t filter_plugin;
+
+
+
+static prelude_bool_t match_string(prelude_list_t *head, const char *str, prelude_bool_t prefix)
+{
+        prelude_list_t *tmp;
+        string_elem_t *elem;
+
+        prelude_list_for_each(head, tmp) {
+                elem = prelude_list_entry(tmp, string_elem_t, list);
+
+                if ( prefix && strncmp(str, elem->value, elem->len) == 0 )
+                        return TRUE;
+
+                if ( ! prefix && strcmp(str, elem->value) == 0 )
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
+
+
+static int process_message(manager_raw_message_t *raw, void *priv)
+{
+        filter_plugin_t *plugin = priv;
+
+        if ( plugin->have_type && raw->type != plugin->type )
+                return -1;
+
+        if ( prelude_msg_get_priority(raw->msg) < plugin->priority )
+                return -1;
+
+        if ( (raw->children & plugin->require) != plugin->require )
+                return -1;
+
+        if ( raw->analyzerid && match_string(&plugin->exclude_analyzerid, raw->analyzerid, FALSE) )
+                return -1;
+
+        if ( raw->classification_text && match_string(&plugin->exclude_classification, raw->classification_text, TRUE) )
+                return -1;
+
+        return 0;
+}
+
+
+
+static int add_string(prelude_list_t *head, const char *str)
+{
+        string_elem_t *elem;
+
+        elem = malloc(sizeof(*elem));
+        if ( ! elem )
+                return prelude_error_from_errno(errno);
+
+        elem->value = strdup(str);
+        if ( ! elem->value ) {
+                free(elem);
+                return prelude_error_from_errno(errno);
+        }
+
+        elem->len = strlen(str);
+        prelude_list_add_tail(head, &elem->list);
+
+        return 0;
+}
+
+
+
+static void destroy_strings(prelude_list_t *head)
+{
+        string_elem_t *elem;
+        prelude_list_t *tmp, *bkp;
+
+        prelude_list_for_each_safe(head, tmp, bkp) {
+                elem = prelude_list_entry(tmp, string_elem_t, list);
+
+                prelude_list_del(&elem->list);
+                free(elem->value);
+                free(elem);
+        }
+}
+
+
+
+static int get_strings(prelude_list_t *head, prelude_string_t *out, const char *sep)
+{
+        int ret;
+        prelude_list_t *tmp;
+        string_elem_t *elem;
+
+        prelude_list_for_each(head, tmp) {
+                elem = prelude_list_entry(tmp, string_elem_t, list);
+
+                if ( ! prelude_string_is_empty(out) ) {
+                        ret = prelude_string_cat(out, sep);
+                        if ( ret < 0 )
+                                return ret;
+                }
+
+                ret = prelude_string_cat(out, elem->value);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        return 0;
+}
+
+
+
+static int get_filter_type(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        if ( ! plugin->have_type )
+                return 0;
+
+        return prelude_string_cat(out, (plugin->type == IDMEF_MSG_ALERT_TAG) ? "alert" : "heartbeat");
+}
+
+
+
+static int set_filter_type(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        if ( strcasecmp(optarg, "alert") == 0 )
+                plugin->type = IDMEF_MSG_ALERT_TAG;
+
+        else if ( strcasecmp(optarg, "heartbeat") == 0 )
+                plugin->type = IDMEF_MSG_HEARTBEAT_TAG;
+
+        else {
+                prelude_string_sprintf(err, "unknown message type '%s'", optarg);
+                return -1;
+        }
+
+        plugin->have_type = TRUE;
+
+        return 0;
+}
+
+
+
+static int get_filter_priority(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+        static const char *name[] = { "none", "low", "mid", "high" };
+
+        if ( plugin->priority >= sizeof(name) / sizeof(*name) )
+                return 0;
+
+        return prelude_string_cat(out, name[plugin->priority]);
+}
+
+
+
+static int set_filter_priority(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        if ( strcasecmp(optarg, "low") == 0 )
+                plugin->priority = PRELUDE_MSG_PRIORITY_LOW;
+
+        else if ( strcasecmp(optarg, "mid") == 0 )
+                plugin->priority = PRELUDE_MSG_PRIORITY_MID;
+
+        else if ( strcasecmp(optarg, "high") == 0 )
+                plugin->priority = PRELUDE_MSG_PRIORITY_HIGH;
+
+        else {
+                prelude_string_sprintf(err, "unknown message priority '%s'", optarg);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+
+static int get_filter_require(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        if ( ! plugin->require_str )
+                return 0;
+
+        return prelude_string_cat(out, plugin->require_str);
+}
+
+
+
+static int set_filter_require(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
+{
+        char *ptr, *start, *dup;
+        uint32_t bit, require = 0;
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        start = dup = strdup(optarg);
+        if ( ! dup )
+                return prelude_error_from_errno(errno);
+
+        while ( (ptr = strsep(&dup, ", ")) ) {
+                if ( ! *ptr )
+                        continue;
+
+                bit = pmsg_to_idmef_get_child_mask(ptr);
+                if ( ! bit ) {
+                        prelude_string_sprintf(err, "'%s' is not an alert child that can be required", ptr);
+                        free(start);
+                        return -1;
+                }
+
+                require |= bit;
+        }
+
+        free(start);
+
+        if ( plugin->require_str )
+                free(plugin->require_str);
+
+        plugin->require_str = strdup(optarg);
+        if ( ! plugin->require_str )
+                return prelude_error_from_errno(errno);
+
+        plugin->require = require;
+
+        return 0;
+}
+
+
+
+static int get_filter_exclude_analyzerid(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+        return get_strings(&plugin->exclude_analyzerid, out, ", ");
+}
+
+
+
+static int set_filter_exclude_analyzerid(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
+{
+        int ret = 0;
+        char *ptr, *start, *dup;
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+
+        start = dup = strdup(optarg);
+        if ( ! dup )
+                return prelude_error_from_errno(errno);
+
+        destroy_strings(&plugin->exclude_analyzerid);
+
+        while ( (ptr = strsep(&dup, ", ")) ) {
+                if ( ! *ptr )
+                        continue;
+
+                ret = add_string(&plugin->exclude_analyzerid, ptr);
+                if ( ret < 0 )
+                        break;
+        }
+
+        free(start);
+
+        return ret;
+}
+
+
+
+static int get_filter_exclude_classification(prelude_option_t *opt, prelude_string_t *out, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+        return get_strings(&plugin->exclude_classification, out, " | ");
+}
+
+
+
+/*
+ * Classification texts might hold any character: each occurrence of
+ * the option add a prefix.
+ */
+static int set_filter_exclude_classification(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(context);
+        return add_string(&plugin->exclude_classification, optarg);
+}
+
+
+
+static int filter_activate(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
+{
+        int ret;
+        filter_plugin_t *new;
+
+        new = calloc(1, sizeof(*new));
+        if ( ! new )
+                return prelude_error_from_errno(errno);
+
+        prelude_list_init(&new->exclude_analyzerid);
+        prelude_list_init(&new->exclude_classification);
+
+        ret = manager_filter_new_hook(&new->hook, context, MANAGER_FILTER_CATEGORY_PRE_DECODE, NULL, new);
+        if ( ret < 0 ) {
+                free(new);
+                return ret;
+        }
+
+        prelude_plugin_instance_set_plugin_data(context, new);
+
+        return 0;
+}
+
+
+
+static void filter_destroy(prelude_plugin_instance_t *pi, prelude_string_t *out)
+{
+        filter_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
+
+        if ( plugin->hook )
+                manager_filter_destroy_hook(plugin->hook);
+
+        destroy_strings(&plugin->exclude_analyzerid);
+        destroy_strings(&plugin->exclude_classification);
+
+        if ( plugin->require_str )
+                free(plugin->require_str);
+
+        free(plugin);
+}
+
+
+
+
+int pre_decode_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *root_opt)
+{
+        int ret;
+        prelude_option_t *opt;
+
+        ret = prelude_option_add(root_opt, &opt, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG
+                                 |PRELUDE_OPTION_TYPE_WIDE, 0, "pre-decode",
+                                 "Filter message before they are decoded", PRELUDE_OPTION_ARGUMENT_OPTIONAL,
+                                 filter_activate, NULL);
+        if ( ret < 0 )
+                return ret;
+
+        prelude_option_set_priority(opt, PRELUDE_OPTION_PRIORITY_LAST);
+        prelude_plugin_set_activation_option(pe, opt, NULL);
+
+        ret = prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG
+                                 |PRELUDE_OPTION_TYPE_WIDE, 't', "type",
+                                 "Only decode messages of this type (alert|heartbeat)", PRELUDE_OPTION_ARGUMENT_REQUIRED,
+                                 set_filter_type, get_filter_type);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG
+                                 |PRELUDE_OPTION_TYPE_WIDE, 'p', "priority",
+                                 "Minimum message priority (low|mid|high)", PRELUDE_OPTION_ARGUMENT_REQUIRED,
+                                 set_filter_priority, get_filter_priority);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG
+                                 |PRELUDE_OPTION_TYPE_WIDE, 'r', "require",
+                                 "Comma separated alert children that must be present", PRELUDE_OPTION_ARGUMENT_REQUIRED,
+                                 set_filter_require, get_filter_require);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG
+                                 |PRELUDE_OPTION_TYPE_WIDE, 'a', "exclude-analyzerid",
+                                 "Comma separated analyzerid whose messages are dropped", PRELUDE_OPTION_ARGUMENT_REQUIRED,
+                                 set_filter_exclude_analyzerid, get_filter_exclude_analyzerid);
+        if ( ret < 0 )
+                return ret;
+
+        ret = prelude_option_add(opt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG
+                                 |PRELUDE_OPTION_TYPE_WIDE, 'c', "exclude-classification",
+                                 "Drop alerts whose classification text start with this prefix",
+                                 PRELUDE_OPTION_ARGUMENT_REQUIRED,
+                                 set_filter_exclude_classification, get_filter_exclude_classification);
+        if ( ret < 0 )
+                return ret;
+
+        prelude_plugin_set_name(&filter_plugin, "Pre-Decode");
+        prelude_plugin_set_destroy_func(&filter_plugin, filter_destroy);
+        manager_filter_plugin_set_raw_running_func(&filter_plugin, process_message);
+        manager_filter_plugin_set_concurrency(&filter_plugin, MANAGER_PLUGIN_CONCURRENCY_REENTRANT);
+
+        prelude_plugin_entry_set_plugin(pe, (void *) &filter_plugin);
+
+        return 0;
+}
+
+
+
+int pre_decode_LTX_prelude_plugin_version(void)
+{
+        return PRELUDE_PLUGIN_API_VERSION;
+}
@@ -240,7 +240,7 @@ static int process_message(idmef_message_t *msg, void *priv)
         prelude_string_t *key;
         filter_plugin_t *plugin = priv;
 
-        ret = prelude_string_new(&key);
+        ret = manager_message_string_new(&key);
         if ( ret < 0 )
                 return 0;
 
@@ -255,8 +255,6 @@ static int process_message(idmef_message_t *msg, void *priv)
         if ( ! prelude_string_is_empty(key) )
                 ret = check_filter(plugin, prelude_string_get_string(key));
 
-        prelude_string_destroy(key);
-
         return ret;
 }
 
@@ -295,6 +295,7 @@ int db_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *rootopt)
         prelude_plugin_set_name(&db_plugin, "db");
         prelude_plugin_set_destroy_func(&db_plugin, db_destroy);
         manager_report_plugin_set_running_func(&db_plugin, db_run);
+        manager_report_plugin_set_concurrency(&db_plugin, MANAGER_PLUGIN_CONCURRENCY_INSTANCE);
 
         prelude_plugin_entry_set_plugin(pe, (void *) &db_plugin);
 
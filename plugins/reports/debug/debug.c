@@ -67,7 +67,7 @@ static int iterator(idmef_value_t *val, void *extra)
         prelude_string_t *out;
         struct iterator_data *data = extra;
 
-        ret = prelude_string_new(&out);
+        ret = manager_message_string_new(&out);
         if ( ret < 0 ) {
                 prelude_perror(ret, "error creating string object");
                 return -1;
@@ -88,7 +88,6 @@ static int iterator(idmef_value_t *val, void *extra)
         prelude_string_cat(out, "\n");
 
         prelude_io_write(data->plugin->fd, prelude_string_get_string(out), prelude_string_get_len(out));
-        prelude_string_destroy(out);
 
         return 0;
 }
@@ -319,6 +318,7 @@ int debug_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *rootopt)
         prelude_plugin_set_name(&debug_plugin, "Debug");
         prelude_plugin_set_destroy_func(&debug_plugin, debug_destroy);
         manager_report_plugin_set_running_func(&debug_plugin, debug_run);
+        manager_report_plugin_set_concurrency(&debug_plugin, MANAGER_PLUGIN_CONCURRENCY_INSTANCE);
 
         prelude_plugin_entry_set_plugin(pe, (void *) &debug_plugin);
 
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 
 #include "prelude-manager.h"
+#include "pmsg-to-idmef.h"
 
 
 int relaying_LTX_prelude_plugin_version(void);
@@ -39,14 +40,13 @@ typedef struct {
 
 
 
-static prelude_msgbuf_t *msgbuf = NULL;
 extern prelude_client_t *manager_client;
 
 
 
-static int send_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+static int send_msg(prelude_msg_t *msg, void *data)
 {
-        prelude_connection_pool_t *pool = prelude_msgbuf_get_data(msgbuf);
+        prelude_connection_pool_t *pool = data;
 
         prelude_connection_pool_broadcast(pool, msg);
 
@@ -57,26 +57,12 @@ static int send_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
 
 static int relaying_process(prelude_plugin_instance_t *pi, idmef_message_t *idmef)
 {
-        int ret;
         relaying_plugin_t *plugin = prelude_plugin_instance_get_plugin_data(pi);
 
         if ( ! plugin->conn_pool )
                 return 0;
 
-        if ( ! msgbuf ) {
-                ret = prelude_msgbuf_new(&msgbuf);
-                if ( ret < 0 )
-                        return ret;
-
-                prelude_msgbuf_set_callback(msgbuf, send_msgbuf);
-        }
-
-        prelude_msgbuf_set_data(msgbuf, plugin->conn_pool);
-
-        idmef_message_write(idmef, msgbuf);
-        prelude_msgbuf_mark_end(msgbuf);
-
-        return 0;
+        return pmsg_forward(idmef, send_msg, plugin->conn_pool);
 }
 
 
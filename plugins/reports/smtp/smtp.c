@@ -542,7 +542,7 @@ static int send_correlation_alert_info(smtp_plugin_t *plugin, idmef_message_t *i
         if ( ! calert )
                 return 0;
 
-        ret = prelude_string_new(&criteria);
+        ret = manager_message_string_new(&criteria);
         if ( ret < 0 )
                 return ret;
 
@@ -570,8 +570,6 @@ static int send_correlation_alert_info(smtp_plugin_t *plugin, idmef_message_t *i
         if ( ! prelude_string_is_empty(criteria) )
                 ret = retrieve_from_db(plugin, prelude_string_get_string(criteria));
 
-        prelude_string_destroy(criteria);
-
         return ret;
 }
 
@@ -746,32 +744,25 @@ static int smtp_run(prelude_plugin_instance_t *pi, idmef_message_t *idmef)
         if ( ret < 0 )
                 return ret;
 
-        ret = prelude_string_new(&subject);
+        ret = manager_message_string_new(&subject);
         if ( ret < 0 )
                 return ret;
 
         ret = get_subject(plugin, idmef, subject);
         if ( ret < 0 )
-                goto out;
+                return ret;
 
         if ( ! prelude_list_is_empty(&plugin->message_content) ) {
-                ret = prelude_string_new(&body);
+                ret = manager_message_string_new(&body);
                 if ( ret < 0 )
-                        goto out;
+                        return ret;
 
                 ret = build_dynamic_string(body, &plugin->message_content, idmef);
                 if ( ret < 0 )
-                        goto out;
+                        return ret;
         }
 
-        ret = send_mail(plugin, prelude_string_get_string(subject), body, idmef);
-
-out:
-        prelude_string_destroy(subject);
-        if ( body )
-                prelude_string_destroy(body);
-
-        return ret;
+        return send_mail(plugin, prelude_string_get_string(subject), body, idmef);
 }
 
 
@@ -910,6 +910,7 @@ int textmod_LTX_manager_plugin_init(prelude_plugin_entry_t *pe, void *rootopt)
         prelude_plugin_set_name(&textmod_plugin, "TextMod");
         prelude_plugin_set_destroy_func(&textmod_plugin, textmod_destroy);
         manager_report_plugin_set_running_func(&textmod_plugin, textmod_run);
+        manager_report_plugin_set_concurrency(&textmod_plugin, MANAGER_PLUGIN_CONCURRENCY_INSTANCE);
 
         prelude_plugin_entry_set_plugin(pe, (void *) &textmod_plugin);
         
@@ -0,0 +1,379 @@
+/*****
+*
+* Copyright (C) 2008 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+/*
+ * Spill to a single append-only file, starting with the offset of the
+ * first unread message. The offset is saved as reading progress, and
+ * after each write, so that a crash only replay the messages read
+ * since it was last saved.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-io.h>
+#include <libprelude/prelude-extract.h>
+
+#include "bufpool-backend.h"
+
+
+#define SPILL_HEADER_SIZE sizeof(uint64_t)
+
+/*
+ * The read offset is saved whenever the reader moved this far.
+ */
+#define SPILL_OFFSET_INTERVAL (64 * 1024)
+
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+
+
+typedef struct {
+        int wfd;
+        prelude_io_t *rio;
+
+        /*
+         * The header can't be written through wfd, which append.
+         */
+        int hfd;
+
+        /*
+         * End of the last completely written message.
+         */
+        off_t woff;
+
+        /*
+         * Read offset, and its value last saved in the header. Written
+         * by the reader, looked at by the spill writer.
+         */
+        off_t roff;
+        off_t roff_saved;
+} spill_file_t;
+
+
+
+static void save_read_offset(spill_file_t *sf, off_t roff)
+{
+        uint64_t offset = prelude_hton64(roff);
+
+        if ( pwrite(sf->hfd, &offset, sizeof(offset), 0) != sizeof(offset) ) {
+                prelude_log(PRELUDE_LOG_ERR, "could not save spill read offset: %s.\n", strerror(errno));
+                return;
+        }
+
+        __atomic_store_n(&sf->roff_saved, roff, __ATOMIC_RELAXED);
+}
+
+
+
+static int file_open(void **handle, const char *filename)
+{
+        int ret, rfd;
+        spill_file_t *sf;
+        uint64_t offset = prelude_hton64(SPILL_HEADER_SIZE);
+
+        sf = calloc(1, sizeof(*sf));
+        if ( ! sf )
+                return prelude_error_from_errno(errno);
+
+        sf->wfd = open(filename, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, S_IRUSR|S_IWUSR);
+        if ( sf->wfd < 0 ) {
+                ret = prelude_error_from_errno(errno);
+                free(sf);
+                return ret;
+        }
+
+        if ( write(sf->wfd, &offset, sizeof(offset)) != sizeof(offset) )
+                goto err;
+
+        sf->hfd = open(filename, O_WRONLY);
+        if ( sf->hfd < 0 )
+                goto err;
+
+        rfd = open(filename, O_RDONLY);
+        if ( rfd < 0 )
+                goto err_hfd;
+
+        if ( lseek(rfd, SPILL_HEADER_SIZE, SEEK_SET) < 0 || prelude_io_new(&sf->rio) < 0 ) {
+                close(rfd);
+                goto err_hfd;
+        }
+
+        prelude_io_set_sys_io(sf->rio, rfd);
+        sf->woff = sf->roff = sf->roff_saved = SPILL_HEADER_SIZE;
+
+        *handle = sf;
+        return 0;
+
+ err_hfd:
+        close(sf->hfd);
+ err:
+        ret = prelude_error_from_errno(errno);
+        close(sf->wfd);
+        unlink(filename);
+        free(sf);
+
+        return ret;
+}
+
+
+
+/*
+ * Write messages with as few syscall as possible. On failure, the
+ * partially written message is truncated away.
+ */
+static size_t file_write(void *handle, prelude_list_t *batch)
+{
+        off_t roff;
+        ssize_t ret;
+        prelude_msg_t *msg;
+        prelude_list_t *tmp;
+        spill_file_t *sf = handle;
+        struct iovec iov[IOV_MAX];
+        size_t i, iovcnt = 0, written = 0, partial = 0;
+
+        tmp = batch->next;
+
+        while ( tmp != batch || iovcnt ) {
+
+                while ( tmp != batch && iovcnt < IOV_MAX ) {
+                        msg = prelude_linked_object_get_object(tmp);
+
+                        iov[iovcnt].iov_base = (void *) prelude_msg_get_message_data(msg);
+                        iov[iovcnt].iov_len = prelude_msg_get_len(msg);
+
+                        iovcnt++;
+                        tmp = tmp->next;
+                }
+
+                ret = writev(sf->wfd, iov, iovcnt);
+                if ( ret < 0 ) {
+                        if ( errno == EINTR )
+                                continue;
+
+                        prelude_log(PRELUDE_LOG_ERR, "spill write failure: %s.\n", strerror(errno));
+
+                        if ( partial && ftruncate(sf->wfd, sf->woff) < 0 )
+                                prelude_log(PRELUDE_LOG_ERR, "could not truncate partial spill write: %s.\n", strerror(errno));
+                        break;
+                }
+
+                /*
+                 * Skip what was written, and retry partial write.
+                 */
+                for ( i = 0; i < iovcnt && (size_t) ret >= iov[i].iov_len; i++ ) {
+                        ret -= iov[i].iov_len;
+                        sf->woff += iov[i].iov_len + partial;
+                        partial = 0;
+                        written++;
+                }
+
+                if ( i < iovcnt ) {
+                        iov[i].iov_base = (unsigned char *) iov[i].iov_base + ret;
+                        iov[i].iov_len -= ret;
+                        partial += ret;
+                }
+
+                memmove(iov, &iov[i], (iovcnt - i) * sizeof(*iov));
+                iovcnt -= i;
+        }
+
+        roff = __atomic_load_n(&sf->roff, __ATOMIC_RELAXED);
+        if ( roff != __atomic_load_n(&sf->roff_saved, __ATOMIC_RELAXED) )
+                save_read_offset(sf, roff);
+
+        return written;
+}
+
+
+
+static void set_read_offset(spill_file_t *sf, off_t roff)
+{
+        if ( roff < 0 )
+                return;
+
+        __atomic_store_n(&sf->roff, roff, __ATOMIC_RELAXED);
+
+        if ( roff - __atomic_load_n(&sf->roff_saved, __ATOMIC_RELAXED) >= SPILL_OFFSET_INTERVAL )
+                save_read_offset(sf, roff);
+}
+
+
+
+static int file_read(void *handle, prelude_msg_t **msg)
+{
+        int ret;
+        spill_file_t *sf = handle;
+
+        *msg = NULL;
+
+        ret = prelude_msg_read(msg, sf->rio);
+        if ( ret >= 0 )
+                set_read_offset(sf, lseek(prelude_io_get_fd(sf->rio), 0, SEEK_CUR));
+
+        return ret;
+}
+
+
+
+static void file_skip(void *handle)
+{
+        spill_file_t *sf = handle;
+
+        set_read_offset(sf, lseek(prelude_io_get_fd(sf->rio), 0, SEEK_END));
+}
+
+
+
+/*
+ * Nothing is left to read: truncate the file rather than letting it
+ * grow for as long as the pool stay on disk.
+ */
+static void file_reset(void *handle)
+{
+        spill_file_t *sf = handle;
+
+        if ( sf->woff == SPILL_HEADER_SIZE )
+                return;
+
+        if ( ftruncate(sf->wfd, SPILL_HEADER_SIZE) < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "could not truncate spill file: %s.\n", strerror(errno));
+                return;
+        }
+
+        sf->woff = SPILL_HEADER_SIZE;
+        lseek(prelude_io_get_fd(sf->rio), SPILL_HEADER_SIZE, SEEK_SET);
+
+        __atomic_store_n(&sf->roff, SPILL_HEADER_SIZE, __ATOMIC_RELAXED);
+        save_read_offset(sf, SPILL_HEADER_SIZE);
+}
+
+
+
+static void file_sync(void *handle)
+{
+        spill_file_t *sf = handle;
+        fsync(sf->wfd);
+}
+
+
+
+static void file_close(void *handle, const char *filename, prelude_bool_t keep)
+{
+        spill_file_t *sf = handle;
+
+        if ( keep )
+                save_read_offset(sf, lseek(prelude_io_get_fd(sf->rio), 0, SEEK_CUR));
+
+        close(sf->hfd);
+        close(sf->wfd);
+        prelude_io_close(sf->rio);
+        prelude_io_destroy(sf->rio);
+
+        if ( ! keep )
+                unlink(filename);
+
+        free(sf);
+}
+
+
+
+static prelude_bool_t file_is_spill(const char *path)
+{
+        struct stat st;
+        return ( stat(path, &st) == 0 && S_ISREG(st.st_mode) ) ? TRUE : FALSE;
+}
+
+
+
+static ssize_t file_recover(const char *filename, void (*cb)(prelude_msg_t *msg, void *data), void *data)
+{
+        int fd, ret;
+        ssize_t count = 0;
+        prelude_io_t *pio;
+        prelude_msg_t *msg;
+        uint64_t offset;
+
+        fd = open(filename, O_RDONLY);
+        if ( fd < 0 )
+                return prelude_error_from_errno(errno);
+
+        if ( read(fd, &offset, sizeof(offset)) != sizeof(offset) ||
+             lseek(fd, prelude_extract_uint64(&offset), SEEK_SET) < 0 ) {
+                close(fd);
+                unlink(filename);
+                return 0;
+        }
+
+        ret = prelude_io_new(&pio);
+        if ( ret < 0 ) {
+                close(fd);
+                return ret;
+        }
+
+        prelude_io_set_sys_io(pio, fd);
+
+        do {
+                msg = NULL;
+
+                ret = prelude_msg_read(&msg, pio);
+                if ( ret < 0 )
+                        break;
+
+                cb(msg, data);
+                count++;
+        } while ( 1 );
+
+        prelude_io_close(pio);
+        prelude_io_destroy(pio);
+
+        unlink(filename);
+
+        return count;
+}
+
+
+
+const bufpool_backend_t bufpool_file_backend = {
+        "file",
+        file_open,
+        file_write,
+        file_read,
+        file_skip,
+        file_reset,
+        file_sync,
+        file_close,
+        file_is_spill,
+        file_recover
+};
@@ -0,0 +1,736 @@
+/*****
+*
+* Copyright (C) 2008 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+/*
+ * Spill to a log of fixed size, memory mapped segment files stored in
+ * a directory. Each segment start with a small header recording how
+ * far it was written and read, so that a segment is self describing
+ * and recovery does not need anything else.
+ *
+ * Fully read segments are recycled by renaming them, instead of being
+ * removed and recreated. Once the log is closed without anything left
+ * to read, the directory is removed with its free segments, which
+ * would otherwise stay on disk unaccounted.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-io.h>
+
+#include "glthread/lock.h"
+#include "bufpool-backend.h"
+
+
+#define SEGMENT_MAGIC 0x50534547
+#define SEGMENT_VERSION 1
+#define SEGMENT_SIZE (4 * 1024 * 1024)
+
+/*
+ * Keep at most this number of free segments around for reuse.
+ */
+#define SEGMENT_FREE_MAX 2
+
+#define SEGMENT_PREFIX "segment."
+#define SEGMENT_FREE_PREFIX "free."
+
+
+typedef struct {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t size;
+
+        /*
+         * Write offset is only advanced once a message is complete,
+         * read offset point to the first unread message.
+         */
+        uint64_t wpos;
+        uint64_t rpos;
+} segment_header_t;
+
+
+typedef struct {
+        prelude_list_t list;
+
+        int fd;
+        uint64_t seq;
+        prelude_bool_t sealed;
+
+        size_t size;
+        unsigned char *base;
+        segment_header_t *hdr;
+} segment_t;
+
+
+typedef struct {
+        char *dirname;
+        uint64_t seq;
+
+        /*
+         * The list is appended to by the writer, and consumed by the
+         * reader: both take the mutex to modify it.
+         */
+        gl_lock_t mutex;
+        prelude_list_t segments;
+        prelude_list_t free_segments;
+        unsigned int free_count;
+
+        segment_t *wseg;
+        segment_t *rseg;
+
+        FILE *rfp;
+        prelude_io_t *rio;
+} segment_log_t;
+
+
+
+static void segment_path(char *buf, size_t size, const char *dirname, const char *prefix, uint64_t seq)
+{
+        snprintf(buf, size, "%s/%s%" PRELUDE_PRIu64, dirname, prefix, seq);
+}
+
+
+
+static int segment_map(segment_t *seg, int prot)
+{
+        seg->base = mmap(NULL, seg->size, prot, MAP_SHARED, seg->fd, 0);
+        if ( seg->base == MAP_FAILED ) {
+                seg->base = NULL;
+                return prelude_error_from_errno(errno);
+        }
+
+        seg->hdr = (segment_header_t *) seg->base;
+
+        return 0;
+}
+
+
+
+static void segment_destroy(segment_t *seg)
+{
+        if ( seg->base )
+                munmap(seg->base, seg->size);
+
+        if ( seg->fd >= 0 )
+                close(seg->fd);
+
+        free(seg);
+}
+
+
+
+static void segment_reset(segment_t *seg, uint64_t seq)
+{
+        seg->seq = seq;
+        seg->sealed = FALSE;
+
+        seg->hdr->magic = SEGMENT_MAGIC;
+        seg->hdr->version = SEGMENT_VERSION;
+        seg->hdr->size = seg->size;
+        seg->hdr->rpos = seg->hdr->wpos = sizeof(segment_header_t);
+}
+
+
+
+/*
+ * Return a segment able to hold at least len bytes of data, reusing
+ * a free one when possible.
+ */
+static segment_t *segment_get(segment_log_t *log, size_t len)
+{
+        int ret;
+        segment_t *seg;
+        char path[PATH_MAX], fpath[PATH_MAX];
+        uint64_t seq = log->seq++;
+        long pagesize = sysconf(_SC_PAGESIZE);
+
+        gl_lock_lock(log->mutex);
+
+        if ( len <= SEGMENT_SIZE - sizeof(segment_header_t) && ! prelude_list_is_empty(&log->free_segments) ) {
+                seg = prelude_list_entry(log->free_segments.next, segment_t, list);
+
+                segment_path(fpath, sizeof(fpath), log->dirname, SEGMENT_FREE_PREFIX, seg->seq);
+                segment_path(path, sizeof(path), log->dirname, SEGMENT_PREFIX, seq);
+
+                if ( rename(fpath, path) == 0 ) {
+                        prelude_list_del(&seg->list);
+                        log->free_count--;
+                        gl_lock_unlock(log->mutex);
+
+                        segment_reset(seg, seq);
+                        return seg;
+                }
+        }
+
+        gl_lock_unlock(log->mutex);
+
+        seg = calloc(1, sizeof(*seg));
+        if ( ! seg ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return NULL;
+        }
+
+        /*
+         * Message bigger than a segment get a dedicated one.
+         */
+        seg->size = len + sizeof(segment_header_t);
+        seg->size = (seg->size < SEGMENT_SIZE) ? SEGMENT_SIZE : (seg->size + pagesize - 1) & ~(pagesize - 1);
+
+        segment_path(path, sizeof(path), log->dirname, SEGMENT_PREFIX, seq);
+
+        seg->fd = open(path, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+        if ( seg->fd < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "could not create segment '%s': %s.\n", path, strerror(errno));
+                free(seg);
+                return NULL;
+        }
+
+#ifdef HAVE_POSIX_FALLOCATE
+        ret = posix_fallocate(seg->fd, 0, seg->size);
+        if ( ret != 0 )
+                errno = ret;
+#else
+        ret = ftruncate(seg->fd, seg->size);
+#endif
+        if ( ret != 0 || segment_map(seg, PROT_READ|PROT_WRITE) < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "could not allocate segment '%s': %s.\n", path, strerror(errno));
+                unlink(path);
+                segment_destroy(seg);
+                return NULL;
+        }
+
+        segment_reset(seg, seq);
+
+        return seg;
+}
+
+
+
+/*
+ * Called with log->mutex held, once seg is sealed and fully read.
+ */
+static void segment_release(segment_log_t *log, segment_t *seg)
+{
+        char path[PATH_MAX], fpath[PATH_MAX];
+
+        prelude_list_del(&seg->list);
+        segment_path(path, sizeof(path), log->dirname, SEGMENT_PREFIX, seg->seq);
+
+        if ( seg->size == SEGMENT_SIZE && log->free_count < SEGMENT_FREE_MAX ) {
+                segment_path(fpath, sizeof(fpath), log->dirname, SEGMENT_FREE_PREFIX, seg->seq);
+
+                if ( rename(path, fpath) == 0 ) {
+                        prelude_list_add_tail(&log->free_segments, &seg->list);
+                        log->free_count++;
+                        return;
+                }
+        }
+
+        unlink(path);
+        segment_destroy(seg);
+}
+
+
+
+static void remove_segments(const char *dirname, prelude_bool_t all)
+{
+        DIR *dir;
+        struct dirent *de;
+        char path[PATH_MAX];
+
+        dir = opendir(dirname);
+        if ( ! dir )
+                return;
+
+        while ( (de = readdir(dir)) ) {
+                if ( strncmp(de->d_name, SEGMENT_FREE_PREFIX, sizeof(SEGMENT_FREE_PREFIX) - 1) != 0 &&
+                     (! all || strncmp(de->d_name, SEGMENT_PREFIX, sizeof(SEGMENT_PREFIX) - 1) != 0) )
+                        continue;
+
+                snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+                unlink(path);
+        }
+
+        closedir(dir);
+
+        if ( all )
+                rmdir(dirname);
+}
+
+
+
+static int segment_open(void **handle, const char *filename)
+{
+        int ret;
+        segment_log_t *log;
+
+        log = calloc(1, sizeof(*log));
+        if ( ! log )
+                return prelude_error_from_errno(errno);
+
+        log->dirname = strdup(filename);
+        if ( ! log->dirname ) {
+                free(log);
+                return prelude_error_from_errno(errno);
+        }
+
+        ret = prelude_io_new(&log->rio);
+        if ( ret < 0 ) {
+                free(log->dirname);
+                free(log);
+                return ret;
+        }
+
+        if ( mkdir(filename, S_IRWXU) < 0 && errno != EEXIST ) {
+                ret = prelude_error_from_errno(errno);
+                prelude_io_destroy(log->rio);
+                free(log->dirname);
+                free(log);
+                return ret;
+        }
+
+        gl_lock_init(log->mutex);
+        prelude_list_init(&log->segments);
+        prelude_list_init(&log->free_segments);
+
+        log->wseg = segment_get(log, 0);
+        if ( ! log->wseg ) {
+                remove_segments(filename, TRUE);
+                prelude_io_destroy(log->rio);
+                gl_lock_destroy(log->mutex);
+                free(log->dirname);
+                free(log);
+                return -1;
+        }
+
+        log->rseg = log->wseg;
+        prelude_list_add_tail(&log->segments, &log->wseg->list);
+
+        *handle = log;
+        return 0;
+}
+
+
+
+/*
+ * Messages are copied in the mapping, the write offset being
+ * published once a message is complete.
+ */
+static size_t segment_write(void *handle, prelude_list_t *batch)
+{
+        size_t len;
+        segment_t *seg;
+        prelude_msg_t *msg;
+        prelude_list_t *tmp;
+        size_t written = 0;
+        segment_log_t *log = handle;
+
+        prelude_list_for_each(batch, tmp) {
+                msg = prelude_linked_object_get_object(tmp);
+                len = prelude_msg_get_len(msg);
+
+                seg = log->wseg;
+
+                if ( seg->hdr->wpos + len > seg->size ) {
+                        seg = segment_get(log, len);
+                        if ( ! seg )
+                                break;
+
+                        gl_lock_lock(log->mutex);
+                        prelude_list_add_tail(&log->segments, &seg->list);
+                        __atomic_store_n(&log->wseg->sealed, TRUE, __ATOMIC_RELEASE);
+                        log->wseg = seg;
+                        gl_lock_unlock(log->mutex);
+                }
+
+                memcpy(seg->base + seg->hdr->wpos, prelude_msg_get_message_data(msg), len);
+                __atomic_store_n(&seg->hdr->wpos, seg->hdr->wpos + len, __ATOMIC_RELEASE);
+
+                written++;
+        }
+
+        return written;
+}
+
+
+
+/*
+ * Point the reader stream at the current read segment.
+ */
+static int segment_read_setup(segment_log_t *log)
+{
+        segment_t *seg = log->rseg;
+
+        log->rfp = fmemopen(seg->base, seg->size, "r");
+        if ( ! log->rfp )
+                return prelude_error_from_errno(errno);
+
+        setvbuf(log->rfp, NULL, _IONBF, 0);
+
+        if ( fseek(log->rfp, seg->hdr->rpos, SEEK_SET) < 0 ) {
+                fclose(log->rfp);
+                log->rfp = NULL;
+                return prelude_error_from_errno(errno);
+        }
+
+        prelude_io_set_file_io(log->rio, log->rfp);
+
+        return 0;
+}
+
+
+
+static void segment_read_close(segment_log_t *log)
+{
+        if ( ! log->rfp )
+                return;
+
+        prelude_io_close(log->rio);
+        log->rfp = NULL;
+}
+
+
+
+static int segment_read(void *handle, prelude_msg_t **msg)
+{
+        int ret;
+        segment_t *seg;
+        segment_log_t *log = handle;
+
+        *msg = NULL;
+
+        while ( 1 ) {
+                seg = log->rseg;
+
+                if ( seg->hdr->rpos < __atomic_load_n(&seg->hdr->wpos, __ATOMIC_ACQUIRE) )
+                        break;
+
+                if ( ! __atomic_load_n(&seg->sealed, __ATOMIC_ACQUIRE) )
+                        return prelude_error(PRELUDE_ERROR_EOF);
+
+                segment_read_close(log);
+
+                gl_lock_lock(log->mutex);
+                log->rseg = prelude_list_entry(seg->list.next, segment_t, list);
+                segment_release(log, seg);
+                gl_lock_unlock(log->mutex);
+        }
+
+        if ( ! log->rfp ) {
+                ret = segment_read_setup(log);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        ret = prelude_msg_read(msg, log->rio);
+        if ( ret < 0 ) {
+                segment_read_close(log);
+                return ret;
+        }
+
+        seg->hdr->rpos = ftell(log->rfp);
+
+        return ret;
+}
+
+
+
+static void segment_skip(void *handle)
+{
+        segment_t *seg;
+        segment_log_t *log = handle;
+
+        segment_read_close(log);
+
+        gl_lock_lock(log->mutex);
+
+        while ( (seg = log->rseg) != log->wseg ) {
+                log->rseg = prelude_list_entry(seg->list.next, segment_t, list);
+                segment_release(log, seg);
+        }
+
+        seg->hdr->rpos = seg->hdr->wpos;
+
+        gl_lock_unlock(log->mutex);
+}
+
+
+
+/*
+ * Nothing is left to read: release every segment but the write one,
+ * and rewind it.
+ */
+static void segment_rewind(void *handle)
+{
+        segment_log_t *log = handle;
+
+        segment_skip(handle);
+
+        gl_lock_lock(log->mutex);
+        log->wseg->hdr->rpos = log->wseg->hdr->wpos = sizeof(segment_header_t);
+        gl_lock_unlock(log->mutex);
+}
+
+
+
+static void segment_sync(void *handle)
+{
+        prelude_list_t *tmp;
+        segment_t *seg;
+        segment_log_t *log = handle;
+
+        gl_lock_lock(log->mutex);
+
+        prelude_list_for_each(&log->segments, tmp) {
+                seg = prelude_list_entry(tmp, segment_t, list);
+                msync(seg->base, seg->hdr->wpos, MS_SYNC);
+        }
+
+        gl_lock_unlock(log->mutex);
+}
+
+
+
+/*
+ * The read offset of each segment is already stored in its header,
+ * keeping the log only means leaving the segments in place. Otherwise
+ * every segment was read, and the whole directory is removed.
+ */
+static void segment_close(void *handle, const char *filename, prelude_bool_t keep)
+{
+        segment_t *seg;
+        prelude_list_t *tmp, *bkp;
+        segment_log_t *log = handle;
+
+        segment_read_close(log);
+        prelude_io_destroy(log->rio);
+
+        prelude_list_for_each_safe(&log->segments, tmp, bkp) {
+                seg = prelude_list_entry(tmp, segment_t, list);
+                prelude_list_del(&seg->list);
+                segment_destroy(seg);
+        }
+
+        prelude_list_for_each_safe(&log->free_segments, tmp, bkp) {
+                seg = prelude_list_entry(tmp, segment_t, list);
+                prelude_list_del(&seg->list);
+                segment_destroy(seg);
+        }
+
+        /*
+         * Free segments are clutter next to a log kept for recovery.
+         */
+        remove_segments(filename, ! keep);
+
+        gl_lock_destroy(log->mutex);
+        free(log->dirname);
+        free(log);
+}
+
+
+
+static prelude_bool_t segment_is_spill(const char *path)
+{
+        DIR *dir;
+        struct dirent *de;
+        prelude_bool_t found = FALSE;
+
+        dir = opendir(path);
+        if ( ! dir )
+                return FALSE;
+
+        while ( (de = readdir(dir)) && ! found ) {
+                if ( strncmp(de->d_name, SEGMENT_PREFIX, sizeof(SEGMENT_PREFIX) - 1) == 0 ||
+                     strncmp(de->d_name, SEGMENT_FREE_PREFIX, sizeof(SEGMENT_FREE_PREFIX) - 1) == 0 )
+                        found = TRUE;
+        }
+
+        closedir(dir);
+
+        return found;
+}
+
+
+
+static int seqcmp(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+        return (x > y) - (x < y);
+}
+
+
+
+static ssize_t recover_segment(const char *path, void (*cb)(prelude_msg_t *msg, void *data), void *data)
+{
+        int ret;
+        FILE *fp;
+        segment_t seg;
+        struct stat st;
+        ssize_t count = 0;
+        prelude_io_t *pio;
+        prelude_msg_t *msg;
+
+        seg.fd = open(path, O_RDONLY);
+        if ( seg.fd < 0 )
+                return prelude_error_from_errno(errno);
+
+        if ( fstat(seg.fd, &st) < 0 || (size_t) st.st_size < sizeof(segment_header_t) ) {
+                close(seg.fd);
+                return 0;
+        }
+
+        seg.size = st.st_size;
+
+        ret = segment_map(&seg, PROT_READ);
+        close(seg.fd);
+        if ( ret < 0 )
+                return ret;
+
+        if ( seg.hdr->magic != SEGMENT_MAGIC || seg.hdr->version != SEGMENT_VERSION ||
+             seg.hdr->size != seg.size || seg.hdr->wpos > seg.size || seg.hdr->rpos > seg.hdr->wpos ) {
+                prelude_log(PRELUDE_LOG_ERR, "segment '%s' is corrupted, ignoring it.\n", path);
+                munmap(seg.base, seg.size);
+                return 0;
+        }
+
+        ret = prelude_io_new(&pio);
+        if ( ret < 0 ) {
+                munmap(seg.base, seg.size);
+                return ret;
+        }
+
+        fp = fmemopen(seg.base, seg.hdr->wpos, "r");
+        if ( ! fp || fseek(fp, seg.hdr->rpos, SEEK_SET) < 0 ) {
+                ret = prelude_error_from_errno(errno);
+                if ( fp )
+                        fclose(fp);
+                prelude_io_destroy(pio);
+                munmap(seg.base, seg.size);
+                return ret;
+        }
+
+        setvbuf(fp, NULL, _IONBF, 0);
+        prelude_io_set_file_io(pio, fp);
+
+        do {
+                msg = NULL;
+
+                ret = prelude_msg_read(&msg, pio);
+                if ( ret < 0 )
+                        break;
+
+                cb(msg, data);
+                count++;
+        } while ( 1 );
+
+        prelude_io_close(pio);
+        prelude_io_destroy(pio);
+        munmap(seg.base, seg.size);
+
+        return count;
+}
+
+
+
+static ssize_t segment_recover(const char *dirname, void (*cb)(prelude_msg_t *msg, void *data), void *data)
+{
+        DIR *dir;
+        ssize_t ret, count = 0;
+        struct dirent *de;
+        uint64_t *seqs = NULL, *tmp;
+        size_t i, nseq = 0, alloc = 0;
+        char path[PATH_MAX];
+
+        dir = opendir(dirname);
+        if ( ! dir )
+                return prelude_error_from_errno(errno);
+
+        while ( (de = readdir(dir)) ) {
+                if ( strncmp(de->d_name, SEGMENT_PREFIX, sizeof(SEGMENT_PREFIX) - 1) != 0 )
+                        continue;
+
+                if ( nseq == alloc ) {
+                        alloc = alloc ? alloc * 2 : 16;
+
+                        tmp = realloc(seqs, alloc * sizeof(*seqs));
+                        if ( ! tmp ) {
+                                free(seqs);
+                                closedir(dir);
+                                return prelude_error_from_errno(errno);
+                        }
+
+                        seqs = tmp;
+                }
+
+                seqs[nseq++] = strtoull(de->d_name + sizeof(SEGMENT_PREFIX) - 1, NULL, 10);
+        }
+
+        closedir(dir);
+
+        /*
+         * Segments are replayed in the order they were written.
+         */
+        qsort(seqs, nseq, sizeof(*seqs), seqcmp);
+
+        for ( i = 0; i < nseq; i++ ) {
+                segment_path(path, sizeof(path), dirname, SEGMENT_PREFIX, seqs[i]);
+
+                ret = recover_segment(path, cb, data);
+                if ( ret < 0 )
+                        prelude_log(PRELUDE_LOG_ERR, "could not recover segment '%s': %s.\n", path, prelude_strerror(ret));
+                else
+                        count += ret;
+        }
+
+        free(seqs);
+        remove_segments(dirname, TRUE);
+
+        return count;
+}
+
+
+
+const bufpool_backend_t bufpool_segment_backend = {
+        "segment",
+        segment_open,
+        segment_write,
+        segment_read,
+        segment_skip,
+        segment_rewind,
+        segment_sync,
+        segment_close,
+        segment_is_spill,
+        segment_recover
+};
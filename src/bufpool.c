@@ -25,276 +25,1102 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fcntl.h>
-
-#include <assert.h>
 
 #include <libprelude/prelude.h>
-#include <libprelude/prelude-failover.h>
+#include <libprelude/prelude-io.h>
 
+#include "glthread/thread.h"
 #include "glthread/lock.h"
+#include "glthread/cond.h"
 #include "bufpool.h"
+#include "bufpool-backend.h"
+
+#ifndef MIN
+# define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
 
 #define DISK_THRESHOLD_DEFAULT 1 * (1024 * 1024)
 
+/*
+ * Number of in memory message per pool reachable through the
+ * lock-free path, must be a power of two. Once the ring is full,
+ * messages go to the pool overflow list, under the pool lock.
+ */
+#define BUFPOOL_RING_SIZE 256
+
+/*
+ * Statistics are accounted per thread, threads beyond this
+ * number share a slot.
+ */
+#define BUFPOOL_COUNTER_SLOTS 64
+#define CACHELINE_SIZE 64
+
+/*
+ * In memory bytes a thread account locally before folding them into
+ * the approximate total checked by the enqueue path.
+ */
+#define BUFPOOL_MEM_BATCH (16 * 1024)
+
+/*
+ * In memory pools are indexed by size class so that the eviction
+ * candidate is found without looking at every pool: bucket n hold
+ * pools of [2^(n-1), 2^n) bytes, and bucket 0 the empty ones.
+ */
+#define BUCKET_MAX (sizeof(size_t) * 8)
+#define BUCKET_NONE ((unsigned int) -1)
+
+
+typedef struct {
+        size_t seq;
+        prelude_msg_t *msg;
+} bufpool_slot_t;
+
+
+typedef struct {
+        void *handle;
+
+        /*
+         * Messages waiting for the spill writer, messages being written,
+         * and messages written but not read yet.
+         */
+        prelude_list_t pending;
+        size_t inflight;
+        size_t ondisk;
+        size_t ondisk_len;
+
+        time_t last_sync;
+} bufpool_spill_t;
+
+
+typedef union {
+        struct {
+                int64_t mem_msglen;
+                int64_t mem_msgcount;
+                int64_t disk_msglen;
+                int64_t disk_msgcount;
+        } c;
+        char pad[CACHELINE_SIZE];
+} bufpool_counter_t;
+
 
 struct bufpool {
+        /*
+         * Link in the size bucket while the pool is in memory, bucket
+         * is BUCKET_NONE otherwise. A pool only move up from the
+         * enqueue path, shrinking pools are moved down by the eviction.
+         */
         prelude_list_t list;
-        prelude_failover_t *failover;
-
-        prelude_list_t msglist;
+        unsigned int bucket;
+
+        /*
+         * Non NULL while the pool is on disk.
+         */
+        bufpool_spill_t *spill;
+
+        /*
+         * Link in the spill writer queue, which hold a reference.
+         */
+        prelude_list_t spill_list;
+        prelude_bool_t spill_queued;
+        unsigned int refcount;
+
+        /*
+         * NULL until the pool first spill.
+         */
         char *filename;
+        bufpool_filename_func_t *getname;
+        void *getname_data;
 
+        /*
+         * Serialize disk access and the memory <-> disk transitions.
+         */
         gl_lock_t mutex;
+        gl_cond_t cond;
+
+        /*
+         * Number of threads in the lock-free path, only entered
+         * when ->spill is NULL.
+         */
+        unsigned int users;
 
         size_t len;
         size_t count;
+
+        /*
+         * Multiple producers, single consumer: the scheduler thread
+         * owning the queue (or whoever hold ->mutex with no users).
+         */
+        size_t tail;
+        size_t head;
+        bufpool_slot_t ring[BUFPOOL_RING_SIZE];
+
+        /*
+         * In memory messages that didn't fit in the ring, protected by
+         * ->mutex. The lock-free path is not entered while non empty,
+         * so that messages are not reordered.
+         */
+        prelude_list_t overflow;
+        size_t overflow_count;
 };
 
 
-static PRELUDE_LIST(pool_list);
-static size_t on_disk_threshold = DISK_THRESHOLD_DEFAULT;
-static gl_lock_t mutex = gl_lock_initializer;
-static gl_lock_t destroy_prevention = gl_lock_initializer;
+static prelude_list_t pool_buckets[BUCKET_MAX + 1];
+static prelude_bool_t pool_buckets_initialized = FALSE;
+static size_t on_disk_threshold = DISK_THRESHOLD_DEFAULT;
+
+/*
+ * Bytes queued for, or stored on disk, checked against the quota
+ * by the admission control.
+ */
+static size_t disk_quota = 0;
+static size_t disk_usage = 0;
+static gl_lock_t mutex = gl_lock_initializer;
+static gl_lock_t destroy_prevention = gl_lock_initializer;
+
+/*
+ * Released pools are kept for reuse, with their lock and condition
+ * still initialized, so that connection churn doesn't go through malloc.
+ */
+#define FREE_POOLS_MAX 1024
+static PRELUDE_LIST(free_pools);
+static unsigned int free_pools_count = 0;
+static gl_lock_t free_pools_mutex = gl_lock_initializer;
+
+static const bufpool_backend_t *backend = &bufpool_file_backend;
+static bufpool_sync_t spill_sync = BUFPOOL_SYNC_NONE;
+static unsigned int spill_sync_interval = 0;
+
+static gl_thread_t writer_thread;
+static prelude_bool_t writer_started = FALSE;
+static volatile sig_atomic_t writer_stop = 0;
+static PRELUDE_LIST(writer_queue);
+static gl_lock_t writer_mutex = gl_lock_initializer;
+static gl_cond_t writer_cond = gl_cond_initializer;
+
+static unsigned int counter_used = 0;
+static bufpool_counter_t counters[BUFPOOL_COUNTER_SLOTS];
+static __thread bufpool_counter_t *thread_counter = NULL;
+
+static int64_t mem_approx = 0;
+static __thread int64_t mem_delta = 0;
+
+
+
+/*
+ * When adding a message to a queue, if the amount of memory used by
+ * all queue reach on_disk_threshold, then we find the queue using most
+ * memory, and flush it to disk.
+ *
+ * When the memory usage become normal again (no more EPS than the
+ * manager can process, the failover is destroyed.
+ */
+
+
+static bufpool_counter_t *get_counter(void)
+{
+        unsigned int slot;
+
+        if ( ! thread_counter ) {
+                slot = __atomic_fetch_add(&counter_used, 1, __ATOMIC_RELAXED);
+                thread_counter = &counters[slot % BUFPOOL_COUNTER_SLOTS];
+        }
+
+        return thread_counter;
+}
+
+
+
+static void sum_counters(int64_t *ml, int64_t *mc, int64_t *dl, int64_t *dc)
+{
+        unsigned int i, used;
+
+        *ml = *mc = *dl = *dc = 0;
+        used = MIN(__atomic_load_n(&counter_used, __ATOMIC_RELAXED), BUFPOOL_COUNTER_SLOTS);
+
+        for ( i = 0; i < used; i++ ) {
+                *ml += __atomic_load_n(&counters[i].c.mem_msglen, __ATOMIC_RELAXED);
+                *mc += __atomic_load_n(&counters[i].c.mem_msgcount, __ATOMIC_RELAXED);
+                *dl += __atomic_load_n(&counters[i].c.disk_msglen, __ATOMIC_RELAXED);
+                *dc += __atomic_load_n(&counters[i].c.disk_msgcount, __ATOMIC_RELAXED);
+        }
+}
+
+
+
+/*
+ * The approximate total is off by at most BUFPOOL_MEM_BATCH per thread.
+ */
+static inline void mem_approx_add(int64_t len)
+{
+        mem_delta += len;
+
+        if ( mem_delta >= BUFPOOL_MEM_BATCH || mem_delta <= -BUFPOOL_MEM_BATCH ) {
+                __atomic_fetch_add(&mem_approx, mem_delta, __ATOMIC_RELAXED);
+                mem_delta = 0;
+        }
+}
+
+
+
+static inline void inc_dlen(bufpool_t *bp, size_t len)
+{
+        bufpool_counter_t *counter = get_counter();
+
+        __atomic_fetch_add(&counter->c.disk_msglen, len, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&counter->c.disk_msgcount, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&disk_usage, len, __ATOMIC_RELAXED);
+
+        __atomic_fetch_add(&bp->count, 1, __ATOMIC_RELEASE);
+}
+
+
+static inline void dec_dlen(bufpool_t *bp, size_t len)
+{
+        bufpool_counter_t *counter = get_counter();
+
+        __atomic_fetch_sub(&counter->c.disk_msglen, len, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&counter->c.disk_msgcount, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&disk_usage, len, __ATOMIC_RELAXED);
+
+        __atomic_fetch_sub(&bp->count, 1, __ATOMIC_RELEASE);
+}
+
+static unsigned int get_bucket(size_t len)
+{
+        if ( len == 0 )
+                return 0;
+
+        return sizeof(unsigned long) * 8 - __builtin_clzl(len);
+}
+
+
+
+/*
+ * mutex must be held.
+ */
+static void bucket_move_locked(bufpool_t *bp, unsigned int bucket)
+{
+        if ( bp->bucket != BUCKET_NONE )
+                prelude_list_del(&bp->list);
+
+        if ( bucket != BUCKET_NONE )
+                prelude_list_add_tail(&pool_buckets[bucket], &bp->list);
+
+        __atomic_store_n(&bp->bucket, bucket, __ATOMIC_SEQ_CST);
+}
+
+
+
+/*
+ * mutex must be held. Move the pool to the bucket matching its size,
+ * and return that bucket. A pool growing while being moved down is
+ * moved back up, either here or by the enqueue path.
+ */
+static unsigned int bucket_refresh_locked(bufpool_t *bp)
+{
+        unsigned int bucket;
+
+        bucket = get_bucket(__atomic_load_n(&bp->len, __ATOMIC_SEQ_CST));
+        if ( bucket == bp->bucket )
+                return bucket;
+
+        bucket_move_locked(bp, bucket);
+
+        bucket = get_bucket(__atomic_load_n(&bp->len, __ATOMIC_SEQ_CST));
+        if ( bucket > bp->bucket )
+                bucket_move_locked(bp, bucket);
+
+        return bp->bucket;
+}
+
+
+
+/*
+ * Called with the pool new size once it grew. The global lock is only
+ * taken when the size go past the pool bucket, which doesn't happen
+ * again until the eviction moved the pool down. Pools that are not
+ * indexed have a BUCKET_NONE bucket, and are never moved.
+ */
+static void bucket_promote(bufpool_t *bp, size_t len)
+{
+        unsigned int bucket = get_bucket(len);
+
+        if ( bucket <= __atomic_load_n(&bp->bucket, __ATOMIC_SEQ_CST) )
+                return;
+
+        gl_lock_lock(mutex);
+
+        if ( bp->bucket != BUCKET_NONE && get_bucket(__atomic_load_n(&bp->len, __ATOMIC_RELAXED)) > bp->bucket )
+                bucket_refresh_locked(bp);
+
+        gl_lock_unlock(mutex);
+}
+
+
+
+/*
+ * mutex must be held.
+ */
+static void bucket_add(bufpool_t *bp)
+{
+        bucket_move_locked(bp, get_bucket(__atomic_load_n(&bp->len, __ATOMIC_RELAXED)));
+}
+
+
+
+/*
+ * mutex must be held.
+ */
+static void bucket_del(bufpool_t *bp)
+{
+        bucket_move_locked(bp, BUCKET_NONE);
+}
+
+
+
+static inline void inc_len(bufpool_t *bp, size_t len)
+{
+        bufpool_counter_t *counter = get_counter();
+
+        __atomic_fetch_add(&counter->c.mem_msglen, len, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&counter->c.mem_msgcount, 1, __ATOMIC_RELAXED);
+        mem_approx_add(len);
+
+        bucket_promote(bp, __atomic_add_fetch(&bp->len, len, __ATOMIC_SEQ_CST));
+        __atomic_fetch_add(&bp->count, 1, __ATOMIC_RELEASE);
+}
+
+
+
+static inline void dec_len(bufpool_t *bp, size_t len)
+{
+        bufpool_counter_t *counter = get_counter();
+
+        __atomic_fetch_sub(&counter->c.mem_msglen, len, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&counter->c.mem_msgcount, 1, __ATOMIC_RELAXED);
+        mem_approx_add(- (int64_t) len);
+
+        __atomic_fetch_sub(&bp->len, len, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&bp->count, 1, __ATOMIC_RELEASE);
+}
+
+
+
+static int ring_push(bufpool_t *bp, prelude_msg_t *msg)
+{
+        size_t pos, seq;
+        bufpool_slot_t *slot;
+
+        pos = __atomic_load_n(&bp->tail, __ATOMIC_RELAXED);
+
+        while ( 1 ) {
+                slot = &bp->ring[pos & (BUFPOOL_RING_SIZE - 1)];
+                seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+                if ( seq == pos ) {
+                        if ( __atomic_compare_exchange_n(&bp->tail, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED) )
+                                break;
+                }
+
+                else if ( (ssize_t) (seq - pos) < 0 )
+                        return -1; /* full */
+
+                else
+                        pos = __atomic_load_n(&bp->tail, __ATOMIC_RELAXED);
+        }
+
+        /*
+         * Account the message before publishing it, so that the consumer
+         * never see it before it is accounted.
+         */
+        inc_len(bp, prelude_msg_get_len(msg));
+
+        slot->msg = msg;
+        __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+
+
+static prelude_msg_t *ring_pop(bufpool_t *bp)
+{
+        prelude_msg_t *msg;
+        bufpool_slot_t *slot = &bp->ring[bp->head & (BUFPOOL_RING_SIZE - 1)];
+
+        if ( __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != bp->head + 1 )
+                return NULL;
+
+        msg = slot->msg;
+        __atomic_store_n(&slot->seq, bp->head + BUFPOOL_RING_SIZE, __ATOMIC_RELEASE);
+        bp->head++;
+
+        dec_len(bp, prelude_msg_get_len(msg));
+
+        return msg;
+}
+
+
+
+/*
+ * bp->mutex must be held.
+ */
+static void overflow_push(bufpool_t *bp, prelude_msg_t *msg)
+{
+        inc_len(bp, prelude_msg_get_len(msg));
+
+        prelude_linked_object_add_tail(&bp->overflow, (prelude_linked_object_t *) msg);
+        __atomic_fetch_add(&bp->overflow_count, 1, __ATOMIC_SEQ_CST);
+}
+
+
+
+/*
+ * bp->mutex must be held.
+ */
+static prelude_msg_t *overflow_pop(bufpool_t *bp)
+{
+        prelude_msg_t *msg;
+
+        if ( prelude_list_is_empty(&bp->overflow) )
+                return NULL;
+
+        msg = prelude_linked_object_get_object(bp->overflow.next);
+        prelude_linked_object_del((prelude_linked_object_t *) msg);
+        __atomic_fetch_sub(&bp->overflow_count, 1, __ATOMIC_SEQ_CST);
+
+        dec_len(bp, prelude_msg_get_len(msg));
+
+        return msg;
+}
+
+
+
+/*
+ * bp->mutex must be held: oldest in memory message, the ring being
+ * older than the overflow list.
+ */
+static prelude_msg_t *memory_pop(bufpool_t *bp)
+{
+        prelude_msg_t *msg;
+
+        msg = ring_pop(bp);
+        if ( ! msg )
+                msg = overflow_pop(bp);
+
+        return msg;
+}
+
+
+
+/*
+ * Enter the lock-free path, which is only allowed while the pool
+ * is not on disk, and has no overflow. Pair with flush_bufpool_to_disk().
+ */
+static prelude_bool_t lockfree_enter(bufpool_t *bp)
+{
+        __atomic_fetch_add(&bp->users, 1, __ATOMIC_SEQ_CST);
+
+        if ( ! __atomic_load_n(&bp->spill, __ATOMIC_SEQ_CST) &&
+             ! __atomic_load_n(&bp->overflow_count, __ATOMIC_SEQ_CST) )
+                return TRUE;
+
+        __atomic_fetch_sub(&bp->users, 1, __ATOMIC_RELEASE);
+
+        return FALSE;
+}
+
+
+
+static inline void lockfree_leave(bufpool_t *bp)
+{
+        __atomic_fetch_sub(&bp->users, 1, __ATOMIC_RELEASE);
+}
+
+
+
+static void bufpool_ref(bufpool_t *bp)
+{
+        __atomic_fetch_add(&bp->refcount, 1, __ATOMIC_RELAXED);
+}
+
+
+
+static void bufpool_unref(bufpool_t *bp)
+{
+        if ( __atomic_sub_fetch(&bp->refcount, 1, __ATOMIC_ACQ_REL) != 0 )
+                return;
+
+        if ( bp->filename ) {
+                free(bp->filename);
+                bp->filename = NULL;
+        }
+
+        gl_lock_lock(free_pools_mutex);
+
+        if ( free_pools_count < FREE_POOLS_MAX ) {
+                prelude_list_add(&free_pools, &bp->list);
+                free_pools_count++;
+                bp = NULL;
+        }
+
+        gl_lock_unlock(free_pools_mutex);
+
+        if ( ! bp )
+                return;
+
+        gl_cond_destroy(bp->cond);
+        gl_lock_destroy(bp->mutex);
+        free(bp);
+}
+
+
+
+static bufpool_t *bufpool_alloc(void)
+{
+        size_t i;
+        bufpool_t *bp = NULL;
+
+        gl_lock_lock(free_pools_mutex);
+
+        if ( ! prelude_list_is_empty(&free_pools) ) {
+                bp = prelude_list_entry(free_pools.next, bufpool_t, list);
+                prelude_list_del(&bp->list);
+                free_pools_count--;
+        }
+
+        gl_lock_unlock(free_pools_mutex);
+
+        /*
+         * A released pool ring is empty and consistent, whatever its
+         * head and tail are.
+         */
+        if ( bp )
+                return bp;
+
+        bp = malloc(sizeof(*bp));
+        if ( ! bp )
+                return NULL;
+
+        bp->head = bp->tail = 0;
+        for ( i = 0; i < BUFPOOL_RING_SIZE; i++ )
+                bp->ring[i].seq = i;
+
+        prelude_list_init(&bp->overflow);
+        bp->overflow_count = 0;
+
+        gl_lock_init(bp->mutex);
+        gl_cond_init(bp->cond);
+
+        return bp;
+}
+
+
+
+static int spill_new(bufpool_t *bp, bufpool_spill_t **out)
+{
+        int ret;
+        char buf[PATH_MAX];
+        bufpool_spill_t *spill;
+
+        if ( ! bp->filename ) {
+                bp->getname(bp->getname_data, buf, sizeof(buf));
+
+                bp->filename = strdup(buf);
+                if ( ! bp->filename )
+                        return prelude_error_from_errno(errno);
+        }
+
+        spill = calloc(1, sizeof(*spill));
+        if ( ! spill )
+                return prelude_error_from_errno(errno);
+
+        ret = backend->open(&spill->handle, bp->filename);
+        if ( ret < 0 ) {
+                free(spill);
+                return ret;
+        }
+
+        prelude_list_init(&spill->pending);
+        spill->last_sync = time(NULL);
+
+        *out = spill;
+        return 0;
+}
+
+
+
+static void spill_sync_file(bufpool_spill_t *spill)
+{
+        time_t now;
+
+        if ( spill_sync == BUFPOOL_SYNC_NONE )
+                return;
+
+        if ( spill_sync == BUFPOOL_SYNC_INTERVAL ) {
+                now = time(NULL);
+                if ( now - spill->last_sync < spill_sync_interval )
+                        return;
+
+                spill->last_sync = now;
+        }
+
+        backend->sync(spill->handle);
+}
+
+
+
+/*
+ * Write every pending message of the pool at once. Called from
+ * the spill writer, or on destruction with bp->mutex held.
+ */
+static void spill_flush_pending(bufpool_t *bp, prelude_bool_t locked)
+{
+        prelude_msg_t *msg;
+        bufpool_spill_t *spill;
+        prelude_list_t batch, *tmp, *bkp;
+        size_t count = 0, len = 0, written, i = 0;
+
+        if ( ! locked )
+                gl_lock_lock(bp->mutex);
+
+        spill = bp->spill;
+        if ( ! spill || prelude_list_is_empty(&spill->pending) ) {
+                if ( ! locked )
+                        gl_lock_unlock(bp->mutex);
+                return;
+        }
+
+        prelude_list_init(&batch);
+        prelude_list_for_each_safe(&spill->pending, tmp, bkp) {
+                msg = prelude_linked_object_get_object(tmp);
+                prelude_linked_object_del((prelude_linked_object_t *) msg);
+                prelude_linked_object_add_tail(&batch, (prelude_linked_object_t *) msg);
+                count++;
+        }
+
+        spill->inflight = count;
+
+        if ( ! locked )
+                gl_lock_unlock(bp->mutex);
+
+        written = backend->write(spill->handle, &batch);
+        spill_sync_file(spill);
+
+        if ( ! locked )
+                gl_lock_lock(bp->mutex);
+
+        prelude_list_for_each_safe(&batch, tmp, bkp) {
+                msg = prelude_linked_object_get_object(tmp);
+                prelude_linked_object_del((prelude_linked_object_t *) msg);
+
+                if ( i++ < written )
+                        len += prelude_msg_get_len(msg);
+                else
+                        dec_dlen(bp, prelude_msg_get_len(msg));
+
+                prelude_msg_destroy(msg);
+        }
+
+        spill->ondisk += written;
+        spill->ondisk_len += len;
+        spill->inflight = 0;
+
+        gl_cond_broadcast(bp->cond);
 
-static size_t mem_msglen = 0, mem_msgcount = 0;
-static size_t disk_msglen = 0, disk_msgcount = 0;
+        if ( ! locked )
+                gl_lock_unlock(bp->mutex);
+}
 
 
 
 /*
- * When adding a message to a queue, if the amount of memory used by
- * all queue reach on_disk_threshold, then we find the queue using most
- * memory, and flush it to disk.
- *
- * When the memory usage become normal again (no more EPS than the
- * manager can process, the failover is destroyed.
+ * bp->mutex must be held.
  */
-
-
-static inline void inc_dlen(bufpool_t *bp, size_t len)
+static void spill_schedule(bufpool_t *bp)
 {
-        gl_lock_lock(mutex);
-        disk_msglen += len;
-        disk_msgcount++;
-        gl_lock_unlock(mutex);
+        gl_lock_lock(writer_mutex);
+
+        if ( ! bp->spill_queued ) {
+                bufpool_ref(bp);
+                bp->spill_queued = TRUE;
+                prelude_list_add_tail(&writer_queue, &bp->spill_list);
+                gl_cond_signal(writer_cond);
+        }
 
-        bp->count++;
+        gl_lock_unlock(writer_mutex);
 }
 
 
-static inline void dec_dlen(bufpool_t *bp, size_t len)
+
+static void *spill_writer(void *arg)
 {
-        gl_lock_lock(mutex);
-        disk_msglen -= len;
-        disk_msgcount--;
-        gl_lock_unlock(mutex);
+        int ret;
+        sigset_t set;
+        bufpool_t *bp;
 
-        bp->count--;
-}
+        sigfillset(&set);
 
-static inline void inc_len(bufpool_t *bp, size_t len)
-{
-        gl_lock_lock(mutex);
-        mem_msglen += len;
-        mem_msgcount++;
-        gl_lock_unlock(mutex);
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        while ( 1 ) {
+                gl_lock_lock(writer_mutex);
 
-        bp->len += len;
-        bp->count++;
+                while ( prelude_list_is_empty(&writer_queue) && ! writer_stop )
+                        gl_cond_wait(writer_cond, writer_mutex);
+
+                if ( prelude_list_is_empty(&writer_queue) ) {
+                        gl_lock_unlock(writer_mutex);
+                        break;
+                }
+
+                bp = prelude_list_entry(writer_queue.next, bufpool_t, spill_list);
+                prelude_list_del(&bp->spill_list);
+                bp->spill_queued = FALSE;
+
+                gl_lock_unlock(writer_mutex);
+
+                spill_flush_pending(bp, FALSE);
+                bufpool_unref(bp);
+        }
+
+        return NULL;
 }
 
 
 
-static inline void dec_len(bufpool_t *bp, size_t len)
+/*
+ * bp->mutex must be held, and the spill writer be done with the pool.
+ */
+static void spill_close(bufpool_t *bp, prelude_bool_t keep)
 {
-        gl_lock_lock(mutex);
-        mem_msglen -= len;
-        mem_msgcount--;
-        gl_lock_unlock(mutex);
+        bufpool_spill_t *spill = bp->spill;
 
-        bp->len -= len;
-        bp->count--;
+        __atomic_store_n(&bp->spill, NULL, __ATOMIC_SEQ_CST);
+
+        backend->close(spill->handle, bp->filename, keep);
+        free(spill);
 }
 
 
 
+/*
+ * bp->mutex must be held.
+ */
 static int flush_bufpool_to_disk(bufpool_t *bp)
 {
         int ret;
         prelude_msg_t *msg;
-        prelude_list_t *tmp, *bkp;
+        bufpool_spill_t *spill;
 
-        ret = prelude_failover_new(&bp->failover, bp->filename);
-        if ( ret < 0 )
+        ret = spill_new(bp, &spill);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "could not create spill file '%s': %s.\n",
+                            bp->filename ? bp->filename : "", prelude_strerror(ret));
                 return ret;
+        }
 
-        prelude_list_for_each_safe(&bp->msglist, tmp, bkp) {
-                msg = prelude_linked_object_get_object(tmp);
-                prelude_linked_object_del((prelude_linked_object_t *) msg);
-
-                ret = prelude_failover_save_msg(bp->failover, msg);
-                if ( ret < 0 ) {
-                        prelude_log(PRELUDE_LOG_ERR, "failover write failure: %s.\n", prelude_strerror(ret));
-                        prelude_msg_destroy(msg);
-                        break;
-                }
-
+        /*
+         * Once the spill is visible, new users take the locked path:
+         * wait for the ones already in the lock-free path to leave.
+         */
+        __atomic_store_n(&bp->spill, spill, __ATOMIC_SEQ_CST);
+
+        while ( __atomic_load_n(&bp->users, __ATOMIC_SEQ_CST) )
+                sched_yield();
+
+        /*
+         * The in memory messages are handed to the spill writer, no I/O
+         * happen here.
+         */
+        while ( (msg = memory_pop(bp)) ) {
+                prelude_linked_object_add_tail(&spill->pending, (prelude_linked_object_t *) msg);
                 inc_dlen(bp, prelude_msg_get_len(msg));
-                dec_len(bp, prelude_msg_get_len(msg));
-                prelude_msg_destroy(msg);
         }
 
+        if ( ! prelude_list_is_empty(&spill->pending) )
+                spill_schedule(bp);
+
         gl_lock_lock(mutex);
-        prelude_list_del_init(&bp->list);
+        bucket_del(bp);
         gl_lock_unlock(mutex);
 
-        return ret;
+        return 0;
 }
 
 
-static bufpool_t *evict_from_memory(void)
+/*
+ * mutex must be held. Pools that shrank since they were indexed are
+ * moved down as they are met, so that the scan cost is paid back by
+ * the enqueues that moved them up.
+ */
+static bufpool_t *get_largest_pool(void)
 {
-        int ret;
-        size_t prev_len = 0;
-        bufpool_t *bp = NULL, *evict = NULL;
-
-        while ( 1 ) {
-                gl_lock_lock(destroy_prevention);
+        unsigned int i;
+        bufpool_t *bp;
 
-                gl_lock_lock(mutex);
-                bp = prelude_list_get_next(&pool_list, bp, bufpool_t, list);
-                gl_lock_unlock(mutex);
+        for ( i = BUCKET_MAX; i > 0; i-- ) {
+                while ( ! prelude_list_is_empty(&pool_buckets[i]) ) {
+                        bp = prelude_list_entry(pool_buckets[i].next, bufpool_t, list);
 
-                if ( ! bp ) {
-                        gl_lock_unlock(destroy_prevention);
-                        break;
+                        if ( bucket_refresh_locked(bp) >= i )
+                                return bp;
                 }
+        }
 
-                gl_lock_lock(bp->mutex);
-                gl_lock_unlock(destroy_prevention);
+        return NULL;
+}
 
-                if ( bp->failover ) {
-                        gl_lock_unlock(bp->mutex);
-                        continue;
-                }
 
-                if ( ! evict )
-                        evict = bp;
 
-                else if ( bp->len > prev_len ) {
-                        gl_lock_unlock(evict->mutex);
+/*
+ * Flush the pool from the biggest size class to disk. The victim is
+ * within a factor of two of the biggest pool. Empty pools are in the
+ * first bucket, and are never picked.
+ */
+static bufpool_t *evict_from_memory(void)
+{
+        int ret = 0;
+        bufpool_t *evict;
+
+        gl_lock_lock(destroy_prevention);
+
+        gl_lock_lock(mutex);
+        evict = get_largest_pool();
+        gl_lock_unlock(mutex);
 
-                        evict = bp;
-                        prev_len = bp->len;
-                } else
-                        gl_lock_unlock(bp->mutex);
+        if ( ! evict ) {
+                gl_lock_unlock(destroy_prevention);
+                return NULL;
         }
 
+        gl_lock_lock(evict->mutex);
+        gl_lock_unlock(destroy_prevention);
 
-        if ( evict ) {
+        /*
+         * Might have been flushed since we looked it up. On failure the
+         * pool stay indexed: don't let the caller pick it again.
+         */
+        if ( ! evict->spill )
                 ret = flush_bufpool_to_disk(evict);
-                gl_lock_unlock(evict->mutex);
-                return evict;
-        }
 
-        return NULL;
+        gl_lock_unlock(evict->mutex);
+
+        return ( ret < 0 ) ? NULL : evict;
 }
 
 
-static inline size_t get_total_mem(void)
+/*
+ * Exact in memory total, summing every thread slot.
+ */
+static size_t get_total_mem(void)
 {
-        size_t total;
+        int64_t ml, mc, dl, dc;
 
-        gl_lock_lock(mutex);
-        total = mem_msglen;
-        gl_lock_unlock(mutex);
+        sum_counters(&ml, &mc, &dl, &dc);
 
-        return total;
+        return ( ml > 0 ) ? ml : 0;
 }
 
 
-int bufpool_add_message(bufpool_t *bp, prelude_msg_t *msg)
+
+static inline size_t get_approx_mem(void)
 {
-        int ret = 0;
+        int64_t ml = __atomic_load_n(&mem_approx, __ATOMIC_RELAXED);
+
+        return ( ml > 0 ) ? ml : 0;
+}
+
+
+
+/*
+ * bp->mutex must be held. A full ring doesn't send the pool to disk,
+ * only the memory threshold does.
+ */
+static int add_message_locked(bufpool_t *bp, prelude_msg_t *msg)
+{
+        if ( ! bp->spill ) {
+                if ( prelude_list_is_empty(&bp->overflow) && ring_push(bp, msg) == 0 )
+                        return 0;
+
+                overflow_push(bp, msg);
+                return 0;
+        }
+
+        if ( prelude_list_is_empty(&bp->spill->pending) )
+                spill_schedule(bp);
+
+        prelude_linked_object_add_tail(&bp->spill->pending, (prelude_linked_object_t *) msg);
+        inc_dlen(bp, prelude_msg_get_len(msg));
+
+        return 0;
+}
+
+
+
+/*
+ * Add count messages at once: memory accounting is checked once, and
+ * the pool is locked at most once. Messages are always consumed.
+ */
+int bufpool_add_messages(bufpool_t *bp, prelude_msg_t **msgs, size_t count)
+{
+        int ret = 0, err;
+        size_t i = 0, len = 0;
         bufpool_t *evicted;
-        size_t len = prelude_msg_get_len(msg);
 
-        while ( get_total_mem() + len >= on_disk_threshold ) {
+        for ( i = 0; i < count; i++ )
+                len += prelude_msg_get_len(msgs[i]);
+
+        /*
+         * Only when the approximate total is over the threshold are the
+         * thread slots summed.
+         */
+        while ( get_approx_mem() + len >= on_disk_threshold &&
+                get_total_mem() + len >= on_disk_threshold ) {
                 evicted = evict_from_memory();
                 if ( evicted == NULL || evicted == bp )
                         break;
         }
 
-        gl_lock_lock(bp->mutex);
+        i = 0;
 
-        if ( ! bp->failover ) {
-                prelude_linked_object_add_tail(&bp->msglist, (prelude_linked_object_t *) msg);
-                inc_len(bp, len);
-        }
+        if ( lockfree_enter(bp) ) {
+                while ( i < count && ring_push(bp, msgs[i]) == 0 )
+                        i++;
 
-        else {
-                ret = prelude_failover_save_msg(bp->failover, msg);
-                inc_dlen(bp, prelude_msg_get_len(msg));
-                prelude_msg_destroy(msg);
+                lockfree_leave(bp);
         }
 
-        gl_lock_unlock(bp->mutex);
+        if ( i < count ) {
+                gl_lock_lock(bp->mutex);
+
+                for ( ; i < count; i++ ) {
+                        err = add_message_locked(bp, msgs[i]);
+                        if ( err < 0 )
+                                ret = err;
+                }
+
+                gl_lock_unlock(bp->mutex);
+        }
 
         return ret;
 }
 
 
-static void failover_destroy(bufpool_t *bp)
-{
-        prelude_failover_destroy(bp->failover);
-        bp->failover = NULL;
 
-        gl_lock_lock(mutex);
-        prelude_list_add_tail(&pool_list, &bp->list);
-        gl_lock_unlock(mutex);
+int bufpool_add_message(bufpool_t *bp, prelude_msg_t *msg)
+{
+        return bufpool_add_messages(bp, &msg, 1);
 }
 
 
 
-int bufpool_get_message(bufpool_t *bp, prelude_msg_t **out)
+/*
+ * bp->mutex must be held. Return the oldest spilled message, waiting
+ * for the spill writer if needed.
+ */
+static prelude_msg_t *spill_get_message(bufpool_t *bp)
 {
         int ret;
         prelude_list_t *tmp;
         prelude_msg_t *msg = NULL;
+        bufpool_spill_t *spill = bp->spill;
 
-        gl_lock_lock(bp->mutex);
+        while ( spill->inflight && ! spill->ondisk )
+                gl_cond_wait(bp->cond, bp->mutex);
+
+        if ( spill->ondisk ) {
+                ret = backend->read(spill->handle, &msg);
+                if ( ret < 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "could not retrieve message from spill file: %s.\n", prelude_strerror(ret));
+
+                        /*
+                         * Give up on what is on disk, and resume reading
+                         * after it.
+                         */
+                        while ( spill->inflight )
+                                gl_cond_wait(bp->cond, bp->mutex);
+
+                        for ( ; spill->ondisk; spill->ondisk-- )
+                                dec_dlen(bp, 0);
 
-        prelude_list_for_each(&bp->msglist, tmp) {
+                        __atomic_fetch_sub(&get_counter()->c.disk_msglen, spill->ondisk_len, __ATOMIC_RELAXED);
+                        __atomic_fetch_sub(&disk_usage, spill->ondisk_len, __ATOMIC_RELAXED);
+                        spill->ondisk_len = 0;
+
+                        backend->skip(spill->handle);
+
+                        return NULL;
+                }
+
+                spill->ondisk--;
+                spill->ondisk_len -= prelude_msg_get_len(msg);
+        }
+
+        else if ( ! prelude_list_is_empty(&spill->pending) ) {
+                tmp = spill->pending.next;
                 msg = prelude_linked_object_get_object(tmp);
                 prelude_linked_object_del((prelude_linked_object_t *) msg);
-                dec_len(bp, prelude_msg_get_len(msg));
-                break;
         }
 
-        if ( ! msg && bp->failover ) {
-                ret = prelude_failover_get_saved_msg(bp->failover, &msg);
-                if ( ret < 0 ) {
-                        prelude_log(PRELUDE_LOG_ERR, "could not retrieve message from failover: %s.\n", prelude_strerror(ret));
-                        failover_destroy(bp);
+        if ( msg )
+                dec_dlen(bp, prelude_msg_get_len(msg));
+
+        return msg;
+}
+
+
+
+int bufpool_get_message(bufpool_t *bp, prelude_msg_t **out)
+{
+        bufpool_spill_t *spill;
+        prelude_msg_t *msg = NULL;
+
+        if ( lockfree_enter(bp) ) {
+                msg = ring_pop(bp);
+                lockfree_leave(bp);
+
+                if ( msg ) {
+                        *out = msg;
+                        return 1;
                 }
+        }
+
+        gl_lock_lock(bp->mutex);
 
-                else if ( bp->count - 1 == 0 ) {
-                        prelude_msg_t *tmsg;
+        msg = memory_pop(bp);
 
-                        ret = prelude_failover_get_saved_msg(bp->failover, &tmsg);
-                        assert(ret == 0);
+        if ( ! msg && (spill = bp->spill) ) {
+                msg = spill_get_message(bp);
 
-                        failover_destroy(bp);
+                /*
+                 * Everything was read back: back to memory. If more
+                 * is pending, at least rewind the storage.
+                 */
+                if ( ! spill->ondisk && ! spill->inflight && prelude_list_is_empty(&spill->pending) ) {
+                        spill_close(bp, FALSE);
+
+                        gl_lock_lock(mutex);
+                        bucket_add(bp);
+                        gl_lock_unlock(mutex);
                 }
 
-                if ( msg )
-                        dec_dlen(bp, prelude_msg_get_len(msg));
+                else if ( ! spill->ondisk && ! spill->inflight )
+                        backend->reset(spill->handle);
         }
 
-        assert(msg || bp->count == 0);
         gl_lock_unlock(bp->mutex);
 
         *out = msg;
@@ -303,27 +1129,37 @@ int bufpool_get_message(bufpool_t *bp, prelude_msg_t **out)
 
 
 
-int bufpool_new(bufpool_t **bp, const char *filename)
+int bufpool_new(bufpool_t **bp, bufpool_filename_func_t *getname, void *data)
 {
-        *bp = malloc(sizeof(**bp));
+        size_t i;
+
+        *bp = bufpool_alloc();
         if ( ! *bp )
-                return -1;
+                return prelude_error_from_errno(errno);
 
         (*bp)->len = 0;
+        (*bp)->bucket = BUCKET_NONE;
         (*bp)->count = 0;
-        (*bp)->failover = NULL;
-        prelude_list_init(&(*bp)->msglist);
+        (*bp)->users = 0;
+        (*bp)->refcount = 1;
+        (*bp)->spill = NULL;
+        (*bp)->spill_queued = FALSE;
 
-        (*bp)->filename = strdup(filename);
-        if ( ! (*bp)->filename ) {
-                free(*bp);
-                return prelude_error_from_errno(errno);
+        (*bp)->filename = NULL;
+        (*bp)->getname = getname;
+        (*bp)->getname_data = data;
+
+        gl_lock_lock(mutex);
+
+        if ( ! pool_buckets_initialized ) {
+                for ( i = 0; i <= BUCKET_MAX; i++ )
+                        prelude_list_init(&pool_buckets[i]);
+
+                pool_buckets_initialized = TRUE;
         }
 
-        gl_lock_init((*bp)->mutex);
+        bucket_add(*bp);
 
-        gl_lock_lock(mutex);
-        prelude_list_add_tail(&pool_list, &(*bp)->list);
         gl_lock_unlock(mutex);
 
         return 0;
@@ -332,22 +1168,34 @@ int bufpool_new(bufpool_t **bp, const char *filename)
 
 void bufpool_destroy(bufpool_t *bp)
 {
+        prelude_msg_t *msg;
+
         gl_lock_lock(destroy_prevention);
         gl_lock_lock(bp->mutex);
         gl_lock_unlock(destroy_prevention);
 
         gl_lock_lock(mutex);
-        prelude_list_del(&bp->list);
+        bucket_del(bp);
         gl_lock_unlock(mutex);
 
-        if ( bp->failover )
-                prelude_failover_destroy(bp->failover);
+        while ( (msg = memory_pop(bp)) )
+                prelude_msg_destroy(msg);
+
+        /*
+         * Keep unread messages on disk, so that they are recovered
+         * on next start.
+         */
+        if ( bp->spill ) {
+                while ( bp->spill->inflight )
+                        gl_cond_wait(bp->cond, bp->mutex);
+
+                spill_flush_pending(bp, TRUE);
+                spill_close(bp, bp->spill->ondisk > 0);
+        }
 
         gl_lock_unlock(bp->mutex);
-        gl_lock_destroy(bp->mutex);
 
-        free(bp->filename);
-        free(bp);
+        bufpool_unref(bp);
 }
 
 
@@ -357,29 +1205,143 @@ void bufpool_set_disk_threshold(size_t threshold)
 }
 
 
-size_t bufpool_get_message_count(bufpool_t *bp)
+
+void bufpool_set_disk_quota(size_t quota)
 {
-        size_t count;
+        disk_quota = quota;
+}
 
-        gl_lock_lock(bp->mutex);
-        count = bp->count;
-        gl_lock_unlock(bp->mutex);
 
-        return count;
+
+prelude_bool_t bufpool_is_over_disk_quota(void)
+{
+        return ( disk_quota && __atomic_load_n(&disk_usage, __ATOMIC_RELAXED) >= disk_quota ) ? TRUE : FALSE;
+}
+
+
+
+void bufpool_set_sync_policy(bufpool_sync_t policy, unsigned int interval)
+{
+        spill_sync = policy;
+        spill_sync_interval = interval;
+}
+
+
+size_t bufpool_get_message_count(bufpool_t *bp)
+{
+        return __atomic_load_n(&bp->count, __ATOMIC_ACQUIRE);
 }
 
 
 
 void bufpool_print_stats(void)
 {
-        uint64_t dl, dc, ml, mc;
+        int64_t dl, dc, ml, mc;
 
-        gl_lock_lock(mutex);
-        dl = disk_msglen;
-        dc = disk_msgcount;
-        ml = mem_msglen;
-        mc = mem_msgcount;
-        gl_lock_unlock(mutex);
+        sum_counters(&ml, &mc, &dl, &dc);
+
+        prelude_log(PRELUDE_LOG_INFO, "disk_len=%" PRELUDE_PRId64 " disk_count=%" PRELUDE_PRId64 " mem_len=%" PRELUDE_PRId64 " mem_count=%" PRELUDE_PRId64 "\n", dl, dc, ml, mc);
+}
+
+
+
+int bufpool_set_backend(const char *name)
+{
+        if ( strcmp(name, bufpool_file_backend.name) == 0 )
+                backend = &bufpool_file_backend;
+
+#ifdef HAVE_FMEMOPEN
+        else if ( strcmp(name, bufpool_segment_backend.name) == 0 )
+                backend = &bufpool_segment_backend;
+#endif
+
+        else
+                return -1;
+
+        return 0;
+}
+
+
+
+/*
+ * Whether path hold messages spilled by a previous run, whatever the
+ * backend used at the time.
+ */
+prelude_bool_t bufpool_is_spill(const char *path)
+{
+#ifdef HAVE_FMEMOPEN
+        if ( bufpool_segment_backend.is_spill(path) )
+                return TRUE;
+#endif
+
+        return bufpool_file_backend.is_spill(path);
+}
+
+
+
+/*
+ * Replay then remove messages left in a spill by a previous run.
+ */
+ssize_t bufpool_recover(const char *path, void (*cb)(prelude_msg_t *msg, void *data), void *data)
+{
+#ifdef HAVE_FMEMOPEN
+        if ( bufpool_segment_backend.is_spill(path) )
+                return bufpool_segment_backend.recover(path, cb, data);
+#endif
+
+        return bufpool_file_backend.recover(path, cb, data);
+}
+
+
+
+int bufpool_init(void)
+{
+        int ret;
+
+        ret = glthread_create(&writer_thread, spill_writer, NULL);
+        if ( ret != 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't create spill writer thread.\n");
+                return -1;
+        }
+
+        writer_started = TRUE;
+
+        return 0;
+}
+
+
+
+void bufpool_exit(void)
+{
+        bufpool_t *bp;
+        prelude_list_t *tmp, *bkp;
+
+        if ( writer_started ) {
+                gl_lock_lock(writer_mutex);
+                writer_stop = 1;
+                gl_cond_signal(writer_cond);
+                gl_lock_unlock(writer_mutex);
+
+                gl_thread_join(writer_thread, NULL);
+                writer_started = FALSE;
+        }
+
+        /*
+         * The spill writer might release the last reference to a pool,
+         * only drain the free list once it is done.
+         */
+        gl_lock_lock(free_pools_mutex);
+
+        prelude_list_for_each_safe(&free_pools, tmp, bkp) {
+                bp = prelude_list_entry(tmp, bufpool_t, list);
+                prelude_list_del(&bp->list);
+
+                gl_cond_destroy(bp->cond);
+                gl_lock_destroy(bp->mutex);
+                free(bp);
+        }
+
+        free_pools_count = 0;
 
-        prelude_log(PRELUDE_LOG_INFO, "disk_len=%" PRELUDE_PRIu64 " disk_count=%" PRELUDE_PRIu64 " mem_len=%" PRELUDE_PRIu64 " mem_count=%" PRELUDE_PRIu64 "\n", dl, dc, ml, mc);
+        gl_lock_unlock(free_pools_mutex);
 }
@@ -33,6 +33,7 @@
 
 #include "prelude-manager.h"
 #include "decode-plugins.h"
+#include "plugin-lock.h"
 
 
 #define MANAGER_PLUGIN_SYMBOL "manager_plugin_init"
@@ -46,10 +47,15 @@ static PRELUDE_LIST(decode_plugins_instance);
  */
 static int subscribe(prelude_plugin_instance_t *pi)
 {
-        prelude_plugin_generic_t *plugin = prelude_plugin_instance_get_plugin(pi);
+        int ret;
+        manager_decode_plugin_t *plugin = (manager_decode_plugin_t *) prelude_plugin_instance_get_plugin(pi);
 
         prelude_log(PRELUDE_LOG_INFO, "Subscribing %s to active decoding plugins.\n", plugin->name);
 
+        ret = plugin_lock_new(pi, plugin->concurrency);
+        if ( ret < 0 )
+                return ret;
+
         return prelude_plugin_instance_add(pi, &decode_plugins_instance);
 }
 
@@ -61,6 +67,7 @@ static void unsubscribe(prelude_plugin_instance_t *pi)
         prelude_log(PRELUDE_LOG_DEBUG, "Unsubscribing %s from active decoding plugins.\n", plugin->name);
 
         prelude_plugin_instance_del(pi);
+        plugin_lock_destroy(pi);
 }
 
 
@@ -83,7 +90,10 @@ int decode_plugins_run(unsigned int plugin_id, prelude_msg_t *msg, idmef_message
                 if ( p->decode_id != plugin_id )
                         continue;
 
+                plugin_lock_acquire(pi);
                 ret = prelude_plugin_run(pi, manager_decode_plugin_t, run, msg, idmef);
+                plugin_lock_release(pi);
+
                 if ( ret < 0 ) {
                         prelude_log(PRELUDE_LOG_WARN, "%s couldn't decode sensor data.\n", p->name);
                         return -1;
@@ -36,6 +36,8 @@
 
 #include "prelude-manager.h"
 #include "filter-plugins.h"
+#include "pmsg-to-idmef.h"
+#include "plugin-lock.h"
 
 
 #define MANAGER_PLUGIN_SYMBOL "manager_plugin_init"
@@ -48,6 +50,11 @@ struct manager_filter_hook {
         prelude_plugin_instance_t *filter;
         prelude_plugin_instance_t *filtered_plugin;
 
+        /*
+         * Alert children the filter look at, if it declared them.
+         */
+        prelude_bool_t have_mask;
+        uint32_t mask;
 };
 
 
@@ -59,8 +66,21 @@ static int add_filter_entry(manager_filter_hook_t **entry,
                             prelude_plugin_instance_t *filter, manager_filter_category_t cat,
                             prelude_plugin_instance_t *filtered_plugin_instance, void *data)
 {
+        int ret;
         manager_filter_hook_t *new;
-        prelude_plugin_generic_t *plugin, *filtered_plugin;
+        manager_filter_plugin_t *plugin;
+        prelude_plugin_generic_t *filtered_plugin;
+
+        plugin = (manager_filter_plugin_t *) prelude_plugin_instance_get_plugin(filter);
+
+        if ( cat == MANAGER_FILTER_CATEGORY_PRE_DECODE && ! plugin->run_raw ) {
+                prelude_log(PRELUDE_LOG_ERR, "%s can't be hooked before messages are decoded.\n", plugin->name);
+                return -1;
+        }
+
+        ret = plugin_lock_new(filter, plugin->concurrency);
+        if ( ret < 0 )
+                return ret;
 
         new = malloc(sizeof(*new));
         if ( ! new ) {
@@ -71,11 +91,10 @@ static int add_filter_entry(manager_filter_hook_t **entry,
         new->data = data;
         new->filter = filter;
         new->filtered_plugin = filtered_plugin_instance;
+        new->have_mask = FALSE;
 
         prelude_list_add_tail(&filter_category_list[cat], &new->list);
 
-        plugin = prelude_plugin_instance_get_plugin(filter);
-
         if ( filtered_plugin_instance ) {
                 filtered_plugin = prelude_plugin_instance_get_plugin(filtered_plugin_instance);
                 prelude_log(PRELUDE_LOG_INFO, "Subscribing %s to filtering plugin with plugin hook %s[%s].\n",
@@ -95,6 +114,8 @@ static void unsubscribe(prelude_plugin_instance_t *pi)
 {
         prelude_plugin_generic_t *plugin = prelude_plugin_instance_get_plugin(pi);
         prelude_log(PRELUDE_LOG_DEBUG, "Unsubscribing %s from active reporting plugins.\n", plugin->name);
+
+        plugin_lock_destroy(pi);
 }
 
 
@@ -118,6 +139,81 @@ int manager_filter_new_hook(manager_filter_hook_t **entry,
 
 
 
+static void get_criteria_mask(idmef_criteria_t *criteria, uint32_t *mask)
+{
+        idmef_criterion_t *criterion;
+
+        for ( ; criteria; criteria = idmef_criteria_get_or(criteria) ) {
+                criterion = idmef_criteria_get_criterion(criteria);
+                if ( criterion )
+                        pmsg_to_idmef_get_path_mask(idmef_criterion_get_path(criterion), mask);
+
+                get_criteria_mask(idmef_criteria_get_and(criteria), mask);
+        }
+}
+
+
+
+/*
+ * Declare the filter as only matching criteria against the message,
+ * without side effects. Alerts may then be decoded partially before
+ * being handed to it.
+ */
+void manager_filter_hook_set_criteria(manager_filter_hook_t *entry, idmef_criteria_t *criteria)
+{
+        uint32_t mask = 0;
+
+        get_criteria_mask(criteria, &mask);
+
+        entry->mask = mask;
+        entry->have_mask = TRUE;
+}
+
+
+
+/*
+ * Return FALSE if the category has no filter, or if one of them need
+ * the whole message.
+ */
+prelude_bool_t filter_plugins_get_category_mask(manager_filter_category_t cat, uint32_t *mask)
+{
+        prelude_list_t *tmp;
+        manager_filter_hook_t *entry;
+
+        *mask = 0;
+
+        if ( prelude_list_is_empty(&filter_category_list[cat]) )
+                return FALSE;
+
+        prelude_list_for_each(&filter_category_list[cat], tmp) {
+                entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
+
+                if ( ! entry->have_mask )
+                        return FALSE;
+
+                *mask |= entry->mask;
+        }
+
+        return ( *mask != PMSG_TO_IDMEF_MASK_ALL );
+}
+
+
+
+
+static int filter_run(manager_filter_hook_t *entry, idmef_message_t *msg)
+{
+        int ret;
+
+        plugin_lock_acquire(entry->filter);
+        ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run, msg, entry->data);
+        plugin_lock_release(entry->filter);
+
+        return ret;
+}
+
+
+
+
 int filter_plugins_run_by_category(idmef_message_t *msg, manager_filter_category_t cat)
 {
         int ret;
@@ -127,7 +223,41 @@ int filter_plugins_run_by_category(idmef_message_t *msg, manager_filter_category
         prelude_list_for_each(&filter_category_list[cat], tmp) {
                 entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
 
-                ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run, msg, entry->data);
+                ret = filter_run(entry, msg);
+                if ( ret < 0 )
+                        return -1;
+        }
+
+        return 0;
+}
+
+
+
+
+/*
+ * Run the PRE_DECODE filters on msg, before it is decoded.
+ */
+int filter_plugins_run_raw(prelude_msg_t *msg)
+{
+        int ret;
+        prelude_list_t *tmp;
+        manager_filter_hook_t *entry;
+        manager_raw_message_t raw;
+
+        if ( prelude_list_is_empty(&filter_category_list[MANAGER_FILTER_CATEGORY_PRE_DECODE]) )
+                return 0;
+
+        ret = pmsg_to_idmef_get_raw(msg, &raw);
+        if ( ret < 0 )
+                return 0;
+
+        prelude_list_for_each(&filter_category_list[MANAGER_FILTER_CATEGORY_PRE_DECODE], tmp) {
+                entry = prelude_list_entry(tmp, manager_filter_hook_t, list);
+
+                plugin_lock_acquire(entry->filter);
+                ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run_raw, &raw, entry->data);
+                plugin_lock_release(entry->filter);
+
                 if ( ret < 0 )
                         return -1;
         }
@@ -152,7 +282,7 @@ int filter_plugins_run_by_plugin(idmef_message_t *msg, prelude_plugin_instance_t
                 if ( entry->filtered_plugin != plugin )
                         continue;
 
-                ret = prelude_plugin_run(entry->filter, manager_filter_plugin_t, run, msg, entry->data);
+                ret = filter_run(entry, msg);
                 if ( ret >= 0 ) {
                         prelude_log_debug(3, "filter '%s': match.\n", prelude_plugin_instance_get_name(entry->filter));
 
@@ -37,6 +37,10 @@
 #include <netinet/in.h> /* required by common.h */
 #include <ftw_.h>
 
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>
+#endif
+
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
 # include <time.h>
@@ -64,8 +68,10 @@
 #include "manager-options.h"
 #include "reverse-relaying.h"
 #include "pmsg-to-idmef.h"
+#include "plugin-lock.h"
 #include "idmef-message-scheduler.h"
 #include "bufpool.h"
+#include "message-arena.h"
 
 
 /*
@@ -96,285 +102,416 @@
 #endif
 
 
+#if defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_SYS_EVENTFD_H)
+# define USE_TIMERFD
+# include <poll.h>
+# include <sys/timerfd.h>
+# include <sys/eventfd.h>
+#endif
+
+
 #ifndef MIN
 # define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 
 #define QUEUE_STATE_DESTROYED 0x01
+#define QUEUE_STATE_SCHEDULED(prio) (0x02 << (prio))
+#define QUEUE_STATE_SCHEDULED_ANY (QUEUE_STATE_SCHEDULED(QUEUE_PRIO_HIGH) | \
+                                   QUEUE_STATE_SCHEDULED(QUEUE_PRIO_MID)  | \
+                                   QUEUE_STATE_SCHEDULED(QUEUE_PRIO_LOW))
+
+/*
+ * Number of messages a queue of weight 1 may process each time it is
+ * visited, before the next queue of the same priority get its turn.
+ */
+#define SCHED_QUANTUM 10
+
+/*
+ * Maximum number of messages handed to a pool at once.
+ */
+#define SCHED_BATCH_MAX 64
+
+/*
+ * Number of released queues kept around for reuse.
+ */
+#define QUEUE_FREE_MAX 1024
+
+/*
+ * The reporting filters verdicts are sampled over PREFILTER_WINDOW
+ * messages, and alerts prefiltered during the next window if at least
+ * PREFILTER_DROP_RATIO percent were rejected.
+ */
+#define PREFILTER_WINDOW 1024
+#define PREFILTER_DROP_RATIO 50
+
+
+typedef enum {
+        QUEUE_PRIO_HIGH = 0,
+        QUEUE_PRIO_MID  = 1,
+        QUEUE_PRIO_LOW  = 2,
+        QUEUE_PRIO_MAX  = 3
+} queue_prio_t;
+
+
+/*
+ * Each processing thread own a shard, holding the queues pinned to it
+ * that have messages waiting to be processed, with one run list per
+ * priority. A queue is present at most once in each run list, and
+ * since all queues from a given analyzer belong to the same shard, per
+ * sensor ordering is preserved.
+ *
+ * Priorities are picked in weighted round robin, using the credit
+ * below, and queues of a given priority are served in deficit round
+ * robin: a flooding sensor only get its quantum before the next sensor
+ * of the same priority is served.
+ */
+typedef struct {
+        unsigned int id;
+        gl_thread_t thread;
+
+        gl_lock_t mutex;
+        gl_cond_t cond;
+        prelude_list_t run_queue[QUEUE_PRIO_MAX];
+        int credit[QUEUE_PRIO_MAX];
+} sched_shard_t;
+
+
+typedef struct {
+        idmef_queue_t *queue;
+        queue_prio_t prio;
+} queue_pool_name_t;
 
 
 struct idmef_queue {
         prelude_list_t list;
+        prelude_list_t run_list[QUEUE_PRIO_MAX];
 
         int state;
+        sched_shard_t *shard;
+
+        unsigned int weight;
+        unsigned int deficit[QUEUE_PRIO_MAX];
+        bufpool_t *pool[QUEUE_PRIO_MAX];
+
+        uint64_t id;
+        queue_pool_name_t pool_name[QUEUE_PRIO_MAX];
 
-        bufpool_t *high;
-        bufpool_t *mid;
-        bufpool_t *low;
+        /*
+         * Set while a recovery thread wait for the queue to drain.
+         */
+        unsigned int recovery_waiting;
 };
 
 
+/*
+ * Per analyzer scheduling weight, set from the configuration.
+ */
+typedef struct {
+        prelude_list_t list;
+        uint64_t analyzerid;
+        unsigned int weight;
+} analyzer_weight_t;
+
+
 static PRELUDE_LIST(message_queue);
 static gl_lock_t queue_list_mutex = gl_lock_initializer;
 
-static prelude_bool_t input_available = FALSE;
-static gl_cond_t input_cond = gl_cond_initializer;
-static gl_lock_t input_mutex = gl_lock_initializer;
-static gl_lock_t process_mutex = gl_lock_initializer;
+static PRELUDE_LIST(free_queues);
+static unsigned int free_queues_count = 0;
+
+static char backup_dirname[PATH_MAX];
 
-static unsigned int sched_process_high   =  50;
-static unsigned int sched_process_medium =  30;
-static unsigned int sched_process_low    =  20;
-static unsigned int sched_process        = 100;
+/*
+ * Processing pause: workers don't start handling a queue while a pause
+ * is requested, and the requester wait for active workers to finish.
+ */
+static gl_lock_t pause_mutex = gl_lock_initializer;
+static gl_cond_t pause_cond = gl_cond_initializer;
+static unsigned int pause_requested = 0;
+static unsigned int active_workers = 0;
+
+static unsigned int sched_weight[QUEUE_PRIO_MAX] = { 50, 30, 20 };
+static PRELUDE_LIST(analyzer_weights);
 
 
 /*
  * Thread controling stuff.
  */
-static gl_thread_t thread;
+static sched_shard_t *shards = NULL;
+static unsigned int sched_workers = 1;
 static volatile sig_atomic_t stop_processing = 0;
 
+/*
+ * Each thread decide for itself whether prefiltering pay off.
+ */
+static __thread unsigned int prefilter_seen = 0;
+static __thread unsigned int prefilter_dropped = 0;
+static __thread prelude_bool_t prefilter_enabled = FALSE;
+
+/*
+ * Timers are driven by a dedicated thread, so that processing threads
+ * only wake up when there is work to do.
+ */
+static gl_thread_t timer_tid;
+static prelude_bool_t timer_started = FALSE;
+#ifdef USE_TIMERFD
+static int timer_fd = -1;
+static int timer_stop_fd = -1;
+#else
+static prelude_bool_t timer_stopped = FALSE;
+static gl_lock_t timer_mutex = gl_lock_initializer;
+static gl_cond_t timer_cond = gl_cond_initializer;
+#endif
+
 
 
-static void signal_input_available(void)
+static sched_shard_t *get_shard(uint64_t analyzerid)
 {
-        gl_lock_lock(input_mutex);
-
-        if ( ! input_available ) {
-                input_available = TRUE;
-                gl_cond_signal(input_cond);
-        }
+        /*
+         * analyzerid are often allocated sequentially: mix the bits
+         * so that sensors are evenly spread among shards.
+         */
+        analyzerid ^= analyzerid >> 33;
+        analyzerid *= 0xff51afd7ed558ccdULL;
+        analyzerid ^= analyzerid >> 33;
 
-        gl_lock_unlock(input_mutex);
+        return &shards[analyzerid % sched_workers];
 }
 
 
 
-static inline struct timespec *get_timespec(struct timespec *ts)
+static unsigned int get_analyzer_weight(uint64_t analyzerid)
 {
-        struct timeval now;
-
-        gettimeofday(&now, NULL);
+        prelude_list_t *tmp;
+        analyzer_weight_t *aw;
 
-        ts->tv_sec = now.tv_sec;
-        ts->tv_nsec = now.tv_usec * 1000;
+        prelude_list_for_each(&analyzer_weights, tmp) {
+                aw = prelude_list_entry(tmp, analyzer_weight_t, list);
+                if ( aw->analyzerid == analyzerid )
+                        return aw->weight;
+        }
 
-        return ts;
+        return 1;
 }
 
 
 
-static int timespec_diff(struct timespec *end, struct timespec *start)
+/*
+ * Must be called with the queue shard mutex held. Return TRUE if the
+ * queue was added to the run list.
+ */
+static prelude_bool_t queue_link(idmef_queue_t *queue, queue_prio_t prio)
 {
-        int diff = end->tv_sec - start->tv_sec;
+        if ( queue->state & QUEUE_STATE_SCHEDULED(prio) )
+                return FALSE;
 
-        if ( end->tv_nsec < start->tv_nsec )
-                diff -= 1;
+        queue->state |= QUEUE_STATE_SCHEDULED(prio);
+        prelude_list_add_tail(&queue->shard->run_queue[prio], &queue->run_list[prio]);
 
-        return diff;
+        return TRUE;
 }
 
-static prelude_bool_t timespec_expired(struct timespec *end, struct timespec *start)
-{
-        return ( timespec_diff(end, start) >= 1 ) ? TRUE : FALSE;
-}
 
 
 /*
- * Wait until a message is queued.
+ * Must be called with the queue shard mutex held.
  */
-static void wait_for_message(struct timespec *last_wakeup)
+static void queue_schedule(idmef_queue_t *queue, queue_prio_t prio)
 {
-        int ret;
-        struct timespec ts;
-
-        gl_lock_lock(input_mutex);
-
-        while ( ! input_available && ! stop_processing ) {
-
-                ts.tv_sec = last_wakeup->tv_sec + 1;
-                ts.tv_nsec = last_wakeup->tv_nsec;
+        if ( queue_link(queue, prio) )
+                gl_cond_signal(queue->shard->cond);
+}
 
-                ret = glthread_cond_timedwait(&input_cond, &input_mutex, &ts);
-                if ( ret == ETIMEDOUT ) {
-                        prelude_timer_wake_up();
-                        last_wakeup->tv_sec = ts.tv_sec;
-                        last_wakeup->tv_nsec = ts.tv_nsec;
-                }
-        }
 
-        if ( ! input_available && stop_processing ) {
-                gl_lock_unlock(input_mutex);
-                gl_thread_exit(NULL);
-        }
 
-        /*
-         * We are going to process all available data.
-         */
-        input_available = FALSE;
-        gl_lock_unlock(input_mutex);
+static void signal_input_available(idmef_queue_t *queue, queue_prio_t prio)
+{
+        gl_lock_lock(queue->shard->mutex);
+        queue_schedule(queue, prio);
+        gl_lock_unlock(queue->shard->mutex);
 }
 
 
 
-static int process_message(prelude_msg_t *msg)
+static inline struct timespec *get_timespec(struct timespec *ts)
 {
-        int ret;
-        idmef_message_t *idmef;
-
-        ret = pmsg_to_idmef(&idmef, msg);
-        if ( ret < 0 ) {
-                prelude_msg_destroy(msg);
-
-                /*
-                 * FIXME: need a way to close connection on invalid message.
-                 */
-                prelude_log(PRELUDE_LOG_ERR, "Invalid message received.\n");
-                return ret;
-        }
+        struct timeval now;
 
-        /*
-         * prelude-msg is usefull for report plugin failover.
-         * We don't need to call prelude_msg_destroy(), as
-         * idmef_message_destroy() will consequently do this for us.
-         */
-        idmef_message_set_pmsg(idmef, msg);
-        idmef_message_process(idmef);
+        gettimeofday(&now, NULL);
 
-        idmef_message_destroy(idmef);
+        ts->tv_sec = now.tv_sec;
+        ts->tv_nsec = now.tv_usec * 1000;
 
-        return 0;
+        return ts;
 }
 
 
 
-static void queue_destroy(idmef_queue_t *queue)
+static void worker_enter(void)
 {
-        gl_lock_lock(queue_list_mutex);
-        prelude_list_del(&queue->list);
-        gl_lock_unlock(queue_list_mutex);
+        gl_lock_lock(pause_mutex);
 
-        bufpool_destroy(queue->high);
-        bufpool_destroy(queue->mid);
-        bufpool_destroy(queue->low);
+        while ( pause_requested )
+                gl_cond_wait(pause_cond, pause_mutex);
 
-        free(queue);
+        active_workers++;
+
+        gl_lock_unlock(pause_mutex);
 }
 
 
 
-static int is_queue_dirty(idmef_queue_t *queue)
+static void worker_leave(void)
 {
-        return bufpool_get_message_count(queue->high) +
-               bufpool_get_message_count(queue->mid)  +
-               bufpool_get_message_count(queue->low);
+        gl_lock_lock(pause_mutex);
+
+        if ( --active_workers == 0 && pause_requested )
+                gl_cond_broadcast(pause_cond);
+
+        gl_lock_unlock(pause_mutex);
 }
 
 
 
-static size_t read_message_scheduled_from_pool(bufpool_t *pool, size_t count)
+static void wake_up_timers(void)
 {
-        size_t proc = 0;
-        prelude_msg_t *msg;
-
-        while ( count-- ) {
-                prelude_return_val_if_fail(bufpool_get_message(pool, &msg) == 1, proc);
+        worker_enter();
 
-                process_message(msg);
-                proc++;
-        }
+        /*
+         * Timer callbacks (heartbeat, plugins timers) expect to run
+         * serialized with GLOBAL plugins.
+         */
+        plugin_lock_global_acquire();
+        prelude_timer_wake_up();
+        plugin_lock_global_release();
 
-        return proc;
+        worker_leave();
 }
 
 
 
-static void read_message_scheduled(idmef_queue_t *queue)
+#ifdef USE_TIMERFD
+
+/*
+ * The timer thread sleep on a CLOCK_MONOTONIC timerfd, so that wall
+ * clock changes don't affect timers, and on an eventfd used to stop it.
+ */
+static void *timer_thread(void *arg)
 {
-        unsigned int j;
-        int ret, i = 0;
-        prelude_msg_t *msg;
-        size_t total, hlen, mlen, llen, proc;
-        bufpool_t *btbl[] = { queue->high, queue->mid, queue->low };
-        const size_t btbl_size = sizeof(btbl) / sizeof(*btbl);
+        int ret;
+        sigset_t set;
+        uint64_t expired;
+        struct pollfd pfd[2];
 
-        hlen = bufpool_get_message_count(queue->high);
-        mlen = bufpool_get_message_count(queue->mid);
-        llen = bufpool_get_message_count(queue->low);
+        sigfillset(&set);
 
-        proc  = read_message_scheduled_from_pool(queue->high, MIN(hlen, sched_process_high));
-        proc += read_message_scheduled_from_pool(queue->mid, MIN(mlen, sched_process_medium));
-        proc += read_message_scheduled_from_pool(queue->low, MIN(llen, sched_process_low));
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
 
-        total = MIN(hlen + mlen + llen - proc, sched_process - proc);
+        pfd[0].fd = timer_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = timer_stop_fd;
+        pfd[1].events = POLLIN;
 
-        while ( total ) {
-                ret = 0;
+        while ( 1 ) {
+                ret = poll(pfd, 2, -1);
+                if ( ret < 0 ) {
+                        if ( errno == EINTR )
+                                continue;
 
-                for ( j = 0; j < btbl_size; j++ ) {
-                        ret = bufpool_get_message(btbl[i++ % btbl_size], &msg);
-                        if ( ret == 1 ) {
-                                process_message(msg);
-                                break;
-                        }
+                        prelude_log(PRELUDE_LOG_ERR, "scheduler timer poll failed: %s.\n", strerror(errno));
+                        break;
                 }
 
-                if ( ret != 1 )
+                if ( pfd[1].revents )
                         break;
 
-                total--;
+                /*
+                 * Missed expirations are folded in a single wake up,
+                 * libprelude timers compare their own deadline.
+                 */
+                if ( read(timer_fd, &expired, sizeof(expired)) == sizeof(expired) )
+                        wake_up_timers();
         }
 
-        prelude_return_if_fail(total == 0);
+        return NULL;
 }
 
 
 
-static void schedule_queued_message(struct timespec *last_wakeup)
+/*
+ * The timerfd is armed before the thread is spawned, so that a failure
+ * is reported to the caller instead of silently leaving timers off.
+ */
+static int timer_start(void)
 {
-        struct timespec end;
-        int dirty, any_queue_dirty;
-        idmef_queue_t *queue = NULL, *bkp = NULL;
+        int ret;
+        struct itimerspec its;
 
-        do {
-                any_queue_dirty = 0;
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if ( timer_fd < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't create scheduler timer: %s.\n", strerror(errno));
+                return -1;
+        }
 
-                while ( 1 ) {
-                        gl_lock_lock(queue_list_mutex);
-                        queue = prelude_list_get_next_safe(&message_queue, queue, bkp, idmef_queue_t, list);
-                        gl_lock_unlock(queue_list_mutex);
+        its.it_value.tv_sec = its.it_interval.tv_sec = 1;
+        its.it_value.tv_nsec = its.it_interval.tv_nsec = 0;
 
-                        if ( ! queue )
-                                break;
+        ret = timerfd_settime(timer_fd, 0, &its, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't arm scheduler timer: %s.\n", strerror(errno));
+                close(timer_fd);
+                return -1;
+        }
 
-                        read_message_scheduled(queue);
+        timer_stop_fd = eventfd(0, EFD_CLOEXEC);
+        if ( timer_stop_fd < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't create scheduler timer eventfd: %s.\n", strerror(errno));
+                close(timer_fd);
+                return -1;
+        }
 
-                        dirty = is_queue_dirty(queue);
-                        any_queue_dirty += dirty;
+        ret = glthread_create(&timer_tid, timer_thread, NULL);
+        if ( ret != 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't create scheduler timer thread.\n");
+                close(timer_stop_fd);
+                close(timer_fd);
+                return -1;
+        }
 
-                        if ( ! dirty && queue->state & QUEUE_STATE_DESTROYED )
-                                queue_destroy(queue);
-                }
+        timer_started = TRUE;
 
-                if ( timespec_expired(get_timespec(&end), last_wakeup) ) {
-                        prelude_timer_wake_up();
-                        last_wakeup->tv_sec = end.tv_sec;
-                        last_wakeup->tv_nsec = end.tv_nsec;
-                }
-        } while ( any_queue_dirty );
+        return 0;
 }
 
 
 
+static void timer_stop(void)
+{
+        uint64_t one = 1;
 
-/*
- * This is the function responssible for handling queued message.
- */
-static void *message_reader(void *arg)
+        if ( ! timer_started )
+                return;
+
+        if ( write(timer_stop_fd, &one, sizeof(one)) != sizeof(one) )
+                prelude_log(PRELUDE_LOG_ERR, "couldn't stop scheduler timer: %s.\n", strerror(errno));
+
+        gl_thread_join(timer_tid, NULL);
+
+        close(timer_stop_fd);
+        close(timer_fd);
+}
+
+#else
+
+static void *timer_thread(void *arg)
 {
         int ret;
         sigset_t set;
-        struct timespec last_wakeup;
+        struct timespec ts;
 
         sigfillset(&set);
 
@@ -384,162 +521,765 @@ static void *message_reader(void *arg)
                 return NULL;
         }
 
-        get_timespec(&last_wakeup);
-        last_wakeup.tv_sec--;
+        get_timespec(&ts);
 
-        while ( ! stop_processing ) {
-                schedule_queued_message(&last_wakeup);
-                wait_for_message(&last_wakeup);
+        gl_lock_lock(timer_mutex);
+
+        while ( ! timer_stopped ) {
+                ts.tv_sec++;
+
+                ret = glthread_cond_timedwait(&timer_cond, &timer_mutex, &ts);
+                if ( ret != ETIMEDOUT )
+                        continue;
+
+                gl_lock_unlock(timer_mutex);
+                wake_up_timers();
+                gl_lock_lock(timer_mutex);
         }
 
-        /*
-         * make sure we don't miss some.
-         */
-        schedule_queued_message(&last_wakeup);
+        gl_lock_unlock(timer_mutex);
 
         return NULL;
 }
 
 
-int idmef_message_schedule(idmef_queue_t *queue, prelude_msg_t *msg)
+
+static int timer_start(void)
 {
         int ret;
-        bufpool_t *mqueue;
 
-        if ( ! queue )
+        ret = glthread_create(&timer_tid, timer_thread, NULL);
+        if ( ret != 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't create scheduler timer thread.\n");
                 return -1;
+        }
 
-        switch (prelude_msg_get_priority(msg)) {
+        timer_started = TRUE;
 
-        case PRELUDE_MSG_PRIORITY_HIGH:
-                mqueue = queue->high;
-                break;
+        return 0;
+}
 
-        case PRELUDE_MSG_PRIORITY_MID:
-                mqueue = queue->mid;
-                break;
 
-        default:
-                mqueue = queue->low;
-                break;
-        }
 
-        ret = bufpool_add_message(mqueue, msg);
-        signal_input_available();
+static void timer_stop(void)
+{
+        if ( ! timer_started )
+                return;
+
+        gl_lock_lock(timer_mutex);
+        timer_stopped = TRUE;
+        gl_cond_signal(timer_cond);
+        gl_lock_unlock(timer_mutex);
 
-        return ret;
+        gl_thread_join(timer_tid, NULL);
 }
 
+#endif
 
 
-static uint64_t get_unique_id(void)
+
+/*
+ * Must be called with the shard mutex held. Pick the priority to serve
+ * next among the non empty run lists, in smooth weighted round robin:
+ * every candidate earn its weight, and the elected one pay the total.
+ */
+static int pick_priority(sched_shard_t *shard)
 {
-        unsigned int id;
-        struct timeval tv;
-        static unsigned int global_id = 0, last_sec = 0;
+        int i, best = -1, total = 0;
 
-        gettimeofday(&tv, NULL);
+        for ( i = 0; i < QUEUE_PRIO_MAX; i++ ) {
+                if ( prelude_list_is_empty(&shard->run_queue[i]) ) {
+                        shard->credit[i] = 0;
+                        continue;
+                }
 
-        gl_lock_lock(queue_list_mutex);
-        if ( tv.tv_sec > last_sec ) {
-                last_sec = tv.tv_sec;
-                global_id = 0;
+                shard->credit[i] += sched_weight[i];
+                total += sched_weight[i];
+
+                if ( best < 0 || shard->credit[i] > shard->credit[best] )
+                        best = i;
         }
 
-        id = global_id++;
-        gl_lock_unlock(queue_list_mutex);
+        if ( best >= 0 )
+                shard->credit[best] -= total;
 
-        return ((uint64_t) id << 32) | last_sec;
+        return best;
 }
 
 
 
-idmef_queue_t *idmef_message_scheduler_queue_new(prelude_client_t *client)
+/*
+ * Wait until a queue of this shard is ready to be processed.
+ */
+static idmef_queue_t *wait_for_queue(sched_shard_t *shard, queue_prio_t *prio)
 {
-        int ret;
-        uint64_t id;
+        int i;
         idmef_queue_t *queue;
-        char buf[PATH_MAX], bdir[PATH_MAX];
 
-        queue = calloc(1, sizeof(*queue));
-        if ( ! queue ) {
-                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
-                return NULL;
-        }
+        gl_lock_lock(shard->mutex);
 
-        id = get_unique_id();
-        prelude_client_profile_get_backup_dirname(prelude_client_get_profile(client), bdir, sizeof(bdir));
+        while ( (i = pick_priority(shard)) < 0 && ! stop_processing )
+                gl_cond_wait(shard->cond, shard->mutex);
 
-        snprintf(buf, sizeof(buf), "%s/high-buffer.%" PRELUDE_PRIu64, bdir, id);
-        ret = bufpool_new(&queue->high, buf);
-        if ( ret < 0 ) {
-                free(queue);
+        if ( i < 0 ) {
+                gl_lock_unlock(shard->mutex);
                 return NULL;
         }
 
-        snprintf(buf, sizeof(buf), "%s/medium-buffer.%" PRELUDE_PRIu64, bdir, id);
-        ret = bufpool_new(&queue->mid, buf);
-        if ( ret < 0 ) {
-                bufpool_destroy(queue->high);
-                free(queue);
-                return NULL;
-        }
+        queue = prelude_list_entry(shard->run_queue[i].next, idmef_queue_t, run_list[i]);
+        prelude_list_del(&queue->run_list[i]);
+        queue->state &= ~QUEUE_STATE_SCHEDULED(i);
 
-        snprintf(buf, sizeof(buf), "%s/low-buffer.%" PRELUDE_PRIu64, bdir, id);
-        ret = bufpool_new(&queue->low, buf);
-        if ( ret < 0 ) {
-                bufpool_destroy(queue->high);
-                bufpool_destroy(queue->mid);
-                free(queue);
-                return NULL;
-        }
+        gl_lock_unlock(shard->mutex);
 
-        gl_lock_lock(queue_list_mutex);
-        prelude_list_add_tail(&message_queue, &queue->list);
-        gl_lock_unlock(queue_list_mutex);
+        *prio = i;
 
         return queue;
 }
 
 
 
-
-void idmef_message_scheduler_queue_destroy(idmef_queue_t *queue)
+static void prefilter_account(prelude_bool_t dropped)
 {
-        queue->state |= QUEUE_STATE_DESTROYED;
-        signal_input_available();
+        if ( dropped )
+                prefilter_dropped++;
+
+        if ( ++prefilter_seen < PREFILTER_WINDOW )
+                return;
+
+        prefilter_enabled = ( prefilter_dropped * 100 >= prefilter_seen * PREFILTER_DROP_RATIO );
+        prefilter_seen = prefilter_dropped = 0;
 }
 
 
 
-#include <libprelude/prelude-failover.h>
-extern prelude_client_t *manager_client;
+/*
+ * Alert children the normalization might rewrite.
+ */
+static uint32_t get_normalized_mask(void)
+{
+        return pmsg_to_idmef_get_child_mask("analyzer") |
+               pmsg_to_idmef_get_child_mask("source") |
+               pmsg_to_idmef_get_child_mask("target");
+}
+
 
 
-static int flush_failover(prelude_failover_t *failover, const char *name)
+/*
+ * When the only use of an alert is reporting, and the reporting filters
+ * reject enough of them, decode the parts these filters look at first,
+ * so that rejected alerts don't get fully decoded. Accepted alerts are
+ * decoded twice, hence the drop ratio requirement.
+ *
+ * Return -1 if the alert is rejected, 1 if it went through the reporting
+ * filters, 0 if it wasn't looked at. *sample is set if the reporting
+ * filters verdict count toward the drop ratio.
+ */
+static int prefilter_message(prelude_msg_t *msg, prelude_bool_t *sample)
 {
         int ret;
-        prelude_msg_t *msg;
-        unsigned long available;
+        uint32_t mask;
+        idmef_message_t *idmef;
 
-        available = prelude_failover_get_available_msg_count(failover);
+        *sample = FALSE;
 
-        if ( available == 0 )
+        if ( ! filter_plugins_get_category_mask(MANAGER_FILTER_CATEGORY_REPORTING, &mask) )
                 return 0;
 
-        prelude_log(PRELUDE_LOG_INFO, "%s: flushing %lu buffered messages from a previous run.\n",
-                    name, available);
-
-        do {
-                ret = prelude_failover_get_saved_msg(failover, &msg);
-                if ( ret <= 0 )
-                        break;
+        if ( reverse_relay_has_receiver() )
+                return 0;
 
-                process_message(msg);
-        } while ( 1 );
+        *sample = TRUE;
 
-        return ret;
-}
+        if ( ! prefilter_enabled )
+                return 0;
+
+        ret = pmsg_to_idmef_partial(&idmef, msg, mask);
+        if ( ret < 0 )
+                return 0;
+
+        /*
+         * Filters see the alert as normalized. The partial alert is
+         * thrown away, only pay for it if the filters look at what
+         * might change.
+         */
+        if ( mask & get_normalized_mask() )
+                decode_plugins_run(0, NULL, idmef);
+
+        ret = filter_plugins_run_by_category(idmef, MANAGER_FILTER_CATEGORY_REPORTING);
+
+        pmsg_forward_release(idmef);
+        idmef_message_destroy(idmef);
+
+        prefilter_account(ret < 0);
+
+        return ( ret < 0 ) ? -1 : 1;
+}
+
+
+
+static int process_idmef(idmef_message_t *idmef, prelude_bool_t filtered);
+
+
+
+static int process_message(prelude_msg_t *msg)
+{
+        int ret;
+        idmef_message_t *idmef;
+        prelude_bool_t filtered, sample = FALSE;
+
+        message_arena_enter();
+
+        ret = filter_plugins_run_raw(msg);
+        if ( ret == 0 )
+                ret = prefilter_message(msg, &sample);
+
+        if ( ret < 0 ) {
+                message_arena_leave();
+                prelude_msg_destroy(msg);
+                return 0;
+        }
+
+        filtered = ( ret > 0 );
+
+        ret = pmsg_to_idmef(&idmef, msg);
+        if ( ret < 0 ) {
+                message_arena_leave();
+                prelude_msg_destroy(msg);
+
+                /*
+                 * FIXME: need a way to close connection on invalid message.
+                 */
+                prelude_log(PRELUDE_LOG_ERR, "Invalid message received.\n");
+                return ret;
+        }
+
+        /*
+         * prelude-msg is usefull for report plugin failover.
+         * We don't need to call prelude_msg_destroy(), as
+         * idmef_message_destroy() will consequently do this for us.
+         */
+        idmef_message_set_pmsg(idmef, msg);
+
+        ret = process_idmef(idmef, filtered);
+        message_arena_leave();
+
+        if ( sample && ! filtered )
+                prefilter_account(ret < 0);
+
+        idmef_message_destroy(idmef);
+
+        return 0;
+}
+
+
+
+static void queue_destroy(idmef_queue_t *queue)
+{
+        int i;
+
+        for ( i = 0; i < QUEUE_PRIO_MAX; i++ )
+                bufpool_destroy(queue->pool[i]);
+
+        gl_lock_lock(queue_list_mutex);
+
+        prelude_list_del(&queue->list);
+
+        if ( free_queues_count < QUEUE_FREE_MAX ) {
+                prelude_list_add(&free_queues, &queue->list);
+                free_queues_count++;
+                queue = NULL;
+        }
+
+        gl_lock_unlock(queue_list_mutex);
+
+        free(queue);
+}
+
+
+
+static int is_queue_dirty(idmef_queue_t *queue)
+{
+        return bufpool_get_message_count(queue->pool[QUEUE_PRIO_HIGH]) +
+               bufpool_get_message_count(queue->pool[QUEUE_PRIO_MID])  +
+               bufpool_get_message_count(queue->pool[QUEUE_PRIO_LOW]);
+}
+
+
+
+static void recovery_wake_up(idmef_queue_t *queue);
+
+
+
+/*
+ * Serve one priority of the queue, up to its deficit. Message are
+ * accounted one unit each, and the deficit left is only kept while
+ * the queue still has messages of this priority.
+ */
+static void read_message_scheduled(idmef_queue_t *queue, queue_prio_t prio)
+{
+        prelude_msg_t *msg;
+        bufpool_t *pool = queue->pool[prio];
+
+        queue->deficit[prio] += SCHED_QUANTUM * queue->weight;
+
+        while ( queue->deficit[prio] > 0 ) {
+                if ( bufpool_get_message(pool, &msg) != 1 )
+                        break;
+
+                /*
+                 * Pair with the store in recover_message().
+                 */
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if ( __atomic_load_n(&queue->recovery_waiting, __ATOMIC_RELAXED) )
+                        recovery_wake_up(queue);
+
+                process_message(msg);
+                queue->deficit[prio]--;
+        }
+
+        if ( bufpool_get_message_count(pool) == 0 )
+                queue->deficit[prio] = 0;
+}
+
+
+
+static void release_queue(idmef_queue_t *queue, queue_prio_t prio)
+{
+        size_t count;
+        prelude_bool_t destroy = FALSE;
+
+        /*
+         * A message queued after this point will put the queue back
+         * in the run list by itself.
+         */
+        count = bufpool_get_message_count(queue->pool[prio]);
+
+        gl_lock_lock(queue->shard->mutex);
+
+        if ( count )
+                queue_schedule(queue, prio);
+
+        else if ( queue->state & QUEUE_STATE_DESTROYED && ! (queue->state & QUEUE_STATE_SCHEDULED_ANY) )
+                destroy = TRUE;
+
+        gl_lock_unlock(queue->shard->mutex);
+
+        if ( destroy )
+                queue_destroy(queue);
+}
+
+
+
+static void set_thread_affinity(sched_shard_t *shard)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+        int ret;
+        long ncpu;
+        cpu_set_t set;
+
+        if ( sched_workers == 1 )
+                return;
+
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        if ( ncpu <= 1 )
+                return;
+
+        CPU_ZERO(&set);
+        CPU_SET(shard->id % ncpu, &set);
+
+        ret = sched_setaffinity(0, sizeof(set), &set);
+        if ( ret < 0 )
+                prelude_log(PRELUDE_LOG_WARN, "could not bind processing thread %u to CPU %ld: %s.\n",
+                            shard->id, shard->id % ncpu, strerror(errno));
+#endif
+}
+
+
+
+
+/*
+ * This is the function responssible for handling queued message.
+ */
+static void *message_reader(void *arg)
+{
+        int ret;
+        sigset_t set;
+        queue_prio_t prio;
+        idmef_queue_t *queue;
+        sched_shard_t *shard = arg;
+
+        sigfillset(&set);
+
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        set_thread_affinity(shard);
+
+        /*
+         * Once processing is stopped, keep going until the run
+         * list is empty, so that we don't miss some.
+         */
+        while ( (queue = wait_for_queue(shard, &prio)) ) {
+                worker_enter();
+
+                read_message_scheduled(queue, prio);
+                release_queue(queue, prio);
+
+                worker_leave();
+        }
+
+        return NULL;
+}
+
+
+static queue_prio_t get_message_prio(prelude_msg_t *msg)
+{
+        switch (prelude_msg_get_priority(msg)) {
+
+        case PRELUDE_MSG_PRIORITY_HIGH:
+                return QUEUE_PRIO_HIGH;
+
+        case PRELUDE_MSG_PRIORITY_MID:
+                return QUEUE_PRIO_MID;
+
+        default:
+                return QUEUE_PRIO_LOW;
+        }
+}
+
+
+
+int idmef_message_schedule(idmef_queue_t *queue, prelude_msg_t *msg)
+{
+        int ret;
+        queue_prio_t prio;
+
+        if ( ! queue )
+                return -1;
+
+        prio = get_message_prio(msg);
+
+        ret = bufpool_add_message(queue->pool[prio], msg);
+        signal_input_available(queue, prio);
+
+        return ret;
+}
+
+
+
+/*
+ * Schedule messages coming from a single connection. Messages are
+ * split by priority, keeping their order, each pool is fed at once,
+ * and the processing thread is woken up at most once. All messages
+ * are consumed, even on error.
+ */
+int idmef_message_schedule_batch(idmef_queue_t *queue, prelude_msg_t **msgs, size_t count)
+{
+        int ret = 0, err;
+        size_t i, n;
+        queue_prio_t prio;
+        prelude_bool_t wakeup = FALSE;
+        prelude_msg_t *batch[SCHED_BATCH_MAX];
+        unsigned int used = 0;
+
+        if ( ! queue ) {
+                for ( i = 0; i < count; i++ )
+                        prelude_msg_destroy(msgs[i]);
+
+                return -1;
+        }
+
+        for ( prio = 0; prio < QUEUE_PRIO_MAX; prio++ ) {
+                n = 0;
+
+                for ( i = 0; i < count; i++ ) {
+                        if ( get_message_prio(msgs[i]) != prio )
+                                continue;
+
+                        batch[n++] = msgs[i];
+
+                        if ( n == SCHED_BATCH_MAX ) {
+                                err = bufpool_add_messages(queue->pool[prio], batch, n);
+                                if ( err < 0 )
+                                        ret = err;
+                                n = 0;
+                        }
+
+                        used |= 1 << prio;
+                }
+
+                if ( n ) {
+                        err = bufpool_add_messages(queue->pool[prio], batch, n);
+                        if ( err < 0 )
+                                ret = err;
+                }
+        }
+
+        if ( ! used )
+                return ret;
+
+        gl_lock_lock(queue->shard->mutex);
+
+        for ( prio = 0; prio < QUEUE_PRIO_MAX; prio++ ) {
+                if ( used & (1 << prio) && queue_link(queue, prio) )
+                        wakeup = TRUE;
+        }
+
+        if ( wakeup )
+                gl_cond_signal(queue->shard->cond);
+
+        gl_lock_unlock(queue->shard->mutex);
+
+        return ret;
+}
+
+
+static uint64_t get_unique_id(void)
+{
+        unsigned int id;
+        struct timeval tv;
+        static unsigned int global_id = 0, last_sec = 0;
+
+        gettimeofday(&tv, NULL);
+
+        gl_lock_lock(queue_list_mutex);
+        if ( tv.tv_sec > last_sec ) {
+                last_sec = tv.tv_sec;
+                global_id = 0;
+        }
+
+        id = global_id++;
+        gl_lock_unlock(queue_list_mutex);
+
+        return ((uint64_t) id << 32) | last_sec;
+}
+
+
+
+/*
+ * The spill file name is only built once a pool goes to disk.
+ */
+static void get_pool_filename(void *data, char *buf, size_t size)
+{
+        queue_pool_name_t *name = data;
+        static const char *prio_name[QUEUE_PRIO_MAX] = { "high", "medium", "low" };
+
+        snprintf(buf, size, "%s/%s-buffer.%" PRELUDE_PRIu64, backup_dirname, prio_name[name->prio], name->queue->id);
+}
+
+
+
+static idmef_queue_t *queue_alloc(void)
+{
+        idmef_queue_t *queue = NULL;
+
+        gl_lock_lock(queue_list_mutex);
+
+        if ( ! prelude_list_is_empty(&free_queues) ) {
+                queue = prelude_list_entry(free_queues.next, idmef_queue_t, list);
+                prelude_list_del(&queue->list);
+                free_queues_count--;
+        }
+
+        gl_lock_unlock(queue_list_mutex);
+
+        if ( ! queue )
+                return calloc(1, sizeof(*queue));
+
+        memset(queue, 0, sizeof(*queue));
+
+        return queue;
+}
+
+
+
+idmef_queue_t *idmef_message_scheduler_queue_new(prelude_client_t *client, uint64_t analyzerid)
+{
+        int ret, i;
+        idmef_queue_t *queue;
+
+        queue = queue_alloc();
+        if ( ! queue ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return NULL;
+        }
+
+        queue->id = get_unique_id();
+        queue->shard = get_shard(analyzerid);
+        queue->weight = get_analyzer_weight(analyzerid);
+
+        for ( i = 0; i < QUEUE_PRIO_MAX; i++ ) {
+                queue->pool_name[i].queue = queue;
+                queue->pool_name[i].prio = i;
+
+                ret = bufpool_new(&queue->pool[i], get_pool_filename, &queue->pool_name[i]);
+                if ( ret < 0 ) {
+                        while ( i-- )
+                                bufpool_destroy(queue->pool[i]);
+
+                        free(queue);
+                        return NULL;
+                }
+        }
+
+        gl_lock_lock(queue_list_mutex);
+        prelude_list_add_tail(&message_queue, &queue->list);
+        gl_lock_unlock(queue_list_mutex);
+
+        return queue;
+}
+
+
+
+
+void idmef_message_scheduler_queue_destroy(idmef_queue_t *queue)
+{
+        gl_lock_lock(queue->shard->mutex);
+
+        queue->state |= QUEUE_STATE_DESTROYED;
+
+        /*
+         * A queue still scheduled is destroyed once the last run list
+         * release it, otherwise make the worker look at it.
+         */
+        if ( ! (queue->state & QUEUE_STATE_SCHEDULED_ANY) )
+                queue_schedule(queue, QUEUE_PRIO_LOW);
+
+        gl_lock_unlock(queue->shard->mutex);
+}
+
+
+
+#include <libprelude/prelude-failover.h>
+extern prelude_client_t *manager_client;
+
+
+/*
+ * Buffers left by a previous run are replayed in the background, in
+ * high to low priority order, while the manager already accept
+ * connections. Recovered messages go through a regular queue, whose
+ * backlog is kept under RECOVERY_BACKLOG so that replaying doesn't
+ * end up spilling to disk again.
+ */
+#define RECOVERY_BACKLOG 1024
+#define RECOVERY_REPORT_INTERVAL 10
+
+
+typedef struct {
+        prelude_list_t list;
+        unsigned int id;
+        unsigned int priority;
+        char filename[PATH_MAX];
+        const char *name;
+} recovery_job_t;
+
+
+typedef struct {
+        idmef_queue_t *queue;
+        unsigned long count;
+} recovery_ctx_t;
+
+
+static PRELUDE_LIST(recovery_jobs);
+static gl_lock_t recovery_mutex = gl_lock_initializer;
+static gl_cond_t recovery_cond = gl_cond_initializer;
+static gl_thread_t *recovery_threads = NULL;
+static unsigned int recovery_nthreads = 0;
+static unsigned int recovery_total = 0;
+static unsigned int recovery_done = 0;
+static unsigned long recovery_count = 0;
+static time_t recovery_last_report = 0;
+static volatile sig_atomic_t recovery_stop = 0;
+
+
+
+/*
+ * recovery_mutex must be held.
+ */
+static void recovery_report(time_t now)
+{
+        recovery_last_report = now;
+
+        prelude_log(PRELUDE_LOG_INFO, "recovered %lu buffered messages, %u of %u buffers done.\n",
+                    recovery_count, recovery_done, recovery_total);
+}
+
+
+
+/*
+ * Called by the workers for a queue a recovery thread is waiting on.
+ */
+static void recovery_wake_up(idmef_queue_t *queue)
+{
+        if ( is_queue_dirty(queue) > RECOVERY_BACKLOG )
+                return;
+
+        gl_lock_lock(recovery_mutex);
+        gl_cond_broadcast(recovery_cond);
+        gl_lock_unlock(recovery_mutex);
+}
+
+
+
+/*
+ * Once recovery_stop is set, messages are still queued, so that the
+ * scheduler keep them on disk, but without waiting for the workers.
+ */
+static void recover_message(prelude_msg_t *msg, void *data)
+{
+        time_t now;
+        recovery_ctx_t *ctx = data;
+
+        idmef_message_schedule(ctx->queue, msg);
+        ctx->count++;
+
+        gl_lock_lock(recovery_mutex);
+
+        recovery_count++;
+
+        now = time(NULL);
+        if ( now - recovery_last_report >= RECOVERY_REPORT_INTERVAL )
+                recovery_report(now);
+
+        /*
+         * Let the processing threads catch up: they signal once the
+         * queue is back under the backlog.
+         */
+        __atomic_store_n(&ctx->queue->recovery_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        while ( ! recovery_stop && is_queue_dirty(ctx->queue) > RECOVERY_BACKLOG )
+                gl_cond_wait(recovery_cond, recovery_mutex);
+
+        __atomic_store_n(&ctx->queue->recovery_waiting, 0, __ATOMIC_RELAXED);
+
+        gl_lock_unlock(recovery_mutex);
+}
+
+
+
+static int flush_failover(prelude_failover_t *failover, recovery_ctx_t *ctx)
+{
+        int ret;
+        prelude_msg_t *msg;
+
+        do {
+                if ( recovery_stop )
+                        return 0;
+
+                ret = prelude_failover_get_saved_msg(failover, &msg);
+                if ( ret <= 0 )
+                        break;
+
+                recover_message(msg, ctx);
+        } while ( 1 );
+
+        return ret;
+}
 
 
 
@@ -566,16 +1306,213 @@ static int failover_unlink(const char *dirname)
 
 
 
+static void recover_job(recovery_job_t *job)
+{
+        ssize_t ret;
+        recovery_ctx_t ctx;
+        prelude_failover_t *failover;
+
+        ctx.count = 0;
+        ctx.queue = idmef_message_scheduler_queue_new(manager_client, job->id);
+        if ( ! ctx.queue )
+                return;
+
+        if ( bufpool_is_spill(job->filename) ) {
+                ret = bufpool_recover(job->filename, recover_message, &ctx);
+                if ( ret < 0 )
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't recover spill file '%s': %s.\n", job->filename, prelude_strerror(ret));
+        }
+
+        /*
+         * Failover directory from an older version.
+         */
+        else {
+                ret = prelude_failover_new(&failover, job->filename);
+                if ( ret < 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't open failover '%s': %s.\n", job->filename, prelude_strerror(ret));
+                        idmef_message_scheduler_queue_destroy(ctx.queue);
+                        return;
+                }
+
+                flush_failover(failover, &ctx);
+                prelude_failover_destroy(failover);
+
+                /*
+                 * Interrupted: what wasn't read stay in the failover.
+                 */
+                ret = ( recovery_stop ) ? 0 : failover_unlink(job->filename);
+                if ( ret < 0 )
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't remove failover '%s': %s.\n", job->filename, prelude_strerror(ret));
+        }
+
+        idmef_message_scheduler_queue_destroy(ctx.queue);
+
+        if ( ctx.count > 0 )
+                prelude_log(PRELUDE_LOG_INFO, "%s: recovered %lu buffered messages from a previous run.\n",
+                            job->name, ctx.count);
+}
+
+
+
+static void *recovery_thread(void *arg)
+{
+        int ret;
+        sigset_t set;
+        recovery_job_t *job;
+
+        sigfillset(&set);
+
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        while ( 1 ) {
+                gl_lock_lock(recovery_mutex);
+
+                if ( recovery_stop || prelude_list_is_empty(&recovery_jobs) ) {
+                        gl_lock_unlock(recovery_mutex);
+                        break;
+                }
+
+                job = prelude_list_entry(recovery_jobs.next, recovery_job_t, list);
+                prelude_list_del(&job->list);
+
+                gl_lock_unlock(recovery_mutex);
+
+                recover_job(job);
+                free(job);
+
+                gl_lock_lock(recovery_mutex);
+
+                if ( ++recovery_done == recovery_total )
+                        prelude_log(PRELUDE_LOG_INFO, "recovery complete, %lu buffered messages replayed from %u buffers.\n",
+                                    recovery_count, recovery_total);
+
+                gl_lock_unlock(recovery_mutex);
+        }
+
+        return NULL;
+}
+
+
+
+/*
+ * Queue a buffer for recovery, keeping higher priority buffers first.
+ */
+static int add_recovery_job(const char *bdir, const char *name)
+{
+        prelude_list_t *tmp;
+        recovery_job_t *job, *cur;
+
+        job = malloc(sizeof(*job));
+        if ( ! job ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        snprintf(job->filename, sizeof(job->filename), "%s/%s", bdir, name);
+        job->name = strrchr(job->filename, '/') + 1;
+        job->id = recovery_total++;
+
+        if ( strncmp(name, "high-", 5) == 0 )
+                job->priority = 0;
+
+        else if ( strncmp(name, "medium-", 7) == 0 )
+                job->priority = 1;
+
+        else
+                job->priority = 2;
+
+        prelude_list_for_each(&recovery_jobs, tmp) {
+                cur = prelude_list_entry(tmp, recovery_job_t, list);
+                if ( cur->priority > job->priority )
+                        break;
+        }
+
+        prelude_list_add_tail(tmp, &job->list);
+
+        return 0;
+}
+
+
+
+static int start_recovery(void)
+{
+        int ret;
+        unsigned int i, count;
+
+        if ( ! recovery_total )
+                return 0;
+
+        count = MIN(sched_workers, recovery_total);
+
+        recovery_threads = calloc(count, sizeof(*recovery_threads));
+        if ( ! recovery_threads ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        for ( i = 0; i < count; i++ ) {
+                ret = glthread_create(&recovery_threads[i], recovery_thread, NULL);
+                if ( ret != 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't create recovery thread.\n");
+                        break;
+                }
+        }
+
+        recovery_nthreads = i;
+        if ( ! recovery_nthreads )
+                return -1;
+
+        prelude_log(PRELUDE_LOG_INFO, "Recovering %u buffers from a previous run in the background.\n", recovery_total);
+
+        return 0;
+}
+
+
+
+/*
+ * Buffers not recovered yet are left on disk for the next run.
+ */
+static void stop_recovery(void)
+{
+        unsigned int i;
+        recovery_job_t *job;
+        prelude_list_t *tmp, *bkp;
+
+        gl_lock_lock(recovery_mutex);
+        recovery_stop = 1;
+        gl_cond_broadcast(recovery_cond);
+        gl_lock_unlock(recovery_mutex);
+
+        for ( i = 0; i < recovery_nthreads; i++ )
+                gl_thread_join(recovery_threads[i], NULL);
+
+        free(recovery_threads);
+        recovery_threads = NULL;
+        recovery_nthreads = 0;
+
+        prelude_list_for_each_safe(&recovery_jobs, tmp, bkp) {
+                job = prelude_list_entry(tmp, recovery_job_t, list);
+                prelude_list_del(&job->list);
+                free(job);
+        }
+}
+
+
+
 int idmef_message_scheduler_init(void)
 {
         int ret;
         DIR *dir;
+        unsigned int i;
         struct dirent *de;
         char bdir[PATH_MAX];
-        char filename[PATH_MAX];
-        prelude_failover_t *failover;
 
         prelude_client_profile_get_backup_dirname(prelude_client_get_profile(manager_client), bdir, sizeof(bdir));
+        strncpy(backup_dirname, bdir, sizeof(backup_dirname) - 1);
 
         dir = opendir(bdir);
         if ( ! dir ) {
@@ -587,27 +1524,51 @@ int idmef_message_scheduler_init(void)
                 if ( ! strstr(de->d_name, "buffer") )
                         continue;
 
-                snprintf(filename, sizeof(filename), "%s/%s", bdir, de->d_name);
-
-                ret = prelude_failover_new(&failover, filename);
-                if ( ret < 0 )
+                ret = add_recovery_job(bdir, de->d_name);
+                if ( ret < 0 ) {
+                        closedir(dir);
                         return ret;
+                }
+        }
 
-                flush_failover(failover, de->d_name);
-                prelude_failover_destroy(failover);
+        closedir(dir);
 
-                ret = failover_unlink(filename);
-                if ( ret < 0 )
-                        prelude_log(PRELUDE_LOG_ERR, "couldn't remove failover '%s': %s.\n", filename, prelude_strerror(ret));
+        ret = bufpool_init();
+        if ( ret < 0 )
+                return ret;
+
+        shards = calloc(sched_workers, sizeof(*shards));
+        if ( ! shards ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
         }
 
-        closedir(dir);
+        for ( i = 0; i < sched_workers; i++ ) {
+                shards[i].id = i;
+                gl_lock_init(shards[i].mutex);
+                gl_cond_init(shards[i].cond);
+                prelude_list_init(&shards[i].run_queue[QUEUE_PRIO_HIGH]);
+                prelude_list_init(&shards[i].run_queue[QUEUE_PRIO_MID]);
+                prelude_list_init(&shards[i].run_queue[QUEUE_PRIO_LOW]);
+        }
+
+        for ( i = 0; i < sched_workers; i++ ) {
+                ret = glthread_create(&shards[i].thread, &message_reader, &shards[i]);
+                if ( ret != 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't create message processing thread.\n");
+                        sched_workers = i;
+                        return -1;
+                }
+        }
 
-        ret = glthread_create(&thread, &message_reader, NULL);
+        ret = timer_start();
         if ( ret < 0 )
-                prelude_log(PRELUDE_LOG_ERR, "couldn't create message processing thread.\n");
+                return ret;
 
-        return ret;
+        if ( sched_workers > 1 )
+                prelude_log(PRELUDE_LOG_INFO, "Started %u message processing threads.\n", sched_workers);
+
+        return start_recovery();
 }
 
 
@@ -615,78 +1576,170 @@ int idmef_message_scheduler_init(void)
 
 void idmef_message_scheduler_exit(void)
 {
+        unsigned int i;
         idmef_queue_t *queue;
         prelude_list_t *tmp, *bkp;
 
-        gl_lock_lock(input_mutex);
-
+        stop_recovery();
         stop_processing = 1;
-        gl_cond_signal(input_cond);
 
-        gl_lock_unlock(input_mutex);
+        for ( i = 0; i < sched_workers; i++ ) {
+                gl_lock_lock(shards[i].mutex);
+                gl_cond_signal(shards[i].cond);
+                gl_lock_unlock(shards[i].mutex);
+        }
 
         prelude_log(PRELUDE_LOG_INFO, "Waiting queued message to be processed.\n");
-        gl_thread_join(thread, NULL);
 
-        gl_cond_destroy(input_cond);
-        gl_lock_destroy(input_mutex);
+        for ( i = 0; i < sched_workers; i++ ) {
+                gl_thread_join(shards[i].thread, NULL);
+                gl_cond_destroy(shards[i].cond);
+                gl_lock_destroy(shards[i].mutex);
+        }
+
+        timer_stop();
 
         prelude_list_for_each_safe(&message_queue, tmp, bkp) {
                 queue = prelude_list_entry(tmp, idmef_queue_t, list);
                 queue_destroy(queue);
         }
+
+        /*
+         * Pooled queues already released their buffer pools.
+         */
+        prelude_list_for_each_safe(&free_queues, tmp, bkp) {
+                queue = prelude_list_entry(tmp, idmef_queue_t, list);
+                prelude_list_del(&queue->list);
+                free(queue);
+        }
+
+        free_queues_count = 0;
+
+        free(shards);
+
+        bufpool_exit();
 }
 
 
 
 
-void idmef_message_process(idmef_message_t *idmef)
+/*
+ * filtered is set for alerts the prefilter already ran through the
+ * reporting filters, which must not see them twice. Normalization
+ * still apply, as the prefilter at most normalized a partial copy.
+ * Return -1 if the reporting filters rejected the message.
+ */
+static int process_idmef(idmef_message_t *idmef, prelude_bool_t filtered)
 {
-        int ret = 0;
+        int ret = 0, reported;
         prelude_bool_t relay_filter_available = 0;
 
-        gl_lock_lock(process_mutex);
+        message_arena_enter();
 
         /*
-         * run normalization plugin.
+         * run normalization plugin, which report the changes it make
+         * through pmsg_forward_set_modified().
          */
         decode_plugins_run(0, NULL, idmef);
 
         /*
          * run simple reporting plugin.
          */
-        report_plugins_run(idmef);
+        reported = report_plugins_run(idmef, filtered);
 
         relay_filter_available = filter_plugins_available(MANAGER_FILTER_CATEGORY_REVERSE_RELAYING);
         if ( relay_filter_available )
                 ret = filter_plugins_run_by_category(idmef, MANAGER_FILTER_CATEGORY_REVERSE_RELAYING);
 
-        gl_lock_unlock(process_mutex);
-
         if ( ret == 0 )
                 reverse_relay_send_receiver(idmef);
+
+        pmsg_forward_release(idmef);
+        message_arena_leave();
+
+        return reported;
+}
+
+
+
+void idmef_message_process(idmef_message_t *idmef)
+{
+        process_idmef(idmef, FALSE);
 }
 
 
 
+/*
+ * Wait for every worker to be idle, and prevent them from processing
+ * further messages. Must not be called from a processing thread.
+ */
 void idmef_message_scheduler_stop_processing(void)
 {
-        gl_lock_lock(process_mutex);
+        gl_lock_lock(pause_mutex);
+
+        pause_requested++;
+        while ( active_workers )
+                gl_cond_wait(pause_cond, pause_mutex);
+
+        gl_lock_unlock(pause_mutex);
+
+        plugin_lock_global_acquire();
 }
 
 
 
 void idmef_message_scheduler_start_processing(void)
 {
-        gl_lock_unlock(process_mutex);
+        plugin_lock_global_release();
+
+        gl_lock_lock(pause_mutex);
+
+        if ( --pause_requested == 0 )
+                gl_cond_broadcast(pause_cond);
+
+        gl_lock_unlock(pause_mutex);
 }
 
 
 
 void idmef_message_scheduler_set_priority(unsigned int high, unsigned int medium, unsigned int low)
 {
-        sched_process_high = high;
-        sched_process_medium = medium;
-        sched_process_low = low;
-        sched_process = high + medium + low;
+        sched_weight[QUEUE_PRIO_HIGH] = high;
+        sched_weight[QUEUE_PRIO_MID] = medium;
+        sched_weight[QUEUE_PRIO_LOW] = low;
+}
+
+
+
+int idmef_message_scheduler_set_analyzer_weight(uint64_t analyzerid, unsigned int weight)
+{
+        prelude_list_t *tmp;
+        analyzer_weight_t *aw;
+
+        prelude_list_for_each(&analyzer_weights, tmp) {
+                aw = prelude_list_entry(tmp, analyzer_weight_t, list);
+                if ( aw->analyzerid == analyzerid ) {
+                        aw->weight = weight;
+                        return 0;
+                }
+        }
+
+        aw = malloc(sizeof(*aw));
+        if ( ! aw ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        aw->analyzerid = analyzerid;
+        aw->weight = weight;
+        prelude_list_add_tail(&analyzer_weights, &aw->list);
+
+        return 0;
+}
+
+
+
+void idmef_message_scheduler_set_workers(unsigned int count)
+{
+        sched_workers = (count > 0) ? count : 1;
 }
@@ -0,0 +1,80 @@
+/*****
+*
+* Copyright (C) 2008 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#ifndef _MANAGER_BUFPOOL_BACKEND_H
+#define _MANAGER_BUFPOOL_BACKEND_H
+
+/*
+ * Spill storage used once a bufpool is moved to disk. Writes happen
+ * from the spill writer thread, reads from the pool consumer; both are
+ * never called concurrently for the same handle, except write() and
+ * read() which must support it.
+ */
+typedef struct {
+        const char *name;
+
+        int (*open)(void **handle, const char *filename);
+
+        /*
+         * Append the batch of messages, return the number of
+         * messages fully written.
+         */
+        size_t (*write)(void *handle, prelude_list_t *batch);
+
+        int (*read)(void *handle, prelude_msg_t **msg);
+
+        /*
+         * Discard everything written so far.
+         */
+        void (*skip)(void *handle);
+
+        /*
+         * Every written message was read, and no write is in progress:
+         * the storage might be rewound.
+         */
+        void (*reset)(void *handle);
+
+        void (*sync)(void *handle);
+
+        /*
+         * Release the handle, keeping unread messages for the next
+         * run if keep is set.
+         */
+        void (*close)(void *handle, const char *filename, prelude_bool_t keep);
+
+        prelude_bool_t (*is_spill)(const char *path);
+
+        /*
+         * Replay then remove a spill left by a previous run.
+         */
+        ssize_t (*recover)(const char *path, void (*cb)(prelude_msg_t *msg, void *data), void *data);
+} bufpool_backend_t;
+
+
+extern const bufpool_backend_t bufpool_file_backend;
+
+#ifdef HAVE_FMEMOPEN
+extern const bufpool_backend_t bufpool_segment_backend;
+#endif
+
+#endif /* _MANAGER_BUFPOOL_BACKEND_H */
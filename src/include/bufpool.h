@@ -23,10 +23,26 @@
 
 typedef struct bufpool bufpool_t;
 
+typedef enum {
+        BUFPOOL_SYNC_NONE     = 0,
+        BUFPOOL_SYNC_BATCH    = 1,
+        BUFPOOL_SYNC_INTERVAL = 2
+} bufpool_sync_t;
+
+/*
+ * Build the name of the file a pool spill to, only called once the
+ * pool actually need to go to disk.
+ */
+typedef void (bufpool_filename_func_t)(void *data, char *buf, size_t size);
+
+int bufpool_init(void);
+
+void bufpool_exit(void);
+
 
 void bufpool_destroy(bufpool_t *bp);
 
-int bufpool_new(bufpool_t **bp, const char *filename);
+int bufpool_new(bufpool_t **bp, bufpool_filename_func_t *getname, void *data);
 
 size_t bufpool_get_message_count(bufpool_t *bp);
 
@@ -34,6 +50,20 @@ int bufpool_get_message(bufpool_t *bp, prelude_msg_t **msg);
 
 int bufpool_add_message(bufpool_t *bp, prelude_msg_t *msg);
 
+int bufpool_add_messages(bufpool_t *bp, prelude_msg_t **msgs, size_t count);
+
 void bufpool_set_disk_threshold(size_t threshold);
 
+void bufpool_set_disk_quota(size_t quota);
+
+prelude_bool_t bufpool_is_over_disk_quota(void);
+
+void bufpool_set_sync_policy(bufpool_sync_t policy, unsigned int interval);
+
 void bufpool_print_stats(void);
+
+int bufpool_set_backend(const char *name);
+
+prelude_bool_t bufpool_is_spill(const char *path);
+
+ssize_t bufpool_recover(const char *path, void (*cb)(prelude_msg_t *msg, void *data), void *data);
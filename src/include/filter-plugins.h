@@ -32,6 +32,10 @@ int filter_plugins_run_by_category(idmef_message_t *msg, manager_filter_category
 
 int filter_plugins_run_by_plugin(idmef_message_t *message, prelude_plugin_instance_t *plugin);
 
+prelude_bool_t filter_plugins_get_category_mask(manager_filter_category_t cat, uint32_t *mask);
+
+int filter_plugins_run_raw(prelude_msg_t *msg);
+
 
 #endif /* _MANAGER_PLUGIN_FILTER_H */
 
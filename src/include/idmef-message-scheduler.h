@@ -31,9 +31,11 @@ void idmef_message_scheduler_exit(void);
 
 int idmef_message_schedule(idmef_queue_t *queue, prelude_msg_t *msg);
 
+int idmef_message_schedule_batch(idmef_queue_t *queue, prelude_msg_t **msgs, size_t count);
+
 void idmef_message_process(idmef_message_t *idmef);
 
-idmef_queue_t *idmef_message_scheduler_queue_new(prelude_client_t *client);
+idmef_queue_t *idmef_message_scheduler_queue_new(prelude_client_t *client, uint64_t analyzerid);
 
 void idmef_message_scheduler_queue_destroy(idmef_queue_t *queue);
 
@@ -44,4 +46,8 @@ void idmef_message_scheduler_start_processing(void);
 
 void idmef_message_scheduler_set_priority(unsigned int high, unsigned int medium, unsigned int low);
 
+int idmef_message_scheduler_set_analyzer_weight(uint64_t analyzerid, unsigned int weight);
+
+void idmef_message_scheduler_set_workers(unsigned int count);
+
 #endif /* _MANAGER_IDMEF_MESSAGE_SCHEDULER_H */
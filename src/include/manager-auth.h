@@ -33,5 +33,11 @@ int manager_auth_client(server_generic_client_t *client, prelude_io_t *pio, gnut
 
 int manager_auth_init(prelude_client_t *client, const char *tlsopts, int dh_bits, int dh_regenerate);
 
+void manager_auth_deinit(void);
+
+void manager_auth_client_close(prelude_io_t *pio);
+
+void manager_auth_set_session_cache_size(unsigned int size);
+
 
 #endif /* _MANAGER_TLS_AUTH_H */
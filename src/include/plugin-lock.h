@@ -0,0 +1,47 @@
+/*****
+*
+* Copyright (C) 2008 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#ifndef _MANAGER_PLUGIN_LOCK_H
+#define _MANAGER_PLUGIN_LOCK_H
+
+int plugin_lock_new(prelude_plugin_instance_t *pi, manager_plugin_concurrency_t concurrency);
+
+void plugin_lock_destroy(prelude_plugin_instance_t *pi);
+
+manager_plugin_concurrency_t plugin_lock_get_concurrency(prelude_plugin_instance_t *pi);
+
+void plugin_lock_set_concurrency(prelude_plugin_instance_t *pi, manager_plugin_concurrency_t concurrency);
+
+void *plugin_lock_get_data(prelude_plugin_instance_t *pi);
+
+void plugin_lock_set_data(prelude_plugin_instance_t *pi, void *data);
+
+void plugin_lock_acquire(prelude_plugin_instance_t *pi);
+
+void plugin_lock_release(prelude_plugin_instance_t *pi);
+
+void plugin_lock_global_acquire(void);
+
+void plugin_lock_global_release(void);
+
+#endif /* _MANAGER_PLUGIN_LOCK_H */
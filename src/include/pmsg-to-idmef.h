@@ -22,3 +22,33 @@
 *****/
 
 int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg);
+
+/*
+ * Partial decoding, keeping only the alert children needed by a set
+ * of paths.
+ */
+#define PMSG_TO_IDMEF_MASK_ALL ((uint32_t) -1)
+
+uint32_t pmsg_to_idmef_get_child_mask(const char *name);
+
+void pmsg_to_idmef_get_path_mask(idmef_path_t *path, uint32_t *mask);
+
+int pmsg_to_idmef_partial(idmef_message_t **idmef, prelude_msg_t *msg, uint32_t mask);
+
+int pmsg_to_idmef_get_raw(prelude_msg_t *msg, manager_raw_message_t *raw);
+
+prelude_bool_t pmsg_to_idmef_is_manager_analyzer(idmef_analyzer_t *analyzer);
+
+/*
+ * Called for each message holding the wire form of the message,
+ * which the callback must reference if it keep it.
+ */
+typedef int (pmsg_forward_func_t)(prelude_msg_t *msg, void *data);
+
+int pmsg_forward(idmef_message_t *idmef, pmsg_forward_func_t *cb, void *data);
+
+void pmsg_forward_set_modified(idmef_message_t *idmef);
+
+void pmsg_forward_release(idmef_message_t *idmef);
+
+void pmsg_forward_analyzer_changed(void);
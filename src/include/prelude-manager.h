@@ -25,6 +25,24 @@
 #include <libprelude/prelude-log.h>
 
 
+/*
+ * Plugin concurrency contract: tell the manager whether the plugin
+ * functions might be called from several processing threads at once.
+ *
+ * - GLOBAL: the plugin is serialized with every other GLOBAL plugin and
+ *   with timers. This is the default, and what older plugins expect.
+ * - INSTANCE: calls to a given instance are serialized, distinct instances
+ *   might run concurrently.
+ * - REENTRANT: the plugin handle concurrency itself.
+ */
+typedef enum {
+        MANAGER_PLUGIN_CONCURRENCY_GLOBAL    = 0,
+        MANAGER_PLUGIN_CONCURRENCY_INSTANCE  = 1,
+        MANAGER_PLUGIN_CONCURRENCY_REENTRANT = 2
+} manager_plugin_concurrency_t;
+
+
+
 /*
  * Report plugin entry structure.
  */
@@ -35,23 +53,29 @@ typedef struct {
         PRELUDE_PLUGIN_GENERIC;
         int (*run)(prelude_plugin_instance_t *pi, idmef_message_t *message);
         void (*close)(prelude_plugin_instance_t *pi);
+        manager_plugin_concurrency_t concurrency;
 } manager_report_plugin_t;
 
 #define manager_report_plugin_set_running_func(p, f) (p)->run = (f)
 #define manager_report_plugin_set_closing_func(p, f) (p)->close = (f)
+#define manager_report_plugin_set_concurrency(p, c) (p)->concurrency = (c)
 
 
 /*
- * Decode plugin entry structure
+ * Decode plugin entry structure. Plugins working on an already decoded
+ * message (decode_id 0) must call pmsg_forward_set_modified() when they
+ * change it, otherwise the message is forwarded as received.
  */
 typedef struct {
         PRELUDE_PLUGIN_GENERIC;
         unsigned int decode_id;
         int (*run)(prelude_msg_t *ac, idmef_message_t *idmef);
+        manager_plugin_concurrency_t concurrency;
 } manager_decode_plugin_t;
 
 
 #define manager_decode_plugin_set_running_func(p, f) (p)->run = (f)
+#define manager_decode_plugin_set_concurrency(p, c) (p)->concurrency = (c)
 
 
 
@@ -62,7 +86,8 @@ typedef enum {
         MANAGER_FILTER_CATEGORY_REPORTING         = 0,
         MANAGER_FILTER_CATEGORY_REVERSE_RELAYING  = 1,
         MANAGER_FILTER_CATEGORY_PLUGIN            = 2,
-        MANAGER_FILTER_CATEGORY_END               = 3  /* should be the latest, do not remove */
+        MANAGER_FILTER_CATEGORY_PRE_DECODE        = 3,
+        MANAGER_FILTER_CATEGORY_END               = 4  /* should be the latest, do not remove */
 } manager_filter_category_t;
 
 
@@ -70,13 +95,32 @@ typedef enum {
 typedef struct manager_filter_hook manager_filter_hook_t;
 
 
+/*
+ * What filters of the PRE_DECODE category get to see of a message,
+ * found in its TLVs before it is decoded. Strings point to the message
+ * data, and are NULL when absent.
+ */
+typedef struct {
+        prelude_msg_t *msg;
+
+        uint8_t type;                     /* IDMEF_MSG_ALERT_TAG, IDMEF_MSG_HEARTBEAT_TAG, ... */
+        uint32_t children;                /* alert children present, see pmsg_to_idmef_get_child_mask() */
+        const char *analyzerid;           /* of the first analyzer */
+        const char *classification_text;
+} manager_raw_message_t;
+
+
 typedef struct {
         PRELUDE_PLUGIN_GENERIC;
         int (*run)(idmef_message_t *message, void *data);
+        manager_plugin_concurrency_t concurrency;
+        int (*run_raw)(manager_raw_message_t *message, void *data);
 } manager_filter_plugin_t;
 
 
 #define manager_filter_plugin_set_running_func(p, f) (p)->run = (f)
+#define manager_filter_plugin_set_concurrency(p, c) (p)->concurrency = (c)
+#define manager_filter_plugin_set_raw_running_func(p, f) (p)->run_raw = (f)
 
 
 int manager_filter_new_hook(manager_filter_hook_t **entry,
@@ -86,3 +130,13 @@ int manager_filter_new_hook(manager_filter_hook_t **entry,
 
 
 void manager_filter_destroy_hook(manager_filter_hook_t *entry);
+
+void manager_filter_hook_set_criteria(manager_filter_hook_t *entry, idmef_criteria_t *criteria);
+
+
+/*
+ * Temporary string owned by the message being processed: it is
+ * cleared and recycled once processing of the message is over, and
+ * must not be destroyed by the caller.
+ */
+int manager_message_string_new(prelude_string_t **out);
@@ -28,9 +28,11 @@ prelude_bool_t report_plugins_available(void);
 
 int report_plugin_activate_failover(const char *plugin);
 
+prelude_plugin_instance_t *report_plugins_search_instance(const char *name);
+
 int report_plugins_init(const char *dirname, void *data);
 
-void report_plugins_run(idmef_message_t *message);
+int report_plugins_run(idmef_message_t *message, prelude_bool_t filtered);
 
 void report_plugins_close(void);
 
@@ -41,6 +41,8 @@ void reverse_relay_send_prepared(void);
 
 void reverse_relay_send_receiver(idmef_message_t *idmef);
 
+prelude_bool_t reverse_relay_has_receiver(void);
+
 int reverse_relay_set_initiator_dead(prelude_connection_t *cnx);
 
 int reverse_relay_create_initiator(const char *arg);
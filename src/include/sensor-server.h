@@ -27,15 +27,19 @@
 #include "idmef-message-scheduler.h"
 #include "reverse-relaying.h"
 
+typedef struct sensor_bucket sensor_bucket_t;
+
 typedef struct {
         SERVER_GENERIC_OBJECT;
         prelude_list_t list;
+        prelude_list_t hash_list;
 
         idmef_queue_t *queue;
         prelude_connection_t *cnx;
         prelude_bool_t we_connected;
         prelude_list_t write_msg_list;
         reverse_relay_receiver_t *rrr;
+        sensor_bucket_t *bucket;
 
         uint32_t instance_id;
 } sensor_fd_t;
@@ -51,4 +55,8 @@ int sensor_server_add_client(server_generic_t *server, server_generic_client_t *
 
 int sensor_server_write_client(server_generic_client_t *dst, prelude_msg_t *msg);
 
+void sensor_server_set_rate_limit(double rate, double burst);
+
+void sensor_server_print_stats(void);
+
 #endif /* _MANAGER_SENSOR_SERVER_H */
@@ -34,6 +34,8 @@
 #define SERVER_GENERIC_CLIENT_STATE_FLUSHING       0x04
 #define SERVER_GENERIC_CLIENT_STATE_CLOSING        0x08
 #define SERVER_GENERIC_CLIENT_STATE_CLOSED         0x10
+#define SERVER_GENERIC_CLIENT_STATE_SUSPENDED      0x20
+#define SERVER_GENERIC_CLIENT_STATE_HANDSHAKING    0x40
 
 #ifdef HAVE_IPV6
 # define SERVER_SOCKADDR_TYPE struct sockaddr_in6
@@ -46,6 +48,7 @@
 #define SERVER_GENERIC_OBJECT        \
         ev_io evio;                  \
         ev_timer evtimer;            \
+        ev_timer evresume;           \
         prelude_io_t *fd;            \
         prelude_msg_t *msg;          \
         int state;                   \
@@ -53,6 +56,7 @@
         prelude_connection_permission_t permission; \
         gnutls_alert_description alert; \
         SERVER_SOCKADDR_TYPE sa; \
+        struct ev_loop *loop; \
         server_generic_t *server
 
 
@@ -84,6 +88,12 @@ typedef int (server_generic_read_func_t)(server_generic_client_t *client);
 typedef int (server_generic_write_func_t)(server_generic_client_t *client);
 
 
+/*
+ * Callback function type for running code in a client event loop.
+ */
+typedef void (server_generic_call_func_t)(void *data);
+
+
 
 server_generic_t *server_generic_new(size_t serverlen,
                                      server_generic_accept_func_t *accept,
@@ -99,6 +109,10 @@ void server_generic_start(server_generic_t **server, size_t nserver);
 
 void server_generic_destroy(server_generic_t *server);
 
+server_generic_client_t *server_generic_client_new(server_generic_t *server);
+
+void server_generic_client_free(server_generic_t *server, server_generic_client_t *client);
+
 void server_generic_stop(server_generic_t *server);
 
 int server_generic_process_requests(server_generic_t *server, server_generic_client_t *client);
@@ -119,8 +133,22 @@ void server_generic_notify_event(void);
 
 void server_generic_notify_write_enable(server_generic_client_t *client);
 
+void server_generic_client_suspend_read(server_generic_client_t *client, double delay);
+
+void server_generic_notify_read_pending(server_generic_client_t *client);
+
 void server_generic_notify_write_disable(server_generic_client_t *client);
 
+void server_generic_set_io_threads(unsigned int nthread);
+
+void server_generic_set_listen_backlog(int backlog);
+
+void server_generic_set_handshake_threads(unsigned int nthread);
+
+prelude_bool_t server_generic_client_is_local(server_generic_client_t *client);
+
+int server_generic_client_call(server_generic_client_t *client, server_generic_call_func_t *func, void *data);
+
 #endif /* _MANAGER_SERVER_GENERIC_H */
 
 
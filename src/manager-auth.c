@@ -31,6 +31,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
 
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
@@ -53,13 +54,21 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 
+#include "glthread/thread.h"
 #include "glthread/lock.h"
+#include "glthread/cond.h"
 #include "manager-auth.h"
 
 
 #define DEFAULT_DH_BITS 1024
 #define DH_FILENAME MANAGER_RUN_DIR "/tls-parameters.data"
 
+/*
+ * How long a TLS session might be resumed, in seconds.
+ */
+#define SESSION_CACHE_EXPIRATION 3600
+#define SESSION_ID_MAX 32
+
 
 #ifdef HAVE_GNUTLS_STRING_PRIORITY
 
@@ -71,10 +80,54 @@ static gnutls_priority_t tls_priority;
 static int global_dh_lifetime;
 static unsigned int global_dh_bits;
 static gnutls_certificate_credentials cred;
-static gnutls_dh_params cur_dh_params = NULL;
+/*
+ * DH parameters are shared by sessions, each handshake holding a
+ * reference until it is over, so that regeneration can swap them.
+ */
+typedef struct {
+        unsigned int refcount;
+        gnutls_dh_params dh;
+} dh_params_t;
+
+
+static dh_params_t *cur_dh_params = NULL;
 static prelude_timer_t dh_param_regeneration_timer;
 static gl_lock_t dh_regen_mutex = gl_lock_initializer;
 
+static gl_thread_t dh_regen_thread;
+static prelude_bool_t dh_regen_started = FALSE;
+static prelude_bool_t dh_regen_requested = FALSE;
+static prelude_bool_t dh_regen_stop = FALSE;
+static gl_cond_t dh_regen_cond = gl_cond_initializer;
+
+
+/*
+ * Server side TLS session cache, keyed by session ID. Along with the
+ * session data, it remember the identity of the authenticated client,
+ * so that resumed sessions don't need to parse the certificate again.
+ */
+typedef struct {
+        prelude_list_t list;
+        prelude_list_t lru;
+
+        size_t idlen;
+        unsigned char id[SESSION_ID_MAX];
+
+        gnutls_datum data;
+        time_t expire;
+
+        prelude_bool_t has_identity;
+        uint64_t analyzerid;
+        prelude_connection_permission_t permission;
+} session_entry_t;
+
+
+static unsigned int session_cache_size = 0;
+static unsigned int session_cache_count = 0;
+static prelude_list_t *session_table = NULL;
+static PRELUDE_LIST(session_lru);
+static gl_lock_t session_mutex = gl_lock_initializer;
+
 
 
 static int gcry_prelude_mutex_init(void **retval)
@@ -263,74 +316,404 @@ static int dh_params_save(gnutls_dh_params dh, unsigned int dh_bits)
 
 
 
-static void dh_params_regenerate(void *data)
+static dh_params_t *dh_params_new(void)
 {
         int ret;
-        gnutls_dh_params new, tmp;
+        dh_params_t *params;
+
+        params = malloc(sizeof(*params));
+        if ( ! params ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return NULL;
+        }
+
+        ret = gnutls_dh_params_init(&params->dh);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_WARN, "error initializing dh parameters object: %s.\n", gnutls_strerror(ret));
+                free(params);
+                return NULL;
+        }
+
+        params->refcount = 1;
+
+        return params;
+}
+
+
+
+static dh_params_t *dh_params_ref(void)
+{
+        dh_params_t *params;
+
+        gl_lock_lock(dh_regen_mutex);
+        params = cur_dh_params;
+        params->refcount++;
+        gl_lock_unlock(dh_regen_mutex);
+
+        return params;
+}
+
+
+
+static void dh_params_unref(dh_params_t *params)
+{
+        unsigned int refcount;
+
+        gl_lock_lock(dh_regen_mutex);
+        refcount = --params->refcount;
+        gl_lock_unlock(dh_regen_mutex);
+
+        if ( refcount == 0 ) {
+                gnutls_dh_params_deinit(params->dh);
+                free(params);
+        }
+}
+
+
+
+static void dh_params_regenerate(void)
+{
+        dh_params_t *new, *old;
 
         /*
          * generate a new DH key.
          */
-        ret = gnutls_dh_params_init(&new);
-        if ( ret < 0 ) {
-                prelude_log(PRELUDE_LOG_WARN, "error initializing dh parameters object: %s.\n", gnutls_strerror(ret));
+        new = dh_params_new();
+        if ( ! new )
                 return;
-        }
 
-        gnutls_dh_params_generate2(new, global_dh_bits);
+        gnutls_dh_params_generate2(new->dh, global_dh_bits);
+        dh_params_save(new->dh, global_dh_bits);
 
         gl_lock_lock(dh_regen_mutex);
-        tmp = cur_dh_params;
+        old = cur_dh_params;
         cur_dh_params = new;
         gl_lock_unlock(dh_regen_mutex);
 
         /*
-         * clear the old dh_params.
+         * the old dh_params are cleared once the last handshake using them is over.
          */
-        gnutls_dh_params_deinit(tmp);
+        dh_params_unref(old);
 
         prelude_log(PRELUDE_LOG_INFO, "Regenerated %d bits Diffie-Hellman key for TLS.\n", global_dh_bits);
+}
+
+
+
+/*
+ * Generation take seconds of CPU time: it is done by a dedicated
+ * thread rather than from the timer callback.
+ */
+static void *dh_regen_thread_cb(void *arg)
+{
+        int ret;
+        sigset_t set;
+
+        sigfillset(&set);
+
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        while ( 1 ) {
+                gl_lock_lock(dh_regen_mutex);
+
+                while ( ! dh_regen_requested && ! dh_regen_stop )
+                        gl_cond_wait(dh_regen_cond, dh_regen_mutex);
+
+                if ( dh_regen_stop ) {
+                        gl_lock_unlock(dh_regen_mutex);
+                        break;
+                }
+
+                dh_regen_requested = FALSE;
+                gl_lock_unlock(dh_regen_mutex);
+
+                dh_params_regenerate();
+        }
+
+        return NULL;
+}
+
+
+
+static void dh_params_regenerate_cb(void *data)
+{
+        gl_lock_lock(dh_regen_mutex);
+        dh_regen_requested = TRUE;
+        gl_cond_signal(dh_regen_cond);
+        gl_lock_unlock(dh_regen_mutex);
 
-        dh_params_save(cur_dh_params, global_dh_bits);
         prelude_timer_set_expire(&dh_param_regeneration_timer, global_dh_lifetime);
         prelude_timer_reset(&dh_param_regeneration_timer);
 }
 
 
 
-static int get_params(gnutls_session session, gnutls_params_type type, gnutls_params_st *st)
+static unsigned int session_hash(const unsigned char *id, size_t len)
 {
-        int ret;
-        gnutls_dh_params cpy;
+        size_t i;
+        uint32_t hash = 2166136261U;
 
-        if ( type == GNUTLS_PARAMS_RSA_EXPORT )
+        for ( i = 0; i < len; i++ ) {
+                hash ^= id[i];
+                hash *= 16777619;
+        }
+
+        return hash % session_cache_size;
+}
+
+
+
+static void session_entry_destroy(session_entry_t *entry)
+{
+        prelude_list_del(&entry->list);
+        prelude_list_del(&entry->lru);
+        session_cache_count--;
+
+        free(entry->data.data);
+        free(entry);
+}
+
+
+
+/*
+ * Must be called with session_mutex held.
+ */
+static session_entry_t *session_lookup(const unsigned char *id, size_t len)
+{
+        prelude_list_t *tmp;
+        session_entry_t *entry;
+
+        if ( len > SESSION_ID_MAX )
+                return NULL;
+
+        prelude_list_for_each(&session_table[session_hash(id, len)], tmp) {
+                entry = prelude_list_entry(tmp, session_entry_t, list);
+
+                if ( entry->idlen != len || memcmp(entry->id, id, len) != 0 )
+                        continue;
+
+                if ( entry->expire < time(NULL) ) {
+                        session_entry_destroy(entry);
+                        return NULL;
+                }
+
+                return entry;
+        }
+
+        return NULL;
+}
+
+
+
+static int session_db_store(void *ptr, gnutls_datum key, gnutls_datum data)
+{
+        void *copy;
+        session_entry_t *entry;
+
+        if ( key.size > SESSION_ID_MAX )
                 return -1;
 
-        ret = gnutls_dh_params_init(&cpy);
-        if ( ret < 0 ) {
-                prelude_log(PRELUDE_LOG_WARN, "error creating a new dh parameters object: %s.\n", gnutls_strerror(ret));
+        copy = malloc(data.size);
+        if ( ! copy )
                 return -1;
+
+        memcpy(copy, data.data, data.size);
+
+        gl_lock_lock(session_mutex);
+
+        entry = session_lookup(key.data, key.size);
+        if ( entry )
+                free(entry->data.data);
+        else {
+                /*
+                 * Evict the least recently used session.
+                 */
+                if ( session_cache_count >= session_cache_size )
+                        session_entry_destroy(prelude_list_entry(session_lru.prev, session_entry_t, lru));
+
+                entry = calloc(1, sizeof(*entry));
+                if ( ! entry ) {
+                        gl_lock_unlock(session_mutex);
+                        free(copy);
+                        return -1;
+                }
+
+                entry->idlen = key.size;
+                memcpy(entry->id, key.data, key.size);
+
+                prelude_list_add(&session_table[session_hash(key.data, key.size)], &entry->list);
+                prelude_list_add(&session_lru, &entry->lru);
+                session_cache_count++;
         }
 
-        gl_lock_lock(dh_regen_mutex);
-        ret = gnutls_dh_params_cpy(cpy, cur_dh_params);
-        gl_lock_unlock(dh_regen_mutex);
+        entry->data.data = copy;
+        entry->data.size = data.size;
+        entry->expire = time(NULL) + SESSION_CACHE_EXPIRATION;
 
-        if ( ret < 0 ) {
-                prelude_log(PRELUDE_LOG_WARN, "could not copy dh params for sessions: %s.\n", gnutls_strerror(ret));
-                gnutls_dh_params_deinit(cpy);
+        gl_lock_unlock(session_mutex);
+
+        return 0;
+}
+
+
+
+static gnutls_datum session_db_retrieve(void *ptr, gnutls_datum key)
+{
+        session_entry_t *entry;
+        gnutls_datum res = { NULL, 0 };
+
+        gl_lock_lock(session_mutex);
+
+        entry = session_lookup(key.data, key.size);
+        if ( entry ) {
+                res.data = gnutls_malloc(entry->data.size);
+                if ( res.data ) {
+                        res.size = entry->data.size;
+                        memcpy(res.data, entry->data.data, res.size);
+                }
+
+                prelude_list_del(&entry->lru);
+                prelude_list_add(&session_lru, &entry->lru);
+        }
+
+        gl_lock_unlock(session_mutex);
+
+        return res;
+}
+
+
+
+static int session_db_remove(void *ptr, gnutls_datum key)
+{
+        session_entry_t *entry;
+
+        gl_lock_lock(session_mutex);
+
+        entry = session_lookup(key.data, key.size);
+        if ( entry )
+                session_entry_destroy(entry);
+
+        gl_lock_unlock(session_mutex);
+
+        return 0;
+}
+
+
+
+static void session_set_identity(gnutls_session session, uint64_t analyzerid, prelude_connection_permission_t permission)
+{
+        session_entry_t *entry;
+        unsigned char id[SESSION_ID_MAX];
+        size_t len = sizeof(id);
+
+        if ( ! session_cache_size || gnutls_session_get_id(session, id, &len) < 0 )
+                return;
+
+        gl_lock_lock(session_mutex);
+
+        entry = session_lookup(id, len);
+        if ( entry ) {
+                entry->has_identity = TRUE;
+                entry->analyzerid = analyzerid;
+                entry->permission = permission;
+        }
+
+        gl_lock_unlock(session_mutex);
+}
+
+
+
+static int session_get_identity(gnutls_session session, uint64_t *analyzerid, prelude_connection_permission_t *permission)
+{
+        int ret = -1;
+        session_entry_t *entry;
+        unsigned char id[SESSION_ID_MAX];
+        size_t len = sizeof(id);
+
+        if ( ! session_cache_size || gnutls_session_get_id(session, id, &len) < 0 )
                 return -1;
+
+        gl_lock_lock(session_mutex);
+
+        entry = session_lookup(id, len);
+        if ( entry && entry->has_identity ) {
+                *analyzerid = entry->analyzerid;
+                *permission = entry->permission;
+                ret = 0;
         }
 
-        st->deinit = 1;
+        gl_lock_unlock(session_mutex);
+
+        return ret;
+}
+
+
+
+static int session_cache_init(void)
+{
+        unsigned int i;
+
+        if ( ! session_cache_size )
+                return 0;
+
+        session_table = malloc(session_cache_size * sizeof(*session_table));
+        if ( ! session_table ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        for ( i = 0; i < session_cache_size; i++ )
+                prelude_list_init(&session_table[i]);
+
+        return 0;
+}
+
+
+
+/*
+ * Sessions get a reference on the current parameters, kept until the
+ * handshake is over or the connection closed, rather than a copy.
+ */
+static int get_params(gnutls_session session, gnutls_params_type type, gnutls_params_st *st)
+{
+        dh_params_t *params;
+
+        if ( type == GNUTLS_PARAMS_RSA_EXPORT )
+                return -1;
+
+        params = gnutls_session_get_ptr(session);
+        if ( ! params ) {
+                params = dh_params_ref();
+                gnutls_session_set_ptr(session, params);
+        }
+
+        st->deinit = 0;
         st->type = type;
-        st->params.dh = cpy;
+        st->params.dh = params->dh;
 
         return 0;
 }
 
 
 
+static void release_params(gnutls_session session)
+{
+        dh_params_t *params;
+
+        params = gnutls_session_get_ptr(session);
+        if ( ! params )
+                return;
+
+        gnutls_session_set_ptr(session, NULL);
+        dh_params_unref(params);
+}
+
+
+
 static int handle_gnutls_error(prelude_io_t *pio, gnutls_session session, server_generic_client_t *client, int ret,
                                gnutls_alert_description *alert_desc)
 {
@@ -530,6 +913,13 @@ int manager_auth_client(server_generic_client_t *client, prelude_io_t *pio, gnut
                 gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE, cred);
                 gnutls_certificate_server_set_request(session, GNUTLS_CERT_REQUEST);
 
+                if ( session_cache_size ) {
+                        gnutls_db_set_retrieve_function(session, session_db_retrieve);
+                        gnutls_db_set_store_function(session, session_db_store);
+                        gnutls_db_set_remove_function(session, session_db_remove);
+                        gnutls_db_set_cache_expiration(session, SESSION_CACHE_EXPIRATION);
+                }
+
                 data.fd = fd;
                 gnutls_transport_set_ptr(session, data.ptr);
                 prelude_io_set_tls_io(pio, session);
@@ -542,9 +932,28 @@ int manager_auth_client(server_generic_client_t *client, prelude_io_t *pio, gnut
 
         } while ( ret < 0 && (ret = handle_gnutls_error(pio, session, client, ret, alert)) == 1 );
 
+        if ( ret != 0 )
+                release_params(session);
+
         if ( ret <= 0 )
                 return ret;
 
+        /*
+         * The certificate of a resumed session was checked when the
+         * session was established.
+         */
+        if ( gnutls_session_is_resumed(session) &&
+             session_get_identity(session, &analyzerid, &permission) == 0 ) {
+                ret = server_generic_client_set_permission(client, permission);
+                if ( ret < 0 )
+                        return -1;
+
+                server_generic_client_set_analyzerid(client, analyzerid);
+                server_generic_log_client(client, PRELUDE_LOG_INFO, "TLS authentication succeed: session resumed.\n");
+
+                return 1;
+        }
+
         ret = verify_certificate(client, session, alert);
         if ( ret < 0 )
                 return -1;
@@ -560,6 +969,8 @@ int manager_auth_client(server_generic_client_t *client, prelude_io_t *pio, gnut
                 return -1;
 
         server_generic_client_set_analyzerid(client, analyzerid);
+        session_set_identity(session, analyzerid, permission);
+
         server_generic_log_client(client, PRELUDE_LOG_INFO,
                                   "TLS authentication succeed: client certificate is trusted.\n");
 
@@ -569,6 +980,22 @@ int manager_auth_client(server_generic_client_t *client, prelude_io_t *pio, gnut
 
 
 
+/*
+ * The connection is being closed, possibly in the middle of the
+ * handshake.
+ */
+void manager_auth_client_close(prelude_io_t *pio)
+{
+        gnutls_session session;
+
+        session = prelude_io_get_fdptr(pio);
+        if ( session )
+                release_params(session);
+}
+
+
+
+
 int manager_auth_disable_encryption(server_generic_client_t *client, prelude_io_t *pio)
 {
         int ret;
@@ -632,6 +1059,10 @@ int manager_auth_init(prelude_client_t *client, const char *tlsopts, int dh_bits
         tls_priority_init(tlsopts);
         gnutls_certificate_allocate_credentials(&cred);
 
+        ret = session_cache_init();
+        if ( ret < 0 )
+                return ret;
+
         prelude_client_profile_get_tls_key_filename(cp, keyfile, sizeof(keyfile));
         prelude_client_profile_get_tls_server_keycert_filename(cp, certfile, sizeof(certfile));
 
@@ -670,7 +1101,9 @@ int manager_auth_init(prelude_client_t *client, const char *tlsopts, int dh_bits
                 }
         }
 
-        gnutls_dh_params_init(&cur_dh_params);
+        cur_dh_params = dh_params_new();
+        if ( ! cur_dh_params )
+                return -1;
 
         ret = access(MANAGER_RUN_DIR, R_OK|W_OK);
         if ( ret < 0 ) {
@@ -680,13 +1113,13 @@ int manager_auth_init(prelude_client_t *client, const char *tlsopts, int dh_bits
 
         ret = dh_check_elapsed();
 
-        if ( ret != -1 && dh_params_load(cur_dh_params, dh_bits) == 0 )
+        if ( ret != -1 && dh_params_load(cur_dh_params->dh, dh_bits) == 0 )
                 prelude_timer_set_expire(&dh_param_regeneration_timer, dh_lifetime - ret);
         else {
                 prelude_log(PRELUDE_LOG_INFO, "Generating %d bits Diffie-Hellman key for TLS...\n", dh_bits);
 
-                gnutls_dh_params_generate2(cur_dh_params, dh_bits);
-                dh_params_save(cur_dh_params, dh_bits);
+                gnutls_dh_params_generate2(cur_dh_params->dh, dh_bits);
+                dh_params_save(cur_dh_params->dh, dh_bits);
 
                 prelude_timer_set_expire(&dh_param_regeneration_timer, dh_lifetime);
         }
@@ -694,9 +1127,48 @@ int manager_auth_init(prelude_client_t *client, const char *tlsopts, int dh_bits
         gnutls_certificate_set_params_function(cred, get_params);
 
         if ( dh_lifetime ) {
-                prelude_timer_set_callback(&dh_param_regeneration_timer, dh_params_regenerate);
+                ret = glthread_create(&dh_regen_thread, dh_regen_thread_cb, NULL);
+                if ( ret != 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't create Diffie-Hellman regeneration thread.\n");
+                        return -1;
+                }
+
+                dh_regen_started = TRUE;
+
+                prelude_timer_set_callback(&dh_param_regeneration_timer, dh_params_regenerate_cb);
                 prelude_timer_init(&dh_param_regeneration_timer);
         }
 
         return 0;
 }
+
+
+
+/*
+ * Stop the regeneration thread, waiting for a regeneration in
+ * progress, and drop the current parameters.
+ */
+void manager_auth_deinit(void)
+{
+        if ( dh_regen_started ) {
+                gl_lock_lock(dh_regen_mutex);
+                dh_regen_stop = TRUE;
+                gl_cond_signal(dh_regen_cond);
+                gl_lock_unlock(dh_regen_mutex);
+
+                gl_thread_join(dh_regen_thread, NULL);
+                dh_regen_started = FALSE;
+        }
+
+        if ( cur_dh_params ) {
+                dh_params_unref(cur_dh_params);
+                cur_dh_params = NULL;
+        }
+}
+
+
+
+void manager_auth_set_session_cache_size(unsigned int size)
+{
+        session_cache_size = size;
+}
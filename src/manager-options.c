@@ -43,6 +43,7 @@
 #include "bufpool.h"
 #include "server-generic.h"
 #include "sensor-server.h"
+#include "manager-auth.h"
 #include "manager-options.h"
 #include "report-plugins.h"
 #include "reverse-relaying.h"
@@ -273,6 +274,74 @@ static int set_connection_timeout(prelude_option_t *opt, const char *arg, prelud
 
 
 
+static int set_io_threads(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        unsigned long int value;
+
+        value = strtoul(arg, &eptr, 10);
+        if ( value == ULONG_MAX || eptr == arg || *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid number of I/O threads specified: '%s'.\n", arg);
+                return -1;
+        }
+
+        server_generic_set_io_threads(value);
+        return 0;
+}
+
+
+
+static int set_tls_handshake_threads(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        unsigned long int value;
+
+        value = strtoul(arg, &eptr, 10);
+        if ( value == ULONG_MAX || eptr == arg || *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid number of TLS handshake threads specified: '%s'.\n", arg);
+                return -1;
+        }
+
+        server_generic_set_handshake_threads(value);
+        return 0;
+}
+
+
+
+static int set_tls_session_cache(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        unsigned long int value;
+
+        value = strtoul(arg, &eptr, 10);
+        if ( value == ULONG_MAX || value > UINT_MAX || eptr == arg || *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid TLS session cache size specified: '%s'.\n", arg);
+                return -1;
+        }
+
+        manager_auth_set_session_cache_size(value);
+        return 0;
+}
+
+
+
+static int set_listen_backlog(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        long int value;
+
+        value = strtol(arg, &eptr, 10);
+        if ( value <= 0 || value > INT_MAX || eptr == arg || *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid listen backlog specified: '%s'.\n", arg);
+                return -1;
+        }
+
+        server_generic_set_listen_backlog(value);
+        return 0;
+}
+
+
+
 static int set_dh_bits(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
 {
         config.dh_bits = atoi(arg);
@@ -307,8 +376,32 @@ static char *const2char(const char *val)
 }
 
 
+static int set_analyzer_weight(const char *analyzer, const char *value)
+{
+        char *eptr = NULL;
+        uint64_t analyzerid;
+        unsigned long int weight;
+
+        analyzerid = strtoull(analyzer, &eptr, 10);
+        if ( eptr == analyzer || *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "invalid analyzerid '%s'.\n", analyzer);
+                return -1;
+        }
+
+        weight = strtoul(value, &eptr, 10);
+        if ( weight == 0 || weight > UINT_MAX || eptr == value || *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "invalid weight '%s' for analyzer '%s'.\n", value, analyzer);
+                return -1;
+        }
+
+        return idmef_message_scheduler_set_analyzer_weight(analyzerid, weight);
+}
+
+
+
 static int set_sched_priority(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
 {
+        int ret;
         unsigned int i;
         char *name, *prio, *value = const2char(arg);
         struct {
@@ -329,6 +422,19 @@ static int set_sched_priority(prelude_option_t *opt, const char *arg, prelude_st
 
                 *prio++ = 0;
 
+                /*
+                 * Numeric names are analyzerid, with their own weight.
+                 */
+                if ( isdigit((unsigned char) *name) ) {
+                        ret = set_analyzer_weight(name, prio);
+                        *(prio - 1) = ':';
+
+                        if ( ret < 0 )
+                                return -1;
+
+                        continue;
+                }
+
                 for ( i = 0; i < sizeof(tbl) / sizeof(*tbl); i++ ) {
                         if ( strcmp(name, tbl[i].name) == 0 ) {
                                 tbl[i].priority = atoi(prio);
@@ -350,7 +456,23 @@ static int set_sched_priority(prelude_option_t *opt, const char *arg, prelude_st
 }
 
 
-static int set_sched_buffer_size(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+static int set_sched_workers(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        unsigned long int value;
+
+        value = strtoul(arg, &eptr, 10);
+        if ( value == 0 || value == ULONG_MAX || eptr == arg || *eptr ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid number of scheduler workers specified: '%s'.\n", arg);
+                return -1;
+        }
+
+        idmef_message_scheduler_set_workers(value);
+        return 0;
+}
+
+
+static int parse_size(const char *arg, size_t *size)
 {
         char *eptr = NULL;
         unsigned long int value;
@@ -375,12 +497,113 @@ static int set_sched_buffer_size(prelude_option_t *opt, const char *arg, prelude
                 return -1;
         }
 
+        *size = value;
+
+        return 0;
+}
+
+
+
+static int set_sched_buffer_size(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        size_t value;
+
+        ret = parse_size(arg, &value);
+        if ( ret < 0 )
+                return ret;
+
         bufpool_set_disk_threshold(value);
         return 0;
 }
 
 
 
+static int set_sched_disk_quota(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+        size_t value;
+
+        ret = parse_size(arg, &value);
+        if ( ret < 0 )
+                return ret;
+
+        bufpool_set_disk_quota(value);
+        return 0;
+}
+
+
+
+static int set_sched_rate_limit(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        double rate, burst;
+
+        rate = strtod(arg, &eptr);
+        if ( eptr == arg || rate < 0 || (*eptr && *eptr != ':') ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid rate limit specified: '%s'.\n", arg);
+                return -1;
+        }
+
+        burst = rate;
+
+        if ( *eptr == ':' ) {
+                arg = eptr + 1;
+
+                burst = strtod(arg, &eptr);
+                if ( eptr == arg || burst < 1 || *eptr ) {
+                        prelude_log(PRELUDE_LOG_ERR, "Invalid rate limit burst specified: '%s'.\n", arg);
+                        return -1;
+                }
+        }
+
+        sensor_server_set_rate_limit(rate, burst);
+        return 0;
+}
+
+
+
+static int set_sched_spill_sync(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        char *eptr = NULL;
+        unsigned long int value;
+
+        if ( strcmp(arg, "none") == 0 )
+                bufpool_set_sync_policy(BUFPOOL_SYNC_NONE, 0);
+
+        else if ( strcmp(arg, "batch") == 0 )
+                bufpool_set_sync_policy(BUFPOOL_SYNC_BATCH, 0);
+
+        else {
+                value = strtoul(arg, &eptr, 10);
+                if ( value == 0 || value == ULONG_MAX || eptr == arg || *eptr ) {
+                        prelude_log(PRELUDE_LOG_ERR, "Invalid spill sync policy specified: '%s'.\n", arg);
+                        return -1;
+                }
+
+                bufpool_set_sync_policy(BUFPOOL_SYNC_INTERVAL, value);
+        }
+
+        return 0;
+}
+
+
+
+static int set_sched_spill_backend(prelude_option_t *opt, const char *arg, prelude_string_t *err, void *context)
+{
+        int ret;
+
+        ret = bufpool_set_backend(arg);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "Invalid spill backend specified: '%s'.\n", arg);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+
 #if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
 static int set_user(prelude_option_t *opt, const char *optarg, prelude_string_t *err, void *context)
 {
@@ -521,10 +744,22 @@ int manager_options_init(prelude_option_t *rootopt, int *argc, char **argv)
                            "Number of seconds a client has to successfully authenticate (default 10)",
                            PRELUDE_OPTION_ARGUMENT_REQUIRED, set_connection_timeout, NULL);
 
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "io-threads",
+                           "Number of threads handling sensors connections (default 0, the main thread)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_io_threads, NULL);
+
         prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "tls-options",
                            "TLS ciphers, key exchange methods, protocols, macs, and compression options",
                            PRELUDE_OPTION_ARGUMENT_REQUIRED, set_tls_options, NULL);
 
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "tls-handshake-threads",
+                           "Number of threads running concurrent TLS handshakes (default 0, the I/O threads)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_tls_handshake_threads, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "tls-session-cache",
+                           "Number of TLS sessions kept for resumption (default 0, disabled)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_tls_session_cache, NULL);
+
         prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "dh-parameters-regenerate",
                            "How often to regenerate the Diffie Hellman parameters (in hours)",
                            PRELUDE_OPTION_ARGUMENT_REQUIRED, set_dh_regenerate, NULL);
@@ -539,6 +774,26 @@ int manager_options_init(prelude_option_t *rootopt, int *argc, char **argv)
         prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-buffer-size",
                            NULL, PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_buffer_size, NULL);
 
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-disk-quota",
+                           "Maximum size of events stored on disk, sensors being slowed down past it",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_disk_quota, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-rate-limit",
+                           "Maximum number of events per second accepted from each sensor (rate[:burst])",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_rate_limit, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-workers",
+                           "Number of threads processing queued messages (default 1)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_workers, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-spill-sync",
+                           "When to sync events stored on disk (none, batch, or interval in seconds)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_spill_sync, NULL);
+
+        prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CFG, 0, "sched-spill-backend",
+                           "How events are stored on disk (file, or segment)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_sched_spill_backend, NULL);
+
         prelude_option_add(rootopt, &opt, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG, 'c', "child-managers",
                            "List of managers address:port pair where messages should be gathered from",
                            PRELUDE_OPTION_ARGUMENT_REQUIRED, set_reverse_relay, NULL);
@@ -548,6 +803,15 @@ int manager_options_init(prelude_option_t *rootopt, int *argc, char **argv)
          */
         prelude_option_set_priority(opt, PRELUDE_OPTION_PRIORITY_LAST);
 
+        prelude_option_add(rootopt, &opt, PRELUDE_OPTION_TYPE_CFG, 0, "listen-backlog",
+                           "Maximum number of pending sensors connections (default SOMAXCONN)",
+                           PRELUDE_OPTION_ARGUMENT_REQUIRED, set_listen_backlog, NULL);
+
+        /*
+         * listen() is called as soon as the listen option is processed.
+         */
+        prelude_option_set_priority(opt, PRELUDE_OPTION_PRIORITY_FIRST);
+
         prelude_option_add(rootopt, NULL, PRELUDE_OPTION_TYPE_CLI|PRELUDE_OPTION_TYPE_CFG, 'l', "listen",
                            "Address the sensors server should listen on (addr:port)",
                            PRELUDE_OPTION_ARGUMENT_REQUIRED, set_listen_address, NULL);
@@ -0,0 +1,129 @@
+/*****
+*
+* Copyright (C) 2007 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <libprelude/prelude.h>
+
+#include "prelude-manager.h"
+#include "message-arena.h"
+
+
+/*
+ * Strings kept around from one message to the next, per thread.
+ */
+#define ARENA_STRING_MAX 64
+
+/*
+ * A string that grew beyond this size is released rather than
+ * recycled, so that a single large message doesn't pin memory.
+ */
+#define ARENA_STRING_KEEP_SIZE 8192
+
+
+/*
+ * Per thread arena of temporary strings: handing a string out is a
+ * matter of bumping the used index, and leaving the outermost scope
+ * reset it.
+ */
+typedef struct {
+        unsigned int depth;
+
+        size_t used;
+        size_t count;
+        prelude_string_t **strings;
+} message_arena_t;
+
+
+static __thread message_arena_t arena;
+
+
+
+static void arena_reset(void)
+{
+        size_t i;
+
+        for ( i = 0; i < arena.used; i++ ) {
+                if ( ! arena.strings[i] )
+                        continue;
+
+                if ( i >= ARENA_STRING_MAX || prelude_string_get_len(arena.strings[i]) > ARENA_STRING_KEEP_SIZE ) {
+                        prelude_string_destroy(arena.strings[i]);
+                        arena.strings[i] = NULL;
+                }
+
+                else prelude_string_clear(arena.strings[i]);
+        }
+
+        arena.used = 0;
+}
+
+
+
+void message_arena_enter(void)
+{
+        arena.depth++;
+}
+
+
+
+void message_arena_leave(void)
+{
+        if ( arena.depth > 0 && --arena.depth > 0 )
+                return;
+
+        arena_reset();
+}
+
+
+
+int manager_message_string_new(prelude_string_t **out)
+{
+        int ret;
+        prelude_string_t **ptr;
+
+        if ( arena.used == arena.count ) {
+                ptr = realloc(arena.strings, (arena.count + 16) * sizeof(*ptr));
+                if ( ! ptr )
+                        return prelude_error_from_errno(errno);
+
+                memset(ptr + arena.count, 0, 16 * sizeof(*ptr));
+
+                arena.strings = ptr;
+                arena.count += 16;
+        }
+
+        if ( ! arena.strings[arena.used] ) {
+                ret = prelude_string_new(&arena.strings[arena.used]);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        *out = arena.strings[arena.used++];
+
+        return 0;
+}
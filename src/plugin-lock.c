@@ -0,0 +1,168 @@
+/*****
+*
+* Copyright (C) 2008 PreludeIDS Technologies. All Rights Reserved.
+* Author: Yoann Vandoorselaere <yoann.v@prelude-ids.com>
+*
+* This file is part of the Prelude-Manager program.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; see the file COPYING.  If not, write to
+* the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+*
+*****/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libprelude/prelude.h>
+#include <libprelude/prelude-log.h>
+
+#include "glthread/lock.h"
+
+#include "prelude-manager.h"
+#include "plugin-lock.h"
+
+
+typedef struct {
+        manager_plugin_concurrency_t concurrency;
+        gl_lock_t mutex;
+        void *data;
+} plugin_lock_t;
+
+
+/*
+ * Serialize GLOBAL plugins, timers, and access to objects shared
+ * by every message (the manager analyzer).
+ */
+static gl_recursive_lock_t global_mutex = gl_recursive_lock_initializer;
+
+
+
+int plugin_lock_new(prelude_plugin_instance_t *pi, manager_plugin_concurrency_t concurrency)
+{
+        plugin_lock_t *lock;
+
+        if ( prelude_plugin_instance_get_data(pi) )
+                return 0;
+
+        lock = calloc(1, sizeof(*lock));
+        if ( ! lock ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        lock->concurrency = concurrency;
+        gl_lock_init(lock->mutex);
+
+        prelude_plugin_instance_set_data(pi, lock);
+
+        return 0;
+}
+
+
+
+void plugin_lock_destroy(prelude_plugin_instance_t *pi)
+{
+        plugin_lock_t *lock = prelude_plugin_instance_get_data(pi);
+
+        if ( ! lock )
+                return;
+
+        gl_lock_destroy(lock->mutex);
+        prelude_plugin_instance_set_data(pi, NULL);
+
+        free(lock);
+}
+
+
+
+manager_plugin_concurrency_t plugin_lock_get_concurrency(prelude_plugin_instance_t *pi)
+{
+        plugin_lock_t *lock = prelude_plugin_instance_get_data(pi);
+        return ( lock ) ? lock->concurrency : MANAGER_PLUGIN_CONCURRENCY_GLOBAL;
+}
+
+
+
+void plugin_lock_set_concurrency(prelude_plugin_instance_t *pi, manager_plugin_concurrency_t concurrency)
+{
+        plugin_lock_t *lock = prelude_plugin_instance_get_data(pi);
+
+        if ( lock )
+                lock->concurrency = concurrency;
+}
+
+
+
+void *plugin_lock_get_data(prelude_plugin_instance_t *pi)
+{
+        plugin_lock_t *lock = prelude_plugin_instance_get_data(pi);
+        return ( lock ) ? lock->data : NULL;
+}
+
+
+
+void plugin_lock_set_data(prelude_plugin_instance_t *pi, void *data)
+{
+        plugin_lock_t *lock = prelude_plugin_instance_get_data(pi);
+
+        if ( lock )
+                lock->data = data;
+}
+
+
+
+/*
+ * Acquire whatever lock the plugin contract require before calling
+ * one of the instance functions. Instances without a lock fall back
+ * to global serialization.
+ */
+void plugin_lock_acquire(prelude_plugin_instance_t *pi)
+{
+        plugin_lock_t *lock = prelude_plugin_instance_get_data(pi);
+
+        if ( ! lock || lock->concurrency == MANAGER_PLUGIN_CONCURRENCY_GLOBAL )
+                gl_recursive_lock_lock(global_mutex);
+
+        else if ( lock->concurrency == MANAGER_PLUGIN_CONCURRENCY_INSTANCE )
+                gl_lock_lock(lock->mutex);
+}
+
+
+
+void plugin_lock_release(prelude_plugin_instance_t *pi)
+{
+        plugin_lock_t *lock = prelude_plugin_instance_get_data(pi);
+
+        if ( ! lock || lock->concurrency == MANAGER_PLUGIN_CONCURRENCY_GLOBAL )
+                gl_recursive_lock_unlock(global_mutex);
+
+        else if ( lock->concurrency == MANAGER_PLUGIN_CONCURRENCY_INSTANCE )
+                gl_lock_unlock(lock->mutex);
+}
+
+
+
+void plugin_lock_global_acquire(void)
+{
+        gl_recursive_lock_lock(global_mutex);
+}
+
+
+
+void plugin_lock_global_release(void)
+{
+        gl_recursive_lock_unlock(global_mutex);
+}
@@ -24,6 +24,9 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 
@@ -42,17 +45,92 @@
 #include <libprelude/prelude-log.h>
 #include <libprelude/idmef-message-id.h>
 #include <libprelude/idmef-message-read.h>
+#include <libprelude/idmef-message-write.h>
 #include <libprelude/prelude-ident.h>
 #include <libprelude/prelude-client.h>
 #include <libprelude/prelude-error.h>
 #include <libprelude/prelude-extract.h>
 
+#include "prelude-manager.h"
 #include "decode-plugins.h"
 #include "pmsg-to-idmef.h"
 
+#include "glthread/lock.h"
+
+
+/*
+ * The wire form of the message being processed by a thread, built at
+ * most once and shared by every consumer forwarding it. As long as no
+ * plugin modified the message, it is spliced from the bytes received
+ * from the sensor instead of being encoded again.
+ *
+ * The entry is keyed on both the message and the prelude_msg_t it was
+ * decoded from, so that a message allocated at the address of one the
+ * entry wasn't released for doesn't pick up its wire form.
+ */
+typedef struct {
+        idmef_message_t *idmef;
+        prelude_msg_t *pmsg;
+        prelude_bool_t modified;
+        prelude_bool_t analyzer_time_added;
+
+        size_t count;
+        size_t size;
+        prelude_msg_t **msgs;
+} forward_t;
+
 
 extern prelude_client_t *manager_client;
 
+static __thread forward_t forward;
+
+/*
+ * Each thread attach its own copy of the manager analyzer to the
+ * messages it decode, so that the copy reference count and list link
+ * are only touched by that thread, one message at a time, without any
+ * lock. Copies are made again once analyzer_generation changed.
+ */
+static unsigned int analyzer_generation = 0;
+static __thread idmef_analyzer_t *thread_analyzer = NULL;
+static __thread unsigned int thread_analyzer_generation = 0;
+
+/*
+ * Encoded manager analyzer, inserted in spliced messages. Dropped by
+ * pmsg_forward_analyzer_changed() whenever the analyzer might change.
+ */
+static prelude_msg_t *analyzer_wire = NULL;
+static prelude_bool_t analyzer_wire_failed = FALSE;
+static gl_lock_t analyzer_wire_mutex = gl_lock_initializer;
+
+
+/*
+ * Alert children a partial decode may leave out, by path name. Any
+ * other nested object is always decoded.
+ */
+static const struct {
+        const char *name;
+        uint8_t tag;
+} alert_children[] = {
+        { "analyzer",          IDMEF_MSG_ANALYZER_TAG          },
+        { "classification",    IDMEF_MSG_CLASSIFICATION_TAG    },
+        { "source",            IDMEF_MSG_SOURCE_TAG            },
+        { "target",            IDMEF_MSG_TARGET_TAG            },
+        { "assessment",        IDMEF_MSG_ASSESSMENT_TAG        },
+        { "additional_data",   IDMEF_MSG_ADDITIONAL_DATA_TAG   },
+        { "tool_alert",        IDMEF_MSG_TOOL_ALERT_TAG        },
+        { "correlation_alert", IDMEF_MSG_CORRELATION_ALERT_TAG },
+        { "overflow_alert",    IDMEF_MSG_OVERFLOW_ALERT_TAG    },
+};
+
+
+/*
+ * Alert attributes always part of a partial decode. The analyzer time
+ * is not: pmsg_to_idmef() might derive it from the message header.
+ */
+static const char *alert_attributes[] = {
+        "messageid", "create_time", "detect_time", NULL
+};
+
 
 
 static int get_msg_time(prelude_msg_t *msg, idmef_time_t *create_time, idmef_time_t **ret)
@@ -79,10 +157,41 @@ static int get_msg_time(prelude_msg_t *msg, idmef_time_t *create_time, idmef_tim
 
 
 
+static int get_thread_analyzer(idmef_analyzer_t **analyzer)
+{
+        int ret;
+        unsigned int generation = __atomic_load_n(&analyzer_generation, __ATOMIC_ACQUIRE);
+
+        if ( thread_analyzer && thread_analyzer_generation == generation ) {
+                *analyzer = thread_analyzer;
+                return 0;
+        }
+
+        if ( thread_analyzer ) {
+                idmef_analyzer_destroy(thread_analyzer);
+                thread_analyzer = NULL;
+        }
+
+        ret = idmef_analyzer_clone(prelude_client_get_analyzer(manager_client), &thread_analyzer);
+        if ( ret < 0 ) {
+                thread_analyzer = NULL;
+                return ret;
+        }
+
+        thread_analyzer_generation = generation;
+        *analyzer = thread_analyzer;
+
+        return 0;
+}
+
+
+
+
 static int handle_heartbeat_msg(prelude_msg_t *msg, idmef_message_t *idmef)
 {
         int ret;
         idmef_time_t *analyzer_time;
+        idmef_analyzer_t *analyzer;
         idmef_heartbeat_t *heartbeat;
 
         ret = idmef_message_new_heartbeat(idmef, &heartbeat);
@@ -99,9 +208,14 @@ static int handle_heartbeat_msg(prelude_msg_t *msg, idmef_message_t *idmef)
                         return ret;
 
                 idmef_heartbeat_set_analyzer_time(heartbeat, analyzer_time);
+                forward.analyzer_time_added = TRUE;
         }
 
-        idmef_heartbeat_set_analyzer(heartbeat, idmef_analyzer_ref(prelude_client_get_analyzer(manager_client)), IDMEF_LIST_PREPEND);
+        ret = get_thread_analyzer(&analyzer);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_heartbeat_set_analyzer(heartbeat, idmef_analyzer_ref(analyzer), IDMEF_LIST_PREPEND);
 
         return 0;
 }
@@ -114,6 +228,7 @@ static int handle_alert_msg(prelude_msg_t *msg, idmef_message_t *idmef)
         int ret;
         idmef_alert_t *alert;
         idmef_time_t *analyzer_time;
+        idmef_analyzer_t *analyzer;
 
         ret = idmef_message_new_alert(idmef, &alert);
         if ( ret < 0 )
@@ -129,9 +244,14 @@ static int handle_alert_msg(prelude_msg_t *msg, idmef_message_t *idmef)
                         return ret;
 
                 idmef_alert_set_analyzer_time(alert, analyzer_time);
+                forward.analyzer_time_added = TRUE;
         }
 
-        idmef_alert_set_analyzer(alert, idmef_analyzer_ref(prelude_client_get_analyzer(manager_client)), IDMEF_LIST_PREPEND);
+        ret = get_thread_analyzer(&analyzer);
+        if ( ret < 0 )
+                return ret;
+
+        idmef_alert_set_analyzer(alert, idmef_analyzer_ref(analyzer), IDMEF_LIST_PREPEND);
 
         return 0;
 }
@@ -152,6 +272,8 @@ static int handle_proprietary_msg(prelude_msg_t *msg, idmef_message_t *idmef, vo
         if ( ret < 0 )
                 return ret;
 
+        forward.modified = TRUE;
+
         return 0;
 }
 
@@ -172,6 +294,10 @@ int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg)
                 return ret;
         }
 
+        pmsg_forward_release(NULL);
+        forward.idmef = *idmef;
+        forward.pmsg = msg;
+
         while ( (ret = prelude_msg_get(msg, &tag, &len, &buf)) == 0 ) {
 
                 if ( tag == IDMEF_MSG_ALERT_TAG )
@@ -209,7 +335,651 @@ int pmsg_to_idmef(idmef_message_t **idmef, prelude_msg_t *msg)
                 return 0;
 
         prelude_log(PRELUDE_LOG_INFO, "%s: error reading IDMEF message: %s.\n", prelude_strsource(ret), prelude_strerror(ret));
+        pmsg_forward_release(*idmef);
         idmef_message_destroy(*idmef);
 
         return ret;
 }
+
+
+
+static int forward_add(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+{
+        prelude_msg_t **ptr;
+
+        if ( forward.count == forward.size ) {
+                ptr = realloc(forward.msgs, (forward.size + 4) * sizeof(*ptr));
+                if ( ! ptr ) {
+                        prelude_msg_destroy(msg);
+                        return prelude_error_from_errno(errno);
+                }
+
+                forward.msgs = ptr;
+                forward.size += 4;
+        }
+
+        forward.msgs[forward.count++] = msg;
+
+        return 0;
+}
+
+
+
+static int forward_encode(idmef_message_t *idmef)
+{
+        int ret;
+        prelude_msgbuf_t *msgbuf;
+
+        ret = prelude_msgbuf_new(&msgbuf);
+        if ( ret < 0 )
+                return ret;
+
+        prelude_msgbuf_set_callback(msgbuf, forward_add);
+        prelude_msgbuf_set_flags(msgbuf, PRELUDE_MSGBUF_FLAGS_ASYNC);
+
+        idmef_message_write(idmef, msgbuf);
+        prelude_msgbuf_mark_end(msgbuf);
+
+        prelude_msgbuf_destroy(msgbuf);
+
+        return 0;
+}
+
+
+
+static int store_analyzer_wire(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+{
+        /*
+         * A fragmented analyzer can't be spliced.
+         */
+        if ( analyzer_wire ) {
+                prelude_msg_destroy(msg);
+                analyzer_wire_failed = TRUE;
+                return 0;
+        }
+
+        analyzer_wire = msg;
+
+        return 0;
+}
+
+
+
+/*
+ * Size of the msg header, preceding its TLVs. Return 0 if msg doesn't
+ * look complete.
+ */
+static uint32_t get_msg_hdr_size(prelude_msg_t *msg)
+{
+        uint32_t len = prelude_msg_get_len(msg), dlen = prelude_msg_get_datalen(msg);
+
+        return ( dlen < len ) ? len - dlen : 0;
+}
+
+
+
+/*
+ * Whether tag open a nested object, closed by an END_OF_TAG TLV.
+ *
+ * The TLV walkers below rely on the libprelude 0.9 wire encoding, as
+ * written by idmef-message-write.c in the 0.9.21.3 version configure
+ * require: a nested object is an empty TLV tagged with the object tag,
+ * followed by the object children, and an empty END_OF_TAG TLV. Since
+ * leaf values may be empty too, nested objects are recognized by their
+ * tag only.
+ */
+static prelude_bool_t is_object_tag(uint8_t tag)
+{
+        switch (tag) {
+
+        case IDMEF_MSG_ALERT_TAG:
+        case IDMEF_MSG_HEARTBEAT_TAG:
+        case IDMEF_MSG_ANALYZER_TAG:
+        case IDMEF_MSG_CLASSIFICATION_TAG:
+        case IDMEF_MSG_REFERENCE_TAG:
+        case IDMEF_MSG_SOURCE_TAG:
+        case IDMEF_MSG_TARGET_TAG:
+        case IDMEF_MSG_NODE_TAG:
+        case IDMEF_MSG_ADDRESS_TAG:
+        case IDMEF_MSG_USER_TAG:
+        case IDMEF_MSG_USER_ID_TAG:
+        case IDMEF_MSG_PROCESS_TAG:
+        case IDMEF_MSG_SERVICE_TAG:
+        case IDMEF_MSG_WEB_SERVICE_TAG:
+        case IDMEF_MSG_SNMP_SERVICE_TAG:
+        case IDMEF_MSG_FILE_TAG:
+        case IDMEF_MSG_FILE_ACCESS_TAG:
+        case IDMEF_MSG_INODE_TAG:
+        case IDMEF_MSG_CHECKSUM_TAG:
+        case IDMEF_MSG_LINKAGE_TAG:
+        case IDMEF_MSG_ASSESSMENT_TAG:
+        case IDMEF_MSG_IMPACT_TAG:
+        case IDMEF_MSG_ACTION_TAG:
+        case IDMEF_MSG_CONFIDENCE_TAG:
+        case IDMEF_MSG_ADDITIONAL_DATA_TAG:
+        case IDMEF_MSG_TOOL_ALERT_TAG:
+        case IDMEF_MSG_CORRELATION_ALERT_TAG:
+        case IDMEF_MSG_OVERFLOW_ALERT_TAG:
+        case IDMEF_MSG_ALERTIDENT_TAG:
+                return TRUE;
+
+        default:
+                return FALSE;
+        }
+}
+
+
+
+static prelude_msg_t *get_analyzer_wire(void)
+{
+        int ret;
+        prelude_msgbuf_t *msgbuf;
+        idmef_analyzer_t *analyzer;
+
+        gl_lock_lock(analyzer_wire_mutex);
+
+        if ( ! analyzer_wire && ! analyzer_wire_failed ) {
+                ret = get_thread_analyzer(&analyzer);
+                if ( ret == 0 )
+                        ret = prelude_msgbuf_new(&msgbuf);
+
+                if ( ret < 0 )
+                        analyzer_wire_failed = TRUE;
+                else {
+                        prelude_msgbuf_set_callback(msgbuf, store_analyzer_wire);
+                        prelude_msgbuf_set_flags(msgbuf, PRELUDE_MSGBUF_FLAGS_ASYNC);
+
+                        idmef_analyzer_write(analyzer, msgbuf);
+
+                        prelude_msgbuf_mark_end(msgbuf);
+                        prelude_msgbuf_destroy(msgbuf);
+
+                        if ( ! analyzer_wire )
+                                analyzer_wire_failed = TRUE;
+                }
+        }
+
+        gl_lock_unlock(analyzer_wire_mutex);
+
+        return analyzer_wire_failed ? NULL : analyzer_wire;
+}
+
+
+
+/*
+ * The manager analyzer might have been modified: copy and encode it
+ * again on next use. Callers must make sure no message is being
+ * processed.
+ */
+void pmsg_forward_analyzer_changed(void)
+{
+        __atomic_fetch_add(&analyzer_generation, 1, __ATOMIC_RELEASE);
+
+        gl_lock_lock(analyzer_wire_mutex);
+
+        if ( analyzer_wire ) {
+                prelude_msg_destroy(analyzer_wire);
+                analyzer_wire = NULL;
+        }
+
+        analyzer_wire_failed = FALSE;
+
+        gl_lock_unlock(analyzer_wire_mutex);
+}
+
+
+
+/*
+ * Copy the TLVs found in buf to msg, stopping after the first one
+ * tagged stop_tag, if not -1. Return the number of bytes consumed.
+ */
+static int copy_tlv(prelude_msg_t *msg, const unsigned char *buf, uint32_t len, int stop_tag)
+{
+        int ret;
+        uint8_t tag;
+        uint32_t i = 0, dlen;
+
+        while ( len - i >= 5 ) {
+                tag = buf[i];
+                dlen = prelude_extract_uint32(buf + i + 1);
+
+                if ( dlen > len - i - 5 )
+                        return prelude_error(PRELUDE_ERROR_INVAL_LENGTH);
+
+                ret = prelude_msg_set(msg, tag, dlen, buf + i + 5);
+                if ( ret < 0 )
+                        return ret;
+
+                i += 5 + dlen;
+
+                if ( tag == stop_tag )
+                        break;
+        }
+
+        return i;
+}
+
+
+
+/*
+ * The message as received, with the manager analyzer prepended the
+ * way pmsg_to_idmef() did, and the analyzer time it might have added.
+ * Since the IDMEF decoder doesn't care about the order of the children
+ * of an alert or heartbeat, both are inserted right after its tag.
+ */
+static int forward_splice(idmef_message_t *idmef, prelude_msg_t *orig)
+{
+        int ret;
+        uint32_t tmp[3];
+        uint8_t tag, atag;
+        prelude_msg_t *msg, *awire;
+        idmef_time_t *atime = NULL;
+        const unsigned char *obuf;
+        uint32_t olen, alen, extra = 0, ohdr = get_msg_hdr_size(orig), ahdr;
+
+        awire = get_analyzer_wire();
+        if ( ! awire || ! ohdr )
+                return -1;
+
+        ahdr = get_msg_hdr_size(awire);
+        if ( ! ahdr )
+                return -1;
+
+        if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_ALERT ) {
+                tag = IDMEF_MSG_ALERT_TAG;
+                atag = IDMEF_MSG_ALERT_ANALYZER_TIME;
+                if ( forward.analyzer_time_added )
+                        atime = idmef_alert_get_analyzer_time(idmef_message_get_alert(idmef));
+        }
+
+        else if ( idmef_message_get_type(idmef) == IDMEF_MESSAGE_TYPE_HEARTBEAT ) {
+                tag = IDMEF_MSG_HEARTBEAT_TAG;
+                atag = IDMEF_MSG_HEARTBEAT_ANALYZER_TIME;
+                if ( forward.analyzer_time_added )
+                        atime = idmef_heartbeat_get_analyzer_time(idmef_message_get_heartbeat(idmef));
+        }
+
+        else return -1;
+
+        if ( atime )
+                extra = 5 + sizeof(tmp);
+
+        obuf = prelude_msg_get_message_data(orig) + ohdr;
+        olen = prelude_msg_get_len(orig) - ohdr;
+        alen = prelude_msg_get_len(awire) - ahdr;
+
+        ret = prelude_msg_new(&msg, 0, olen + alen + extra, prelude_msg_get_tag(orig), prelude_msg_get_priority(orig));
+        if ( ret < 0 )
+                return ret;
+
+        ret = copy_tlv(msg, obuf, olen, tag);
+        if ( ret < 0 || (uint32_t) ret == olen )
+                goto err;
+
+        obuf += ret;
+        olen -= ret;
+
+        ret = copy_tlv(msg, prelude_msg_get_message_data(awire) + ahdr, alen, -1);
+        if ( ret < 0 )
+                goto err;
+
+        if ( atime ) {
+                tmp[0] = htonl(idmef_time_get_sec(atime));
+                tmp[1] = htonl(idmef_time_get_usec(atime));
+                tmp[2] = htonl(idmef_time_get_gmt_offset(atime));
+
+                ret = prelude_msg_set(msg, atag, sizeof(tmp), tmp);
+                if ( ret < 0 )
+                        goto err;
+        }
+
+        ret = copy_tlv(msg, obuf, olen, -1);
+        if ( ret < 0 )
+                goto err;
+
+        prelude_msg_mark_end(msg);
+
+        return forward_add(NULL, msg);
+
+ err:
+        prelude_msg_destroy(msg);
+        return -1;
+}
+
+
+
+/*
+ * Return the mask bit of the alert child name, 0 if unknown.
+ */
+uint32_t pmsg_to_idmef_get_child_mask(const char *name)
+{
+        size_t i;
+
+        for ( i = 0; i < sizeof(alert_children) / sizeof(*alert_children); i++ ) {
+                if ( strcmp(name, alert_children[i].name) == 0 )
+                        return 1 << i;
+        }
+
+        return 0;
+}
+
+
+
+static uint32_t get_child_mask_by_tag(uint8_t tag)
+{
+        size_t i;
+
+        for ( i = 0; i < sizeof(alert_children) / sizeof(*alert_children); i++ ) {
+                if ( tag == alert_children[i].tag )
+                        return 1 << i;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * Add to mask the alert children a partial decode need to keep for
+ * path to be evaluated.
+ */
+void pmsg_to_idmef_get_path_mask(idmef_path_t *path, uint32_t *mask)
+{
+        size_t i;
+        uint32_t bit;
+        const char *name;
+
+        name = idmef_path_get_name(path, 0);
+        if ( ! name || strcmp(name, "alert") != 0 )
+                return;
+
+        name = ( idmef_path_get_depth(path) > 1 ) ? idmef_path_get_name(path, 1) : NULL;
+        if ( ! name ) {
+                *mask = PMSG_TO_IDMEF_MASK_ALL;
+                return;
+        }
+
+        bit = pmsg_to_idmef_get_child_mask(name);
+        if ( bit ) {
+                *mask |= bit;
+                return;
+        }
+
+        for ( i = 0; alert_attributes[i]; i++ ) {
+                if ( strcmp(name, alert_attributes[i]) == 0 )
+                        return;
+        }
+
+        *mask = PMSG_TO_IDMEF_MASK_ALL;
+}
+
+
+
+static prelude_bool_t keep_alert_child(uint8_t tag, uint32_t mask)
+{
+        uint32_t bit = get_child_mask_by_tag(tag);
+
+        return ( ! bit || (mask & bit) ) ? TRUE : FALSE;
+}
+
+
+
+/*
+ * Decode the alert in msg, leaving out the children not in mask. See
+ * is_object_tag() for how a subtree is skipped without decoding it.
+ * Return -1 if msg is not an alert, or doesn't look like expected.
+ */
+int pmsg_to_idmef_partial(idmef_message_t **idmef, prelude_msg_t *msg, uint32_t mask)
+{
+        int ret;
+        uint8_t tag;
+        prelude_msg_t *partial;
+        const unsigned char *buf;
+        prelude_bool_t copy, keep = TRUE;
+        uint32_t i, len, dlen, depth = 0, hdr = get_msg_hdr_size(msg);
+
+        if ( ! hdr || mask == PMSG_TO_IDMEF_MASK_ALL )
+                return -1;
+
+        buf = prelude_msg_get_message_data(msg) + hdr;
+        len = prelude_msg_get_len(msg) - hdr;
+
+        ret = prelude_msg_new(&partial, 0, len, prelude_msg_get_tag(msg), prelude_msg_get_priority(msg));
+        if ( ret < 0 )
+                return ret;
+
+        for ( i = 0; len - i >= 5; i += 5 + dlen ) {
+                tag = buf[i];
+                dlen = prelude_extract_uint32(buf + i + 1);
+
+                if ( dlen > len - i - 5 )
+                        goto err;
+
+                if ( tag == IDMEF_MSG_END_OF_TAG ) {
+                        if ( depth == 0 )
+                                goto err;
+
+                        copy = ( depth < 2 || keep );
+                        depth--;
+                }
+
+                else if ( is_object_tag(tag) ) {
+                        if ( dlen != 0 || (++depth == 1 && tag != IDMEF_MSG_ALERT_TAG) )
+                                goto err;
+
+                        if ( depth == 2 )
+                                keep = keep_alert_child(tag, mask);
+
+                        copy = ( depth < 2 || keep );
+                }
+
+                else copy = ( depth < 2 || keep );
+
+                if ( ! copy )
+                        continue;
+
+                ret = prelude_msg_set(partial, tag, dlen, buf + i + 5);
+                if ( ret < 0 )
+                        goto err;
+        }
+
+        if ( depth != 0 || i != len )
+                goto err;
+
+        prelude_msg_mark_end(partial);
+
+        ret = pmsg_to_idmef(idmef, partial);
+        if ( ret < 0 )
+                goto err;
+
+        /*
+         * The decoded message reference the partial message data.
+         */
+        idmef_message_set_pmsg(*idmef, partial);
+
+        return 0;
+
+ err:
+        prelude_msg_destroy(partial);
+        return -1;
+}
+
+
+
+static const char *get_tlv_string(const unsigned char *buf, uint32_t len)
+{
+        if ( len == 0 || buf[len - 1] != 0 )
+                return NULL;
+
+        return (const char *) buf;
+}
+
+
+
+/*
+ * Look at the TLVs of msg for what PRE_DECODE filters may check,
+ * without decoding it. See is_object_tag() for the encoding relied on.
+ */
+int pmsg_to_idmef_get_raw(prelude_msg_t *msg, manager_raw_message_t *raw)
+{
+        uint8_t tag, child = 0;
+        const unsigned char *buf;
+        prelude_bool_t first_analyzer = FALSE, seen_analyzer = FALSE;
+        uint32_t i, len, dlen, depth = 0, hdr = get_msg_hdr_size(msg);
+
+        if ( ! hdr )
+                return -1;
+
+        memset(raw, 0, sizeof(*raw));
+        raw->msg = msg;
+
+        buf = prelude_msg_get_message_data(msg) + hdr;
+        len = prelude_msg_get_len(msg) - hdr;
+
+        for ( i = 0; len - i >= 5; i += 5 + dlen ) {
+                tag = buf[i];
+                dlen = prelude_extract_uint32(buf + i + 1);
+
+                if ( dlen > len - i - 5 )
+                        return -1;
+
+                if ( tag == IDMEF_MSG_END_OF_TAG ) {
+                        if ( depth == 0 )
+                                return -1;
+
+                        depth--;
+                        continue;
+                }
+
+                if ( depth == 0 && (tag == IDMEF_MSG_ALERT_TAG || tag == IDMEF_MSG_HEARTBEAT_TAG || tag == IDMEF_MSG_OWN_FORMAT) )
+                        raw->type = tag;
+
+                if ( is_object_tag(tag) ) {
+                        if ( dlen != 0 )
+                                return -1;
+
+                        if ( ++depth != 2 )
+                                continue;
+
+                        child = tag;
+                        first_analyzer = ( tag == IDMEF_MSG_ANALYZER_TAG && ! seen_analyzer );
+
+                        if ( tag == IDMEF_MSG_ANALYZER_TAG )
+                                seen_analyzer = TRUE;
+
+                        if ( raw->type == IDMEF_MSG_ALERT_TAG )
+                                raw->children |= get_child_mask_by_tag(tag);
+
+                        continue;
+                }
+
+                if ( depth != 2 )
+                        continue;
+
+                if ( first_analyzer && tag == IDMEF_MSG_ANALYZER_ANALYZERID )
+                        raw->analyzerid = get_tlv_string(buf + i + 5, dlen);
+
+                else if ( child == IDMEF_MSG_CLASSIFICATION_TAG && tag == IDMEF_MSG_CLASSIFICATION_TEXT )
+                        raw->classification_text = get_tlv_string(buf + i + 5, dlen);
+        }
+
+        return ( depth == 0 && i == len ) ? 0 : -1;
+}
+
+
+
+/*
+ * Hand the wire form of idmef to cb, building it on first use.
+ */
+int pmsg_forward(idmef_message_t *idmef, pmsg_forward_func_t *cb, void *data)
+{
+        int ret;
+        size_t i;
+        prelude_msg_t *orig;
+
+        orig = idmef_message_get_pmsg(idmef);
+
+        /*
+         * Message generated by the manager itself, or not decoded by
+         * this thread.
+         */
+        if ( forward.idmef != idmef || forward.pmsg != orig ) {
+                pmsg_forward_release(NULL);
+                forward.idmef = idmef;
+                forward.pmsg = orig;
+                forward.modified = TRUE;
+        }
+
+        if ( ! forward.count ) {
+                ret = -1;
+                if ( orig && ! forward.modified )
+                        ret = forward_splice(idmef, orig);
+
+                if ( ret < 0 ) {
+                        ret = forward_encode(idmef);
+                        if ( ret < 0 )
+                                return ret;
+                }
+        }
+
+        for ( i = 0; i < forward.count; i++ ) {
+                ret = cb(forward.msgs[i], data);
+                if ( ret < 0 )
+                        return ret;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * A plugin changed idmef: its wire form has to be encoded again.
+ */
+/*
+ * Whether analyzer is the manager analyzer, as attached to messages
+ * decoded by this thread or to the manager own heartbeats.
+ */
+prelude_bool_t pmsg_to_idmef_is_manager_analyzer(idmef_analyzer_t *analyzer)
+{
+        return ( analyzer == thread_analyzer || analyzer == prelude_client_get_analyzer(manager_client) ) ? TRUE : FALSE;
+}
+
+
+
+void pmsg_forward_set_modified(idmef_message_t *idmef)
+{
+        size_t i;
+
+        if ( forward.idmef != idmef )
+                return;
+
+        for ( i = 0; i < forward.count; i++ )
+                prelude_msg_destroy(forward.msgs[i]);
+
+        forward.count = 0;
+        forward.modified = TRUE;
+}
+
+
+
+/*
+ * Drop the wire form of idmef, NULL for whatever message this thread
+ * last forwarded.
+ */
+void pmsg_forward_release(idmef_message_t *idmef)
+{
+        size_t i;
+
+        if ( idmef && forward.idmef != idmef )
+                return;
+
+        for ( i = 0; i < forward.count; i++ )
+                prelude_msg_destroy(forward.msgs[i]);
+
+        forward.count = 0;
+        forward.idmef = NULL;
+        forward.pmsg = NULL;
+        forward.modified = FALSE;
+        forward.analyzer_time_added = FALSE;
+}
@@ -44,6 +44,7 @@
 #include "idmef-message-scheduler.h"
 #include "reverse-relaying.h"
 #include "manager-auth.h"
+#include "bufpool.h"
 
 #define MANAGER_MODEL "Prelude Manager"
 #define MANAGER_CLASS "Concentrator"
@@ -58,6 +59,10 @@ struct ev_loop *manager_event_loop;
 static char **global_argv;
 static volatile sig_atomic_t got_signal = 0;
 
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+static ev_signal stats_signal;
+#endif
+
 
 
 /*
@@ -148,6 +153,16 @@ static void sig_cb(struct ev_loop *loop, struct ev_signal *s, int revent)
 }
 
 
+/*
+ * Log scheduler and admission control statistics.
+ */
+static void stats_cb(struct ev_loop *loop, struct ev_signal *s, int revent)
+{
+        bufpool_print_stats();
+        sensor_server_print_stats();
+}
+
+
 static void add_signal(int signo, struct sigaction *action)
 {
         ev_signal *s = malloc(sizeof(*s));
@@ -293,6 +308,9 @@ int main(int argc, char **argv)
 #if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
         add_signal(SIGQUIT, &action);
         add_signal(SIGHUP, &action);
+
+        ev_signal_init(&stats_signal, stats_cb, SIGUSR1);
+        ev_signal_start(manager_event_loop, &stats_signal);
 #endif
 
         server_generic_start(config.server, config.nserver);
@@ -305,6 +323,7 @@ int main(int argc, char **argv)
                             got_signal, get_restart_string());
 
         idmef_message_scheduler_exit();
+        manager_auth_deinit();
         prelude_client_destroy(manager_client, PRELUDE_CLIENT_EXIT_STATUS_FAILURE);
 
         report_plugins_close();
@@ -42,13 +42,14 @@
 #include "report-plugins.h"
 #include "filter-plugins.h"
 #include "pmsg-to-idmef.h"
+#include "plugin-lock.h"
+#include "message-arena.h"
 
 
 #define FAILOVER_RETRY_TIMEOUT 10 * 60
 #define MANAGER_PLUGIN_SYMBOL  "manager_plugin_init"
 
 
-static prelude_msgbuf_t *msgbuf;
 static PRELUDE_LIST(report_plugins_instance);
 
 
@@ -99,7 +100,13 @@ static int recover_from_failover(prelude_plugin_instance_t *pi, plugin_failover_
                 if ( ret < 0 )
                         break;
 
+                message_arena_enter();
                 ret = report_plugin_run_single(pi, pf, idmef);
+                message_arena_leave();
+
+                pmsg_forward_release(idmef);
+                idmef_message_destroy(idmef);
+
                 if ( ret < 0 && ret != MANAGER_REPORT_PLUGIN_FAILURE_SINGLE )
                         break;
 
@@ -176,13 +183,17 @@ static void failover_timer_expire_cb(void *data)
         plugin_failover_t *pf;
         prelude_plugin_instance_t *pi = data;
 
-        pf = prelude_plugin_instance_get_data(pi);
+        pf = plugin_lock_get_data(pi);
+
+        plugin_lock_acquire(pi);
 
         ret = try_recovering_from_failover(pi, pf);
         if ( ret < 0 )
                 prelude_timer_reset(&pf->timer);
         else
                 prelude_timer_destroy(&pf->timer);
+
+        plugin_lock_release(pi);
 }
 
 
@@ -192,7 +203,7 @@ static int setup_plugin_failover(prelude_plugin_instance_t *pi)
         int ret;
         plugin_failover_t *pf;
         char filename[PATH_MAX];
-        prelude_plugin_generic_t *plugin = prelude_plugin_instance_get_plugin(pi);
+        manager_report_plugin_t *plugin = (manager_report_plugin_t *) prelude_plugin_instance_get_plugin(pi);
 
         get_failover_filename(pi, filename, sizeof(filename));
 
@@ -201,6 +212,16 @@ static int setup_plugin_failover(prelude_plugin_instance_t *pi)
                 return -1;
         }
 
+        ret = plugin_lock_new(pi, plugin->concurrency);
+        if ( ret < 0 )
+                return -1;
+
+        /*
+         * Failover state is not reentrant.
+         */
+        if ( plugin_lock_get_concurrency(pi) == MANAGER_PLUGIN_CONCURRENCY_REENTRANT )
+                plugin_lock_set_concurrency(pi, MANAGER_PLUGIN_CONCURRENCY_INSTANCE);
+
         pf = calloc(1, sizeof(*pf));
         if ( ! pf ) {
                 prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
@@ -224,10 +245,11 @@ static int setup_plugin_failover(prelude_plugin_instance_t *pi)
                 return -1;
         }
 
-        prelude_plugin_instance_set_data(pi, pf);
+        plugin_lock_set_data(pi, pf);
 
         try_recovering_from_failover(pi, pf);
         if ( pf->failover_enabled ) {
+                plugin_lock_set_data(pi, NULL);
                 prelude_failover_destroy(pf->failover);
                 prelude_failover_destroy(pf->failed_failover);
                 free(pf);
@@ -244,11 +266,16 @@ static int setup_plugin_failover(prelude_plugin_instance_t *pi)
  */
 static int subscribe(prelude_plugin_instance_t *pi)
 {
-        prelude_plugin_generic_t *plugin = prelude_plugin_instance_get_plugin(pi);
+        int ret;
+        manager_report_plugin_t *plugin = (manager_report_plugin_t *) prelude_plugin_instance_get_plugin(pi);
 
         prelude_log(PRELUDE_LOG_INFO, "Subscribing %s[%s] to active reporting plugins.\n",
                     plugin->name, prelude_plugin_instance_get_name(pi));
 
+        ret = plugin_lock_new(pi, plugin->concurrency);
+        if ( ret < 0 )
+                return ret;
+
         prelude_plugin_instance_add(pi, &report_plugins_instance);
 
         return 0;
@@ -263,6 +290,7 @@ static void unsubscribe(prelude_plugin_instance_t *pi)
                     plugin->name, prelude_plugin_instance_get_name(pi));
 
         prelude_plugin_instance_del(pi);
+        plugin_lock_destroy(pi);
 }
 
 
@@ -286,10 +314,10 @@ static void failover_init(prelude_plugin_instance_t *pi, plugin_failover_t *pf)
 
 
 
-static int save_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+static int save_msg(prelude_msg_t *msg, void *data)
 {
         int ret;
-        prelude_failover_t *pf = prelude_msgbuf_get_data(msgbuf);
+        prelude_failover_t *pf = data;
 
         ret = prelude_failover_save_msg(pf, msg);
         if ( ret < 0 )
@@ -303,12 +331,7 @@ static int save_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
 
 static void save_idmef_message(prelude_failover_t *pf, idmef_message_t *msg)
 {
-        /*
-         * this is a message we generated ourself...
-         */
-        prelude_msgbuf_set_data(msgbuf, pf);
-        idmef_message_write(msg, msgbuf);
-        prelude_msgbuf_mark_end(msgbuf);
+        pmsg_forward(msg, save_msg, pf);
 }
 
 
@@ -333,9 +356,11 @@ static int report_plugin_run_single(prelude_plugin_instance_t *pi, plugin_failov
 
 
 /*
- * Start all plugins of kind 'list'.
+ * Start all plugins of kind 'list'. The reporting filters are skipped
+ * if the message already went through them. Return -1 if the reporting
+ * filters rejected the message.
  */
-void report_plugins_run(idmef_message_t *idmef)
+int report_plugins_run(idmef_message_t *idmef, prelude_bool_t filtered)
 {
         int ret;
         prelude_list_t *tmp;
@@ -343,27 +368,33 @@ void report_plugins_run(idmef_message_t *idmef)
         prelude_plugin_generic_t *pg;
         prelude_plugin_instance_t *pi;
 
-        ret = filter_plugins_run_by_category(idmef, MANAGER_FILTER_CATEGORY_REPORTING);
-        if ( ret < 0 )
-                return;
+        if ( ! filtered ) {
+                ret = filter_plugins_run_by_category(idmef, MANAGER_FILTER_CATEGORY_REPORTING);
+                if ( ret < 0 )
+                        return -1;
+        }
 
         prelude_list_for_each(&report_plugins_instance, tmp) {
 
                 pi = prelude_linked_object_get_object(tmp);
                 pg = prelude_plugin_instance_get_plugin(pi);
-                pf = prelude_plugin_instance_get_data(pi);
+                pf = plugin_lock_get_data(pi);
 
                 ret = filter_plugins_run_by_plugin(idmef, pi);
                 if ( ret < 0 )
                         continue;
 
-                if ( pf && pf->failover_enabled ) {
+                plugin_lock_acquire(pi);
+
+                if ( pf && pf->failover_enabled )
                         save_idmef_message(pf->failover, idmef);
-                        continue;
-                }
+                else
+                        report_plugin_run_single(pi, pf, idmef);
 
-                report_plugin_run_single(pi, pf, idmef);
+                plugin_lock_release(pi);
          }
+
+        return 0;
 }
 
 
@@ -414,14 +445,6 @@ int report_plugins_init(const char *dirname, void *data)
                 return -1;
         }
 
-        ret = prelude_msgbuf_new(&msgbuf);
-        if ( ret < 0 ) {
-                prelude_perror(ret, "could not create message buffer: %s", prelude_strerror(ret));
-                return -1;
-        }
-
-        prelude_msgbuf_set_callback(msgbuf, save_msgbuf);
-
         return count;
 }
 
@@ -440,6 +463,34 @@ prelude_bool_t report_plugins_available(void)
 
 
 
+/*
+ * Only return active reporting instance.
+ */
+prelude_plugin_instance_t *report_plugins_search_instance(const char *name)
+{
+        int ret;
+        prelude_list_t *tmp;
+        char pname[256], iname[256];
+        prelude_plugin_instance_t *pi;
+
+        ret = sscanf(name, "%255[^[][%255[^]]", pname, iname);
+        if ( ret < 1 )
+                return NULL;
+
+        pi = prelude_plugin_search_instance_by_name(NULL, pname, (ret == 2) ? iname : NULL);
+        if ( ! pi )
+                return NULL;
+
+        prelude_list_for_each(&report_plugins_instance, tmp) {
+                if ( prelude_linked_object_get_object(tmp) == pi )
+                        return pi;
+        }
+
+        return NULL;
+}
+
+
+
 int report_plugin_activate_failover(const char *plugin)
 {
         int ret;
@@ -36,10 +36,12 @@
 
 #include "glthread/lock.h"
 
+#include "prelude-manager.h"
 #include "reverse-relaying.h"
 #include "server-generic.h"
 #include "sensor-server.h"
 #include "manager-options.h"
+#include "pmsg-to-idmef.h"
 
 #include "sensor-server.h"
 
@@ -47,7 +49,7 @@
 
 struct reverse_relay_receiver {
         prelude_list_t list;
-
+        prelude_list_t hash_list;
 
         uint64_t analyzerid;
 
@@ -66,7 +68,6 @@ typedef struct {
 } mqueue_t;
 
 
-static prelude_msgbuf_t *msgbuf;
 static PRELUDE_LIST(mqueue_list);
 static gl_lock_t mqueue_mutex = gl_lock_initializer;
 
@@ -74,6 +75,12 @@ static gl_lock_t mqueue_mutex = gl_lock_initializer;
 static PRELUDE_LIST(receiver_list);
 static gl_lock_t receiver_list_mutex = gl_lock_initializer;
 
+/*
+ * Receivers are never removed: they are also indexed by analyzerid.
+ */
+#define RECEIVER_HASH_SIZE 1024
+static prelude_list_t receiver_hash[RECEIVER_HASH_SIZE];
+
 extern manager_config_t config;
 extern prelude_client_t *manager_client;
 static prelude_connection_pool_t *initiator = NULL;
@@ -111,9 +118,8 @@ static reverse_relay_receiver_t *get_next_receiver(prelude_list_t **iter)
         reverse_relay_receiver_t *rrr = NULL;
 
         /*
-         * Locking here is not required since the list is never
-         * modified by the worker thread. We only protect writing
-         * of the list, and reading it from the worker thread.
+         * Receivers are added from the I/O threads: the caller
+         * must hold receiver_list_mutex.
          */
         prelude_list_for_each_continue_safe(&receiver_list, tmp, *iter) {
                 rrr = prelude_list_entry(tmp, reverse_relay_receiver_t, list);
@@ -126,6 +132,18 @@ static reverse_relay_receiver_t *get_next_receiver(prelude_list_t **iter)
 
 
 
+static prelude_list_t *get_receiver_bucket(uint64_t analyzerid)
+{
+        analyzerid ^= analyzerid >> 33;
+        analyzerid *= 0xff51afd7ed558ccdULL;
+        analyzerid ^= analyzerid >> 33;
+
+        return &receiver_hash[analyzerid & (RECEIVER_HASH_SIZE - 1)];
+}
+
+
+
+
 int reverse_relay_set_receiver_alive(reverse_relay_receiver_t *rrr, server_generic_client_t *client)
 {
         ssize_t size;
@@ -133,10 +151,18 @@ int reverse_relay_set_receiver_alive(reverse_relay_receiver_t *rrr, server_gener
         prelude_msg_t *msg;
         prelude_failover_t *failover = rrr->failover;
 
+        /*
+         * The failover is written to from the main loop while the
+         * receiver is not alive.
+         */
+        gl_lock_lock(receiver_list_mutex);
+
         size = prelude_failover_get_saved_msg(failover, &msg);
         if ( size == 0 )
                 rrr->client = client;
 
+        gl_lock_unlock(receiver_list_mutex);
+
         if ( size < 0 ) {
                 prelude_perror((prelude_error_t) size, "could not retrieve saved message from disk");
                 return -1;
@@ -188,7 +214,9 @@ int reverse_relay_set_initiator_dead(prelude_connection_t *cnx)
 
 void reverse_relay_set_receiver_dead(reverse_relay_receiver_t *rrr)
 {
+        gl_lock_lock(receiver_list_mutex);
         rrr->client = NULL;
+        gl_lock_unlock(receiver_list_mutex);
 }
 
 
@@ -219,6 +247,7 @@ int reverse_relay_new_receiver(reverse_relay_receiver_t **rrr, server_generic_cl
 
         gl_lock_lock(receiver_list_mutex);
         prelude_list_add_tail(&receiver_list, &new->list);
+        prelude_list_add_tail(get_receiver_bucket(analyzerid), &new->hash_list);
         gl_lock_unlock(receiver_list_mutex);
         *rrr = new;
 
@@ -229,20 +258,27 @@ int reverse_relay_new_receiver(reverse_relay_receiver_t **rrr, server_generic_cl
 
 reverse_relay_receiver_t *reverse_relay_search_receiver(uint64_t analyzerid)
 {
-        prelude_list_t *iter = NULL;
-        reverse_relay_receiver_t *item;
+        prelude_list_t *tmp;
+        reverse_relay_receiver_t *item, *found = NULL;
+
+        gl_lock_lock(receiver_list_mutex);
 
-        while ( (item = get_next_receiver(&iter)) ) {
+        prelude_list_for_each(get_receiver_bucket(analyzerid), tmp) {
+                item = prelude_list_entry(tmp, reverse_relay_receiver_t, hash_list);
 
-                if ( analyzerid == item->analyzerid )
-                        return item;
+                if ( analyzerid == item->analyzerid ) {
+                        found = item;
+                        break;
+                }
         }
 
-        return NULL;
+        gl_lock_unlock(receiver_list_mutex);
+
+        return found;
 }
 
 
-static int send_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
+static int queue_msg(prelude_msg_t *msg, void *data)
 {
         mqueue_t *mq;
 
@@ -252,8 +288,8 @@ static int send_msgbuf(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
                 return -1;
         }
 
-        mq->msg = msg;
-        mq->analyzerid = *(uint64_t *) prelude_msgbuf_get_data(msgbuf);
+        mq->msg = prelude_msg_ref(msg);
+        mq->analyzerid = *(uint64_t *) data;
 
         gl_lock_lock(mqueue_mutex);
         prelude_list_add_tail(&mqueue_list, &mq->list);
@@ -326,20 +362,28 @@ out:
 
 
 
+prelude_bool_t reverse_relay_has_receiver(void)
+{
+        prelude_bool_t empty;
+
+        gl_lock_lock(receiver_list_mutex);
+        empty = prelude_list_is_empty(&receiver_list);
+        gl_lock_unlock(receiver_list_mutex);
+
+        return ! empty;
+}
+
+
+
 void reverse_relay_send_receiver(idmef_message_t *idmef)
 {
         int ret;
         uint64_t analyzerid;
-        prelude_bool_t empty;
 
         /*
          * If there is no receiver, no need to queue the message.
          */
-        gl_lock_lock(receiver_list_mutex);
-        empty = prelude_list_is_empty(&receiver_list);
-        gl_lock_unlock(receiver_list_mutex);
-
-        if ( empty )
+        if ( ! reverse_relay_has_receiver() )
                 return;
 
         /*
@@ -352,14 +396,11 @@ void reverse_relay_send_receiver(idmef_message_t *idmef)
                 return;
 
         /*
-         * Convert from idmef_message_t to prelude_msg_t,
-         * this will trigger the msgbuf callback where an mqueue_t
-         * object will be created, and attached to the list of message
-         * to be emited.
+         * Get the wire form of the message, shared with the other
+         * consumers, an mqueue_t object referencing it is attached
+         * to the list of message to be emited.
          */
-        prelude_msgbuf_set_data(msgbuf, &analyzerid);
-        idmef_message_write(idmef, msgbuf);
-        prelude_msgbuf_mark_end(msgbuf);
+        pmsg_forward(idmef, queue_msg, &analyzerid);
 
         /*
          * Finally, restart the main server event loop so that it
@@ -380,6 +421,12 @@ void reverse_relay_send_prepared(void)
 
         while ( (mq = mqueue_get_next()) ) {
 
+                /*
+                 * Holding the lock prevent receiver clients from being
+                 * closed by their I/O thread while we write to them.
+                 */
+                gl_lock_lock(receiver_list_mutex);
+
                 while ( (receiver = get_next_receiver(&iter)) ) {
 
                         if ( mq->analyzerid == receiver->analyzerid )
@@ -394,6 +441,8 @@ void reverse_relay_send_prepared(void)
                         }
                 }
 
+                gl_lock_unlock(receiver_list_mutex);
+
                 prelude_msg_destroy(mq->msg);
                 free(mq);
         }
@@ -461,16 +510,10 @@ int reverse_relay_create_initiator(const char *arg)
 
 int reverse_relay_init(void)
 {
-        int ret;
-
-        ret = prelude_msgbuf_new(&msgbuf);
-        if ( ! msgbuf ) {
-                prelude_perror(ret, "error creating reverse relay msgbuf");
-                return -1;
-        }
+        unsigned int i;
 
-        prelude_msgbuf_set_callback(msgbuf, send_msgbuf);
-        prelude_msgbuf_set_flags(msgbuf, PRELUDE_MSGBUF_FLAGS_ASYNC);
+        for ( i = 0; i < RECEIVER_HASH_SIZE; i++ )
+                prelude_list_init(&receiver_hash[i]);
 
         return 0;
 }
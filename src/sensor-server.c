@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -41,29 +42,264 @@
 #include <libprelude/prelude-connection-pool.h>
 #include <libprelude/prelude-option-wide.h>
 
+#include "glthread/lock.h"
+
 #include "server-generic.h"
 #include "sensor-server.h"
 #include "idmef-message-scheduler.h"
+#include "prelude-manager.h"
+#include "report-plugins.h"
+#include "plugin-lock.h"
 #include "manager-options.h"
 #include "reverse-relaying.h"
+#include "pmsg-to-idmef.h"
+#include "bufpool.h"
 
 #define TARGET_UNREACHABLE "Destination agent is unreachable"
 #define TARGET_PROHIBITED  "Destination agent is administratively prohibited"
 
+/*
+ * How long reading from a sensor is suspended while the scheduler disk
+ * quota is exceeded, before checking again.
+ */
+#define DISK_QUOTA_RETRY 1.0
+
+/*
+ * Maximum number of messages read from a connection per event.
+ */
+#define READ_BUDGET 64
+
+/*
+ * Number of buckets of the connection and token bucket indexes, a
+ * power of two.
+ */
+#define SENSORS_CNX_HASH_SIZE 4096
+
+
+/*
+ * Admission control: each analyzer get a token bucket, refilled at
+ * rate_limit messages per second up to rate_burst. Connections of an
+ * analyzer that ran out of tokens are not read from until a token is
+ * available, which slow the sensor down through TCP backpressure.
+ */
+struct sensor_bucket {
+        prelude_list_t list;
+        uint64_t analyzerid;
+
+        /*
+         * Protect the fields below, connections of an analyzer might
+         * run on different I/O threads.
+         */
+        gl_lock_t mutex;
+
+        double tokens;
+        ev_tstamp last_refill;
+
+        unsigned long suspended;
+        double suspended_time;
+};
+
+
+/*
+ * A message to be written by the thread owning the target connection.
+ */
+typedef struct {
+        uint64_t ident;
+        uint32_t instance_id;
+        prelude_msg_t *msg;
+} deferred_write_t;
+
 
 extern prelude_client_t *manager_client;
+extern struct ev_loop *manager_event_loop;
 
+/*
+ * Connections are owned by different I/O threads: the connection list
+ * is locked, and connections are only written to by their own thread.
+ */
 static PRELUDE_LIST(sensors_cnx_list);
 static uint32_t global_instance_id = 0;
+static gl_lock_t sensors_cnx_mutex = gl_lock_initializer;
+
+/*
+ * Connections indexed by analyzerid, for option routing.
+ */
+static prelude_list_t sensors_cnx_hash[SENSORS_CNX_HASH_SIZE];
+static prelude_bool_t sensors_cnx_hash_initialized = FALSE;
+
+/*
+ * Option requests might come from several I/O threads.
+ */
+static gl_lock_t option_mutex = gl_lock_initializer;
+
+/*
+ * Token buckets indexed by analyzerid. The index lock is only taken
+ * to look a bucket up, once per connection.
+ */
+static prelude_list_t bucket_hash[SENSORS_CNX_HASH_SIZE];
+static gl_lock_t bucket_mutex = gl_lock_initializer;
+static double rate_limit = 0;
+static double rate_burst = 0;
+static unsigned long disk_quota_suspended = 0;
+
+
+
+static unsigned int hash_analyzerid(uint64_t analyzerid)
+{
+        analyzerid ^= analyzerid >> 33;
+        analyzerid *= 0xff51afd7ed558ccdULL;
+        analyzerid ^= analyzerid >> 33;
+
+        return analyzerid & (SENSORS_CNX_HASH_SIZE - 1);
+}
+
+
+
+/*
+ * Buckets are shared by all connections of an analyzer, and kept once
+ * unused so that a sensor can't get a full burst back by reconnecting.
+ * The connection keep a pointer to its bucket.
+ */
+static sensor_bucket_t *bucket_get(uint64_t analyzerid, ev_tstamp now)
+{
+        prelude_list_t *tmp, *head;
+        sensor_bucket_t *bucket;
+
+        if ( rate_limit == 0 )
+                return NULL;
+
+        head = &bucket_hash[hash_analyzerid(analyzerid)];
+
+        gl_lock_lock(bucket_mutex);
+
+        prelude_list_for_each(head, tmp) {
+                bucket = prelude_list_entry(tmp, sensor_bucket_t, list);
+
+                if ( bucket->analyzerid == analyzerid )
+                        goto out;
+        }
+
+        bucket = calloc(1, sizeof(*bucket));
+        if ( ! bucket ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                goto out;
+        }
+
+        bucket->analyzerid = analyzerid;
+        bucket->tokens = rate_burst;
+        bucket->last_refill = now;
+        gl_lock_init(bucket->mutex);
 
+        prelude_list_add_tail(head, &bucket->list);
 
-static sensor_fd_t *search_client(prelude_list_t *head, uint64_t analyzerid, uint32_t instance_id)
+ out:
+        gl_lock_unlock(bucket_mutex);
+        return bucket;
+}
+
+
+
+static void bucket_consume(sensor_bucket_t *bucket)
+{
+        gl_lock_lock(bucket->mutex);
+        bucket->tokens--;
+        gl_lock_unlock(bucket->mutex);
+}
+
+
+
+/*
+ * Whether a new message might be read from this connection, suspending
+ * reading otherwise.
+ */
+static prelude_bool_t admit_message(sensor_fd_t *cnx)
+{
+        double delay;
+        ev_tstamp now;
+        sensor_bucket_t *bucket = cnx->bucket;
+
+        if ( bufpool_is_over_disk_quota() ) {
+                __atomic_fetch_add(&disk_quota_suspended, 1, __ATOMIC_RELAXED);
+
+                server_generic_client_suspend_read((server_generic_client_t *) cnx, DISK_QUOTA_RETRY);
+                return FALSE;
+        }
+
+        if ( ! bucket )
+                return TRUE;
+
+        now = ev_now(cnx->loop);
+
+        gl_lock_lock(bucket->mutex);
+
+        /*
+         * Connections of an analyzer might run on different loops.
+         */
+        if ( now > bucket->last_refill ) {
+                bucket->tokens += (now - bucket->last_refill) * rate_limit;
+                if ( bucket->tokens > rate_burst )
+                        bucket->tokens = rate_burst;
+
+                bucket->last_refill = now;
+        }
+
+        if ( bucket->tokens >= 1 ) {
+                gl_lock_unlock(bucket->mutex);
+                return TRUE;
+        }
+
+        delay = (1 - bucket->tokens) / rate_limit;
+
+        bucket->suspended++;
+        bucket->suspended_time += delay;
+
+        gl_lock_unlock(bucket->mutex);
+
+        server_generic_client_suspend_read((server_generic_client_t *) cnx, delay);
+
+        return FALSE;
+}
+
+
+/*
+ * The index is keyed by analyzerid only, so that any instance of an
+ * analyzer might be looked up.
+ */
+static prelude_list_t *get_cnx_bucket(uint64_t analyzerid)
+{
+        return &sensors_cnx_hash[hash_analyzerid(analyzerid)];
+}
+
+
+
+/*
+ * Must be called with sensors_cnx_mutex held.
+ */
+static void add_client(sensor_fd_t *cnx, prelude_bool_t tail)
+{
+        cnx->instance_id = ++global_instance_id;
+
+        if ( tail ) {
+                prelude_list_add_tail(&sensors_cnx_list, &cnx->list);
+                prelude_list_add_tail(get_cnx_bucket(cnx->ident), &cnx->hash_list);
+        } else {
+                prelude_list_add(&sensors_cnx_list, &cnx->list);
+                prelude_list_add(get_cnx_bucket(cnx->ident), &cnx->hash_list);
+        }
+}
+
+
+
+/*
+ * Must be called with sensors_cnx_mutex held.
+ */
+static sensor_fd_t *search_client(uint64_t analyzerid, uint32_t instance_id)
 {
         sensor_fd_t *client;
         prelude_list_t *tmp;
 
-        prelude_list_for_each(head, tmp) {
-                client = prelude_list_entry(tmp, sensor_fd_t, list);
+        prelude_list_for_each(get_cnx_bucket(analyzerid), tmp) {
+                client = prelude_list_entry(tmp, sensor_fd_t, hash_list);
 
                 if ( client->ident == analyzerid && (! instance_id || instance_id == client->instance_id) )
                         return client;
@@ -105,9 +341,13 @@ static int forward_message_to_analyzerid(sensor_fd_t *client, uint64_t analyzeri
 
         tag = prelude_msg_get_tag(msg);
 
-        target = search_client(&sensors_cnx_list, analyzerid, instance_no);
-        if ( ! target )
+        gl_lock_lock(sensors_cnx_mutex);
+
+        target = search_client(analyzerid, instance_no);
+        if ( ! target ) {
+                gl_lock_unlock(sensors_cnx_mutex);
                 return -1;
+        }
 
         /*
          * if we are connected to the client, we need write permission. If the
@@ -129,8 +369,13 @@ static int forward_message_to_analyzerid(sensor_fd_t *client, uint64_t analyzeri
                 }
         }
 
+        /*
+         * The list lock prevent a target owned by another thread from
+         * going away until the write is handed to that thread.
+         */
         sensor_server_write_client((server_generic_client_t *) target, msg);
  out:
+        gl_lock_unlock(sensors_cnx_mutex);
         return ret;
 }
 
@@ -254,10 +499,54 @@ static int process_request_cb(prelude_msgbuf_t *msgbuf, prelude_msg_t *msg)
 
 
 
+/*
+ * Return the reporting instance every option of the request apply to,
+ * or NULL if it target anything else, or might create or destroy instances.
+ */
+static prelude_plugin_instance_t *get_option_request_instance(prelude_msg_t *msg)
+{
+        void *buf;
+        uint8_t tag;
+        uint32_t len;
+        const char *name;
+        prelude_bool_t want_name = FALSE;
+        prelude_plugin_instance_t *pi, *target = NULL;
+
+        while ( prelude_msg_get(msg, &tag, &len, &buf) == 0 ) {
+
+                if ( tag == PRELUDE_MSG_OPTION_COMMIT || tag == PRELUDE_MSG_OPTION_DESTROY )
+                        return NULL;
+
+                if ( tag == PRELUDE_MSG_OPTION_SET || tag == PRELUDE_MSG_OPTION_GET ) {
+                        want_name = TRUE;
+                        continue;
+                }
+
+                if ( tag != PRELUDE_MSG_OPTION_NAME || ! want_name )
+                        continue;
+
+                want_name = FALSE;
+
+                if ( prelude_extract_characters_safe(&name, buf, len) < 0 )
+                        return NULL;
+
+                pi = report_plugins_search_instance(name);
+                if ( ! pi || (target && pi != target) )
+                        return NULL;
+
+                target = pi;
+        }
+
+        return target;
+}
+
+
+
 static int process_option_request(prelude_client_t *dst, sensor_fd_t *src, prelude_msg_t *msg)
 {
         int ret;
         prelude_msgbuf_t *buf;
+        prelude_plugin_instance_t *pi;
 
         ret = prelude_msgbuf_new(&buf);
         if ( ret < 0 )
@@ -268,11 +557,30 @@ static int process_option_request(prelude_client_t *dst, sensor_fd_t *src, prelu
         prelude_msgbuf_set_flags(buf, PRELUDE_MSGBUF_FLAGS_ASYNC);
 
         /*
-         * Stop report plugin processing for safety.
+         * If the request only apply to an existing reporting instance,
+         * hold that instance lock. Otherwise stop processing for safety.
          */
-        idmef_message_scheduler_stop_processing();
-        ret = prelude_option_process_request(dst, msg, buf);
-        idmef_message_scheduler_start_processing();
+        pi = get_option_request_instance(msg);
+        prelude_msg_recycle(msg);
+
+        gl_lock_lock(option_mutex);
+
+        if ( pi && plugin_lock_get_concurrency(pi) != MANAGER_PLUGIN_CONCURRENCY_REENTRANT ) {
+                plugin_lock_acquire(pi);
+                ret = prelude_option_process_request(dst, msg, buf);
+                plugin_lock_release(pi);
+        } else {
+                /*
+                 * The request might change the manager analyzer, which
+                 * spliced messages carry.
+                 */
+                idmef_message_scheduler_stop_processing();
+                ret = prelude_option_process_request(dst, msg, buf);
+                pmsg_forward_analyzer_changed();
+                idmef_message_scheduler_start_processing();
+        }
+
+        gl_lock_unlock(option_mutex);
 
         prelude_msgbuf_destroy(buf);
 
@@ -390,12 +698,15 @@ static int handle_declare_receiver(sensor_fd_t *sclient)
 
 static int handle_declare_client(sensor_fd_t *cnx)
 {
-        cnx->queue = idmef_message_scheduler_queue_new(manager_client);
+        cnx->queue = idmef_message_scheduler_queue_new(manager_client, cnx->ident);
         if ( ! cnx->queue )
                 return -1;
 
-        cnx->instance_id = ++global_instance_id;
-        prelude_list_add_tail(&sensors_cnx_list, &cnx->list);
+        cnx->bucket = bucket_get(cnx->ident, ev_now(cnx->loop));
+
+        gl_lock_lock(sensors_cnx_mutex);
+        add_client(cnx, TRUE);
+        gl_lock_unlock(sensors_cnx_mutex);
 
         return 0;
 }
@@ -431,19 +742,29 @@ static int handle_capability(sensor_fd_t *cnx, prelude_msg_t *msg)
 
 
 
+/*
+ * We receive a message from a client
+ *
+ * If the client connected to us (->cnx == NULL), we need to check it has WRITE  permission.
+ * If we connected to the client (->cnx != NULL), we need to check we have READ   permission.
+ */
+static prelude_bool_t has_idmef_permission(sensor_fd_t *client)
+{
+        if ( (! (client->permission & PRELUDE_CONNECTION_PERMISSION_IDMEF_WRITE) && ! client->we_connected) ||
+             (! (client->permission & PRELUDE_CONNECTION_PERMISSION_IDMEF_READ ) &&   client->we_connected) )
+                return FALSE;
+
+        return TRUE;
+}
+
+
+
 static int handle_msg(sensor_fd_t *client, prelude_msg_t *msg, uint8_t tag)
 {
         int ret;
 
         if ( tag == PRELUDE_MSG_IDMEF ) {
-                /*
-                 * We receive a message from a client
-                 *
-                 * If the client connected to us (->cnx == NULL), we need to check it has WRITE  permission.
-                 * If we connected to the client (->cnx != NULL), we need to check we have READ   permission.
-                 */
-                if ( (! (client->permission & PRELUDE_CONNECTION_PERMISSION_IDMEF_WRITE) && ! client->we_connected) ||
-                     (! (client->permission & PRELUDE_CONNECTION_PERMISSION_IDMEF_READ ) &&   client->we_connected) ) {
+                if ( ! has_idmef_permission(client) ) {
                         server_generic_log_client((server_generic_client_t *) client, PRELUDE_LOG_WARN,
                                                   "insufficient credentials to write IDMEF message.\n");
                         prelude_msg_destroy(msg);
@@ -480,33 +801,104 @@ static int handle_msg(sensor_fd_t *client, prelude_msg_t *msg, uint8_t tag)
 
 
 
-static int read_connection_cb(server_generic_client_t *client)
+static int schedule_messages(sensor_fd_t *cnx, prelude_msg_t **msgs, size_t count)
 {
         int ret;
+
+        if ( ! count )
+                return 0;
+
+        ret = idmef_message_schedule_batch(cnx->queue, msgs, count);
+        if ( ret < 0 ) {
+                server_generic_log_client((server_generic_client_t *) cnx, PRELUDE_LOG_WARN,
+                                          "error processing peer message: %s.\n", prelude_strerror(ret));
+                return -1;
+        }
+
+        return 0;
+}
+
+
+
+/*
+ * Read as many complete messages as available, up to READ_BUDGET, so
+ * that a burst of messages cost a single event loop iteration. IDMEF
+ * messages are handed to the scheduler once reading is over, or before
+ * handling any other message so that the sensor order is preserved.
+ */
+static int read_connection_cb(server_generic_client_t *client)
+{
+        int ret = 0;
+        uint8_t tag;
+        unsigned int i;
         prelude_msg_t *msg;
+        size_t count = 0;
+        prelude_msg_t *batch[READ_BUDGET];
         sensor_fd_t *cnx = (sensor_fd_t *) client;
 
-        ret = prelude_msg_read(&cnx->msg, cnx->fd);
-        if ( ret < 0 ) {
-                prelude_error_code_t code = prelude_error_get_code(ret);
+        for ( i = 0; i < READ_BUDGET; i++ ) {
+                /*
+                 * Admission is only checked before starting a new message.
+                 */
+                if ( ! cnx->msg && cnx->queue && ! admit_message(cnx) )
+                        break;
+
+                ret = prelude_msg_read(&cnx->msg, cnx->fd);
+                if ( ret < 0 ) {
+                        prelude_error_code_t code = prelude_error_get_code(ret);
+
+                        if ( code == PRELUDE_ERROR_EAGAIN ) {
+                                ret = 0;
+                                break;
+                        }
 
-                if ( code == PRELUDE_ERROR_EAGAIN )
-                        return 0;
+                        cnx->msg = NULL;
+                        if ( code != PRELUDE_ERROR_EOF )
+                                server_generic_log_client((server_generic_client_t *) cnx, PRELUDE_LOG_WARN, "%s.\n", prelude_strerror(ret));
 
+                        ret = -1;
+                        break;
+                }
+
+                msg = cnx->msg;
                 cnx->msg = NULL;
-                if ( code != PRELUDE_ERROR_EOF )
-                        server_generic_log_client((server_generic_client_t *) cnx, PRELUDE_LOG_WARN, "%s.\n", prelude_strerror(ret));
 
-                return -1;
+                tag = prelude_msg_get_tag(msg);
+
+                if ( tag == PRELUDE_MSG_IDMEF && has_idmef_permission(cnx) ) {
+                        if ( cnx->bucket )
+                                bucket_consume(cnx->bucket);
+
+                        batch[count++] = msg;
+                        continue;
+                }
+
+                ret = schedule_messages(cnx, batch, count);
+                count = 0;
+
+                if ( ret < 0 ) {
+                        prelude_msg_destroy(msg);
+                        break;
+                }
+
+                ret = handle_msg(cnx, msg, tag);
+                if ( ret < 0 )
+                        break;
         }
 
-        msg = cnx->msg;
-        cnx->msg = NULL;
+        if ( schedule_messages(cnx, batch, count) < 0 )
+                ret = -1;
 
-        ret = handle_msg(cnx, msg, prelude_msg_get_tag(msg));
         if ( ret < 0 )
                 return ret;
 
+        /*
+         * Data already decrypted by the TLS layer won't trigger the
+         * socket watcher again.
+         */
+        if ( i == READ_BUDGET && prelude_io_pending(cnx->fd) > 0 )
+                server_generic_notify_read_pending(client);
+
         return 1;
 }
 
@@ -596,8 +988,14 @@ static int close_connection_cb(server_generic_client_t *ptr)
         }
 
 
-        if ( ! prelude_list_is_empty(&cnx->list) )
+        gl_lock_lock(sensors_cnx_mutex);
+
+        if ( ! prelude_list_is_empty(&cnx->list) ) {
                 prelude_list_del(&cnx->list);
+                prelude_list_del(&cnx->hash_list);
+        }
+
+        gl_lock_unlock(sensors_cnx_mutex);
 
         prelude_list_for_each_safe(&cnx->write_msg_list, tmp, bkp) {
                 msg = prelude_linked_object_get_object(tmp);
@@ -615,7 +1013,6 @@ static int close_connection_cb(server_generic_client_t *ptr)
 
         if ( cnx->queue )
                 idmef_message_scheduler_queue_destroy(cnx->queue);
-
         return 0;
 }
 
@@ -642,8 +1039,18 @@ static int accept_connection_cb(server_generic_client_t *ptr)
 
 server_generic_t *sensor_server_new(void)
 {
+        unsigned int i;
         server_generic_t *server;
 
+        if ( ! sensors_cnx_hash_initialized ) {
+                for ( i = 0; i < SENSORS_CNX_HASH_SIZE; i++ ) {
+                        prelude_list_init(&sensors_cnx_hash[i]);
+                        prelude_list_init(&bucket_hash[i]);
+                }
+
+                sensors_cnx_hash_initialized = TRUE;
+        }
+
         server = server_generic_new(sizeof(sensor_fd_t), accept_connection_cb,
                                     read_connection_cb, write_connection_cb, close_connection_cb);
         if ( ! server ) {
@@ -668,20 +1075,23 @@ int sensor_server_add_client(server_generic_t *server, server_generic_client_t *
 {
         sensor_fd_t *cdata;
 
-        cdata = calloc(1, sizeof(*cdata));
+        cdata = (sensor_fd_t *) server_generic_client_new(server);
         if ( ! cdata ) {
                 prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
                 return -1;
         }
 
         *client = (server_generic_client_t *) cdata;
+        cdata->ident = prelude_connection_get_peer_analyzerid(cnx);
 
-        cdata->queue = idmef_message_scheduler_queue_new(manager_client);
+        cdata->queue = idmef_message_scheduler_queue_new(manager_client, cdata->ident);
         if ( ! cdata->queue ) {
-                free(cdata);
+                server_generic_client_free(server, *client);
                 return -1;
         }
 
+        cdata->bucket = bucket_get(cdata->ident, ev_now(manager_event_loop));
+
         cdata->state |= SERVER_GENERIC_CLIENT_STATE_ACCEPTED;
         cdata->fd = prelude_connection_get_fd(cnx);
 
@@ -692,20 +1102,77 @@ int sensor_server_add_client(server_generic_t *server, server_generic_client_t *
         cdata->server = server;
 
         prelude_list_init(&cdata->write_msg_list);
-        cdata->ident = prelude_connection_get_peer_analyzerid(cnx);
 
         server_generic_client_set_permission((server_generic_client_t *)cdata, prelude_connection_get_permission(cnx));
-        prelude_list_add(&sensors_cnx_list, &cdata->list);
+
+        gl_lock_lock(sensors_cnx_mutex);
+        add_client(cdata, FALSE);
+        gl_lock_unlock(sensors_cnx_mutex);
 
         return server_generic_process_requests(server, (server_generic_client_t *) cdata);
 }
 
 
+static void deferred_write_cb(void *data)
+{
+        sensor_fd_t *dst;
+        deferred_write_t *dw = data;
+
+        gl_lock_lock(sensors_cnx_mutex);
+        dst = search_client(dw->ident, dw->instance_id);
+        gl_lock_unlock(sensors_cnx_mutex);
+
+        /*
+         * Once found, the connection can't go away since this thread own it.
+         */
+        if ( dst )
+                sensor_server_write_client((server_generic_client_t *) dst, dw->msg);
+        else
+                prelude_msg_destroy(dw->msg);
+
+        free(dw);
+}
+
+
+
+/*
+ * Hand msg to the thread owning client. The caller must prevent client
+ * from being closed meanwhile.
+ */
+static int defer_write_client(sensor_fd_t *dst, prelude_msg_t *msg)
+{
+        int ret;
+        deferred_write_t *dw;
+
+        dw = malloc(sizeof(*dw));
+        if ( ! dw ) {
+                prelude_msg_destroy(msg);
+                return prelude_error_from_errno(errno);
+        }
+
+        dw->ident = dst->ident;
+        dw->instance_id = dst->instance_id;
+        dw->msg = msg;
+
+        ret = server_generic_client_call((server_generic_client_t *) dst, deferred_write_cb, dw);
+        if ( ret < 0 ) {
+                prelude_msg_destroy(msg);
+                free(dw);
+        }
+
+        return ret;
+}
+
+
+
 int sensor_server_write_client(server_generic_client_t *client, prelude_msg_t *msg)
 {
         int ret;
         sensor_fd_t *dst = (sensor_fd_t *) client;
 
+        if ( ! server_generic_client_is_local(client) )
+                return defer_write_client(dst, msg);
+
         if ( prelude_list_is_empty(&dst->write_msg_list) )
                 ret = write_client(dst, msg);
         else {
@@ -715,3 +1182,44 @@ int sensor_server_write_client(server_generic_client_t *client, prelude_msg_t *m
 
         return ret;
 }
+
+
+
+void sensor_server_set_rate_limit(double rate, double burst)
+{
+        rate_limit = rate;
+        rate_burst = ( burst < 1 ) ? 1 : burst;
+}
+
+
+
+void sensor_server_print_stats(void)
+{
+        unsigned int i;
+        prelude_list_t *tmp;
+        sensor_bucket_t *bucket;
+        unsigned long suspended;
+
+        gl_lock_lock(bucket_mutex);
+
+        for ( i = 0; i < SENSORS_CNX_HASH_SIZE && sensors_cnx_hash_initialized; i++ ) {
+                prelude_list_for_each(&bucket_hash[i], tmp) {
+                        bucket = prelude_list_entry(tmp, sensor_bucket_t, list);
+
+                        gl_lock_lock(bucket->mutex);
+
+                        if ( bucket->suspended )
+                                prelude_log(PRELUDE_LOG_INFO, "analyzer %" PRELUDE_PRIu64 ": rate limited %lu times, %.1f seconds.\n",
+                                            bucket->analyzerid, bucket->suspended, bucket->suspended_time);
+
+                        gl_lock_unlock(bucket->mutex);
+                }
+        }
+
+        gl_lock_unlock(bucket_mutex);
+
+        suspended = __atomic_load_n(&disk_quota_suspended, __ATOMIC_RELAXED);
+        if ( suspended )
+                prelude_log(PRELUDE_LOG_INFO, "disk quota exceeded: sensors suspended %lu times, %.1f seconds.\n",
+                            suspended, suspended * DISK_QUOTA_RETRY);
+}
@@ -54,6 +54,10 @@
 
 #include <gnutls/gnutls.h>
 
+#include "glthread/thread.h"
+#include "glthread/lock.h"
+#include "glthread/cond.h"
+
 #include "manager-auth.h"
 #include "manager-options.h"
 #include "server-generic.h"
@@ -62,6 +66,16 @@
 
 #define STATE_ACCEPTED_TIMEOUT 20
 
+/*
+ * Maximum number of connections accepted per listener event.
+ */
+#define ACCEPT_BUDGET 64
+
+/*
+ * Number of released client objects each server keep for reuse.
+ */
+#define CLIENT_FREE_MAX 1024
+
 
 struct server_generic {
         ev_io evio;
@@ -76,6 +90,13 @@ struct server_generic {
         server_generic_write_func_t *write;
         server_generic_close_func_t *close;
         server_generic_accept_func_t *accept;
+
+        /*
+         * Released clients, linked through their first word.
+         */
+        gl_lock_t free_mutex;
+        void *free_clients;
+        unsigned int free_count;
 };
 
 
@@ -84,6 +105,40 @@ struct server_generic_client {
 };
 
 
+typedef struct {
+        prelude_list_t list;
+        server_generic_call_func_t *func;
+        void *data;
+} loop_call_t;
+
+
+/*
+ * An event loop, and the calls other threads queued for it.
+ */
+typedef struct {
+        struct ev_loop *loop;
+        ev_async evcall;
+
+        gl_lock_t mutex;
+        prelude_list_t calls;
+
+        gl_thread_t thread;
+} io_loop_t;
+
+
+/*
+ * A TLS handshake step run by the handshake threads. call must come
+ * first, since the job is freed along with it once handed back.
+ */
+typedef struct {
+        loop_call_t call;
+        prelude_list_t list;
+
+        server_generic_client_t *client;
+        int ret;
+} handshake_job_t;
+
+
 
 extern manager_config_t config;
 extern prelude_client_t *manager_client;
@@ -93,6 +148,34 @@ static struct ev_async ev_trigger;
 extern struct ev_loop *manager_event_loop;
 static volatile sig_atomic_t continue_processing = 1;
 
+/*
+ * Connections are accepted from the main loop, and handed in turn to
+ * one of the I/O threads, which then own them until they are closed.
+ */
+static io_loop_t main_loop;
+static io_loop_t *io_loops = NULL;
+static unsigned int io_threads = 0;
+static unsigned int next_io_loop = 0;
+static prelude_bool_t loops_started = FALSE;
+static __thread struct ev_loop *current_loop = NULL;
+
+static int listen_backlog = SOMAXCONN;
+
+/*
+ * Handshakes are run outside of the event loops, so that the asymmetric
+ * crypto of many connecting clients doesn't delay established ones.
+ */
+static unsigned int handshake_threads = 0;
+static gl_thread_t *handshake_tids = NULL;
+static PRELUDE_LIST(handshake_jobs);
+static prelude_bool_t handshake_stop = FALSE;
+static gl_lock_t handshake_mutex = gl_lock_initializer;
+static gl_cond_t handshake_cond = gl_cond_initializer;
+static __thread server_generic_client_t *current_handshake = NULL;
+
+
+static void set_io_events(server_generic_client_t *client, int events);
+
 static int send_auth_result(server_generic_client_t *client, int result)
 {
         int ret;
@@ -152,6 +235,87 @@ static int send_queued_alert(server_generic_client_t *client)
 
 
 
+/*
+ * Queue the next handshake step for the handshake threads. The client
+ * isn't watched until the step is handed back to its loop.
+ */
+static int handshake_start(server_generic_client_t *client)
+{
+        handshake_job_t *job;
+
+        job = malloc(sizeof(*job));
+        if ( ! job ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        job->client = client;
+
+        client->state |= SERVER_GENERIC_CLIENT_STATE_HANDSHAKING;
+        ev_io_stop(client->loop, &client->evio);
+
+        gl_lock_lock(handshake_mutex);
+        prelude_list_add_tail(&handshake_jobs, &job->list);
+        gl_cond_signal(handshake_cond);
+        gl_lock_unlock(handshake_mutex);
+
+        return 0;
+}
+
+
+
+static int accept_client(server_generic_t *server, server_generic_client_t *client)
+{
+        int ret;
+
+        if ( ! client->state & SERVER_GENERIC_CLIENT_STATE_AUTHENTICATED )
+                return -1;
+
+        if ( server->sa->sa_family == AF_UNIX && ! (client->state & SERVER_GENERIC_CLIENT_STATE_ACCEPTED) ) {
+                ret = manager_auth_disable_encryption(client, client->fd);
+                if ( ret <= 0 )
+                        return ret;
+
+                server_generic_log_client(client, PRELUDE_LOG_INFO, "disabled encryption on local UNIX connection.\n");
+        }
+
+        client->state |= SERVER_GENERIC_CLIENT_STATE_ACCEPTED;
+        ev_timer_stop(client->loop, &client->evtimer);
+
+        return server->accept(client);
+}
+
+
+
+/*
+ * Handle the result of manager_auth_client().
+ */
+static int handshake_finish(server_generic_t *server, server_generic_client_t *client, int ret)
+{
+        if ( ret == 0 )
+                return ret; /* EAGAIN happened */
+
+        if ( ret < 0 ) {
+                if ( client->alert ) {
+                        ret = send_queued_alert(client);
+                        if ( ret != 1 )
+                                return ret;
+                }
+
+                return -1;
+        }
+
+        client->state |= SERVER_GENERIC_CLIENT_STATE_AUTHENTICATED;
+
+        ret = send_auth_result(client, PRELUDE_MSG_AUTH_SUCCEED);
+        if ( ret != 1 )
+                return ret;
+
+        return accept_client(server, client);
+}
+
+
+
 /*
  * Read the message sent by the Prelude Manager client.
  * This message should contain information about the kind of
@@ -163,26 +327,15 @@ static int authenticate_client(server_generic_t *server, server_generic_client_t
 {
         int ret;
 
-        if ( ! client->msg && ! client->alert && ! (client->state & SERVER_GENERIC_CLIENT_STATE_AUTHENTICATED) ) {
-                ret = manager_auth_client(client, client->fd, &client->alert);
-                if ( ret == 0 )
-                        return ret; /* EAGAIN happened */
-
-                if ( ret < 0 ) {
-                        if ( client->alert ) {
-                                ret = send_queued_alert(client);
-                                if ( ret != 1 )
-                                        return ret;
-                        }
-
-                        return -1;
-                }
+        if ( client->state & SERVER_GENERIC_CLIENT_STATE_HANDSHAKING )
+                return 0;
 
-                client->state |= SERVER_GENERIC_CLIENT_STATE_AUTHENTICATED;
+        if ( ! client->msg && ! client->alert && ! (client->state & SERVER_GENERIC_CLIENT_STATE_AUTHENTICATED) ) {
+                if ( handshake_threads )
+                        return handshake_start(client);
 
-                ret = send_auth_result(client, PRELUDE_MSG_AUTH_SUCCEED);
-                if ( ret != 1 )
-                        return ret;
+                ret = manager_auth_client(client, client->fd, &client->alert);
+                return handshake_finish(server, client, ret);
         }
 
         else if ( client->alert ) {
@@ -197,21 +350,7 @@ static int authenticate_client(server_generic_t *server, server_generic_client_t
                         return ret;
         }
 
-        if ( ! client->state & SERVER_GENERIC_CLIENT_STATE_AUTHENTICATED )
-                return -1;
-
-        if ( server->sa->sa_family == AF_UNIX && ! (client->state & SERVER_GENERIC_CLIENT_STATE_ACCEPTED) ) {
-                ret = manager_auth_disable_encryption(client, client->fd);
-                if ( ret <= 0 )
-                        return ret;
-
-                server_generic_log_client(client, PRELUDE_LOG_INFO, "disabled encryption on local UNIX connection.\n");
-        }
-
-        client->state |= SERVER_GENERIC_CLIENT_STATE_ACCEPTED;
-        ev_timer_stop(manager_event_loop, &client->evtimer);
-
-        return server->accept(client);
+        return accept_client(server, client);
 }
 
 
@@ -309,6 +448,8 @@ static int close_connection_cb(server_generic_client_t *client)
          * that they can take control over the connection FD.
          */
         if ( client->fd ) {
+                manager_auth_client_close(client->fd);
+
                 ret = do_close_fd(client);
                 if ( ret < 0 )
                         return -1;
@@ -318,7 +459,7 @@ static int close_connection_cb(server_generic_client_t *client)
         }
 
         server_generic_remove_client(client->server, client);
-        free(client);
+        server_generic_client_free(client->server, client);
 
         return 0;
 }
@@ -379,9 +520,9 @@ static int setup_client_socket(server_generic_t *server,
         }
 #endif
         /*
-         * set client socket non blocking.
+         * set client socket non blocking, unless accept4() did.
          */
-#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
+#if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__) && ! defined(HAVE_ACCEPT4)
         ret = fcntl(client, F_SETFL, O_NONBLOCK);
         if ( ret < 0 )
                 return prelude_error_verbose(PRELUDE_ERROR_GENERIC, "could not set non blocking mode for client: %s", strerror(errno));
@@ -404,6 +545,10 @@ static int setup_client_socket(server_generic_t *server,
 
 
 
+/*
+ * Return the accepted socket, -1 on error, or -2 if there is no
+ * pending connection left.
+ */
 static int accept_connection(server_generic_t *server, server_generic_client_t *cdata)
 {
         socklen_t addrlen;
@@ -411,8 +556,15 @@ static int accept_connection(server_generic_t *server, server_generic_client_t *
 
         addrlen = sizeof(cdata->sa);
 
+#ifdef HAVE_ACCEPT4
+        sock = accept4(server->sock, (struct sockaddr *) &cdata->sa, &addrlen, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
         sock = accept(server->sock, (struct sockaddr *) &cdata->sa, &addrlen);
+#endif
         if ( sock < 0 ) {
+                if ( errno == EAGAIN || errno == EWOULDBLOCK )
+                        return -2;
+
                 prelude_log(PRELUDE_LOG_ERR, "accept error: %s.\n", strerror(errno));
                 return -1;
         }
@@ -429,12 +581,100 @@ static int accept_connection(server_generic_t *server, server_generic_client_t *
 
 
 
+static loop_call_t *loop_call_next(io_loop_t *iol)
+{
+        loop_call_t *call = NULL;
+
+        gl_lock_lock(iol->mutex);
+
+        if ( ! prelude_list_is_empty(&iol->calls) ) {
+                call = prelude_list_entry(iol->calls.next, loop_call_t, list);
+                prelude_list_del(&call->list);
+        }
+
+        gl_lock_unlock(iol->mutex);
+
+        return call;
+}
+
+
+
+static void loop_call_cb(struct ev_loop *loop, struct ev_async *w, int revents)
+{
+        loop_call_t *call;
+        io_loop_t *iol = ev_userdata(loop);
+
+        while ( (call = loop_call_next(iol)) ) {
+                call->func(call->data);
+                free(call);
+        }
+}
+
+
+
+/*
+ * Have func called from the thread running iol.
+ */
+static void loop_call_queue(io_loop_t *iol, loop_call_t *call)
+{
+        gl_lock_lock(iol->mutex);
+        prelude_list_add_tail(&iol->calls, &call->list);
+        gl_lock_unlock(iol->mutex);
+
+        ev_async_send(iol->loop, &iol->evcall);
+}
+
+
+
+static int loop_call(io_loop_t *iol, server_generic_call_func_t *func, void *data)
+{
+        loop_call_t *call;
+
+        call = malloc(sizeof(*call));
+        if ( ! call ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                return -1;
+        }
+
+        call->func = func;
+        call->data = data;
+
+        loop_call_queue(iol, call);
+
+        return 0;
+}
+
+
+
+static void adopt_client_cb(void *data)
+{
+        server_generic_client_t *client = data;
+        server_generic_process_requests(client->server, client);
+}
+
+
+
+static io_loop_t *get_next_io_loop(void)
+{
+        if ( ! io_threads )
+                return &main_loop;
+
+        return &io_loops[next_io_loop++ % io_threads];
+}
+
+
+
+/*
+ * Return 1 if a connection was accepted, 0 if there was none pending,
+ * -1 on error.
+ */
 static int handle_connection(server_generic_t *server)
 {
         int ret, client;
+        io_loop_t *iol;
         server_generic_client_t *cdata;
 
-        cdata = calloc(1, server->clientlen);
+        cdata = server_generic_client_new(server);
         if ( ! cdata ) {
                 prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
                 return -1;
@@ -442,27 +682,34 @@ static int handle_connection(server_generic_t *server)
 
         client = accept_connection(server, cdata);
         if ( client < 0 ) {
-                free(cdata);
-                return -1;
+                server_generic_client_free(server, cdata);
+                return ( client == -2 ) ? 0 : -1;
         }
 
         ret = setup_client_socket(server, cdata, client);
         if ( ret < 0 ) {
-                free(cdata);
+                server_generic_client_free(server, cdata);
                 close(client);
                 return -1;
         }
 
-        ret = server_generic_process_requests(server, cdata);
+        cdata->server = server;
+
+        iol = get_next_io_loop();
+        if ( iol == &main_loop )
+                ret = server_generic_process_requests(server, cdata);
+        else
+                ret = loop_call(iol, adopt_client_cb, cdata);
+
         if ( ret < 0 ) {
                 prelude_log(PRELUDE_LOG_ERR, "queueing client FD for server logic processing failed.\n");
                 prelude_io_close(cdata->fd);
                 prelude_io_destroy(cdata->fd);
-                free(cdata);
+                server_generic_client_free(server, cdata);
                 return -1;
         }
 
-        return 0;
+        return 1;
 }
 
 
@@ -472,6 +719,15 @@ static int handle_connection(server_generic_t *server)
 static void libev_timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
         server_generic_client_t *client = w->data;
+
+        /*
+         * The connection is closed once the handshake thread is done with it.
+         */
+        if ( client->state & SERVER_GENERIC_CLIENT_STATE_HANDSHAKING ) {
+                client->state |= SERVER_GENERIC_CLIENT_STATE_CLOSING;
+                return;
+        }
+
         close_connection_cb(client);
 }
 
@@ -494,9 +750,18 @@ static void libev_notification_cb(struct ev_loop *loop, struct ev_io *w, int rev
 }
 
 
+/*
+ * Drain the accept queue, so that a reconnection storm doesn't
+ * overflow the listen backlog.
+ */
 static void connection_cb(struct ev_loop *loop, struct ev_io *w, int revents)
 {
-        handle_connection((server_generic_t *) w);
+        unsigned int i;
+
+        for ( i = 0; i < ACCEPT_BUDGET; i++ ) {
+                if ( handle_connection((server_generic_t *) w) <= 0 )
+                        break;
+        }
 }
 
 
@@ -507,6 +772,236 @@ static void ev_trigger_cb(struct ev_loop *loop, struct ev_async *w, int revents)
 
 
 
+static void io_loop_init(io_loop_t *iol, struct ev_loop *loop)
+{
+        iol->loop = loop;
+
+        gl_lock_init(iol->mutex);
+        prelude_list_init(&iol->calls);
+
+        ev_set_userdata(loop, iol);
+
+        ev_async_init(&iol->evcall, loop_call_cb);
+        ev_async_start(loop, &iol->evcall);
+}
+
+
+
+static void *io_thread(void *arg)
+{
+        int ret;
+        sigset_t set;
+        io_loop_t *iol = arg;
+
+        sigfillset(&set);
+
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        current_loop = iol->loop;
+        ev_loop(iol->loop, 0);
+
+        return NULL;
+}
+
+
+
+static void io_threads_start(void)
+{
+        int ret;
+        unsigned int i;
+        struct ev_loop *loop;
+
+        io_loop_init(&main_loop, manager_event_loop);
+        current_loop = manager_event_loop;
+        loops_started = TRUE;
+
+        if ( ! io_threads )
+                return;
+
+        io_loops = calloc(io_threads, sizeof(*io_loops));
+        if ( ! io_loops ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                io_threads = 0;
+                return;
+        }
+
+        for ( i = 0; i < io_threads; i++ ) {
+                loop = ev_loop_new(EVFLAG_AUTO);
+                if ( ! loop ) {
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't create I/O thread event loop.\n");
+                        break;
+                }
+
+                io_loop_init(&io_loops[i], loop);
+
+                ret = glthread_create(&io_loops[i].thread, io_thread, &io_loops[i]);
+                if ( ret != 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't create I/O thread.\n");
+                        ev_async_stop(loop, &io_loops[i].evcall);
+                        ev_loop_destroy(loop);
+                        gl_lock_destroy(io_loops[i].mutex);
+                        break;
+                }
+        }
+
+        io_threads = i;
+        prelude_log(PRELUDE_LOG_INFO, "%u I/O threads started.\n", io_threads);
+}
+
+
+
+static void stop_loop_cb(void *data)
+{
+        ev_unloop(data, EVUNLOOP_ALL);
+}
+
+
+
+/*
+ * Connections still owned by the I/O threads are left as is, since
+ * we are exiting.
+ */
+static void io_threads_stop(void)
+{
+        unsigned int i;
+
+        for ( i = 0; i < io_threads; i++ ) {
+                if ( loop_call(&io_loops[i], stop_loop_cb, io_loops[i].loop) == 0 )
+                        gl_thread_join(io_loops[i].thread, NULL);
+        }
+}
+
+
+
+static void handshake_done_cb(void *data)
+{
+        int ret;
+        handshake_job_t *job = data;
+        server_generic_client_t *client = job->client;
+
+        client->state &= ~SERVER_GENERIC_CLIENT_STATE_HANDSHAKING;
+
+        if ( client->state & SERVER_GENERIC_CLIENT_STATE_CLOSING ) {
+                close_connection_cb(client);
+                return;
+        }
+
+        set_io_events(client, client->evio.events & (EV_READ|EV_WRITE));
+
+        ret = handshake_finish(client->server, client, job->ret);
+        if ( ret < 0 || client->state & SERVER_GENERIC_CLIENT_STATE_CLOSING )
+                close_connection_cb(client);
+
+        /*
+         * Data might have been received along with the end of the handshake.
+         */
+        else if ( ret > 0 )
+                server_generic_notify_read_pending(client);
+}
+
+
+
+static handshake_job_t *handshake_job_next(void)
+{
+        handshake_job_t *job = NULL;
+
+        gl_lock_lock(handshake_mutex);
+
+        while ( prelude_list_is_empty(&handshake_jobs) && ! handshake_stop )
+                gl_cond_wait(handshake_cond, handshake_mutex);
+
+        if ( ! handshake_stop ) {
+                job = prelude_list_entry(handshake_jobs.next, handshake_job_t, list);
+                prelude_list_del(&job->list);
+        }
+
+        gl_lock_unlock(handshake_mutex);
+
+        return job;
+}
+
+
+
+static void *handshake_thread(void *arg)
+{
+        int ret;
+        sigset_t set;
+        handshake_job_t *job;
+        server_generic_client_t *client;
+
+        sigfillset(&set);
+
+        ret = glthread_sigmask(SIG_SETMASK, &set, NULL);
+        if ( ret < 0 ) {
+                prelude_log(PRELUDE_LOG_ERR, "couldn't set thread signal mask.\n");
+                return NULL;
+        }
+
+        while ( (job = handshake_job_next()) ) {
+                client = job->client;
+
+                current_handshake = client;
+                job->ret = manager_auth_client(client, client->fd, &client->alert);
+                current_handshake = NULL;
+
+                job->call.func = handshake_done_cb;
+                job->call.data = job;
+
+                loop_call_queue(ev_userdata(client->loop), &job->call);
+        }
+
+        return NULL;
+}
+
+
+
+static void handshake_threads_start(void)
+{
+        int ret;
+        unsigned int i;
+
+        if ( ! handshake_threads )
+                return;
+
+        handshake_tids = calloc(handshake_threads, sizeof(*handshake_tids));
+        if ( ! handshake_tids ) {
+                prelude_log(PRELUDE_LOG_ERR, "memory exhausted.\n");
+                handshake_threads = 0;
+                return;
+        }
+
+        for ( i = 0; i < handshake_threads; i++ ) {
+                ret = glthread_create(&handshake_tids[i], handshake_thread, NULL);
+                if ( ret != 0 ) {
+                        prelude_log(PRELUDE_LOG_ERR, "couldn't create TLS handshake thread.\n");
+                        break;
+                }
+        }
+
+        handshake_threads = i;
+}
+
+
+
+static void handshake_threads_stop(void)
+{
+        unsigned int i;
+
+        gl_lock_lock(handshake_mutex);
+        handshake_stop = TRUE;
+        gl_cond_broadcast(handshake_cond);
+        gl_lock_unlock(handshake_mutex);
+
+        for ( i = 0; i < handshake_threads; i++ )
+                gl_thread_join(handshake_tids[i], NULL);
+}
+
+
+
 static int wait_connection(server_generic_t **server, size_t nserver)
 {
         unsigned int i;
@@ -539,7 +1034,7 @@ static int generic_server(int sock, struct sockaddr *addr, size_t alen)
                 return prelude_error_verbose(prelude_error_code_from_errno(errno),
                                              "could not bind socket: %s", strerror(errno));
 
-        ret = listen(sock, 10);
+        ret = listen(sock, listen_backlog);
         if ( ret < 0 )
                 return prelude_error_verbose(PRELUDE_ERROR_GENERIC, "listen error: %s", strerror(errno));
 
@@ -765,6 +1260,12 @@ static int sg_bind_common(server_generic_t *server, unsigned int port)
 #if ! ((defined _WIN32 || defined __WIN32__) && !defined __CYGWIN__)
         fcntl(server->sock, F_SETFD, fcntl(server->sock, F_GETFD) | FD_CLOEXEC);
 
+        /*
+         * Connections are accepted until the queue is empty.
+         */
+        if ( fcntl(server->sock, F_SETFL, fcntl(server->sock, F_GETFL) | O_NONBLOCK) < 0 )
+                return prelude_error_verbose(PRELUDE_ERROR_GENERIC, "could not set non blocking mode for listener: %s", strerror(errno));
+
         if ( server->sa->sa_family == AF_UNIX )
                 prelude_log(PRELUDE_LOG_INFO, "server started (listening on %s).\n",
                             ((struct sockaddr_un *) server->sa)->sun_path);
@@ -807,11 +1308,57 @@ server_generic_t *server_generic_new(size_t clientlen, server_generic_accept_fun
         server->close = closef;
         server->clientlen = clientlen;
 
+        gl_lock_init(server->free_mutex);
+        server->free_clients = NULL;
+        server->free_count = 0;
+
         return server;
 }
 
 
 
+server_generic_client_t *server_generic_client_new(server_generic_t *server)
+{
+        void *client;
+
+        gl_lock_lock(server->free_mutex);
+
+        client = server->free_clients;
+        if ( client ) {
+                server->free_clients = *(void **) client;
+                server->free_count--;
+        }
+
+        gl_lock_unlock(server->free_mutex);
+
+        if ( ! client )
+                return calloc(1, server->clientlen);
+
+        memset(client, 0, server->clientlen);
+
+        return client;
+}
+
+
+
+void server_generic_client_free(server_generic_t *server, server_generic_client_t *client)
+{
+        gl_lock_lock(server->free_mutex);
+
+        if ( server->free_count < CLIENT_FREE_MAX ) {
+                *(void **) client = server->free_clients;
+                server->free_clients = client;
+                server->free_count++;
+                client = NULL;
+        }
+
+        gl_lock_unlock(server->free_mutex);
+
+        free(client);
+}
+
+
+
 int server_generic_bind_numeric(server_generic_t *server, struct sockaddr *sa, socklen_t len, unsigned int port)
 {
         int ret;
@@ -862,7 +1409,13 @@ int server_generic_bind(server_generic_t *server, const char *saddr, unsigned in
 
 void server_generic_start(server_generic_t **server, size_t nserver)
 {
+        io_threads_start();
+        handshake_threads_start();
+
         wait_connection(server, nserver);
+
+        handshake_threads_stop();
+        io_threads_stop();
 }
 
 
@@ -888,6 +1441,14 @@ void server_generic_destroy(server_generic_t *server)
                 free(server->sa);
         }
 
+        while ( server->free_clients ) {
+                void *client = server->free_clients;
+
+                server->free_clients = *(void **) client;
+                free(client);
+        }
+
+        gl_lock_destroy(server->free_mutex);
         free(server);
 }
 
@@ -898,19 +1459,78 @@ void server_generic_notify_event(void)
 }
 
 
+/*
+ * Reading is not monitored while the client is suspended, unless the
+ * connection is being closed.
+ */
+static void set_io_events(server_generic_client_t *client, int events)
+{
+        /*
+         * From a handshake thread: the watcher is restarted with these
+         * events once the client is handed back to its loop.
+         */
+        if ( client == current_handshake ) {
+                ev_io_set(&client->evio, (int) prelude_io_get_fd(client->fd), events);
+                return;
+        }
+
+        if ( client->state & SERVER_GENERIC_CLIENT_STATE_SUSPENDED &&
+             ! (client->state & SERVER_GENERIC_CLIENT_STATE_CLOSING) )
+                events &= ~EV_READ;
+
+        ev_io_stop(client->loop, &client->evio);
+        ev_io_set(&client->evio, (int) prelude_io_get_fd(client->fd), events);
+
+        if ( events )
+                ev_io_start(client->loop, &client->evio);
+}
+
+
+static void libev_resume_cb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+        server_generic_client_t *client = w->data;
+
+        client->state &= ~SERVER_GENERIC_CLIENT_STATE_SUSPENDED;
+        set_io_events(client, EV_READ | (client->evio.events & EV_WRITE));
+}
+
+
 void server_generic_notify_write_enable(server_generic_client_t *client)
 {
-        ev_io_stop(manager_event_loop, &client->evio);
-        ev_io_set(&client->evio, (int) prelude_io_get_fd(client->fd), EV_READ|EV_WRITE);
-        ev_io_start(manager_event_loop, &client->evio);
+        set_io_events(client, EV_READ|EV_WRITE);
 }
 
 
 void server_generic_notify_write_disable(server_generic_client_t *client)
 {
-        ev_io_stop(manager_event_loop, &client->evio);
-        ev_io_set(&client->evio, (int) prelude_io_get_fd(client->fd), EV_READ);
-        ev_io_start(manager_event_loop, &client->evio);
+        set_io_events(client, EV_READ);
+}
+
+
+/*
+ * Have the client read callback called again, for data that is already
+ * buffered and won't make the socket readable.
+ */
+void server_generic_notify_read_pending(server_generic_client_t *client)
+{
+        ev_feed_event(client->loop, &client->evio, EV_READ);
+}
+
+
+/*
+ * Stop reading from the client for delay seconds, so that the peer
+ * get slowed down by TCP flow control.
+ */
+void server_generic_client_suspend_read(server_generic_client_t *client, double delay)
+{
+        if ( client->state & SERVER_GENERIC_CLIENT_STATE_SUSPENDED )
+                return;
+
+        client->state |= SERVER_GENERIC_CLIENT_STATE_SUSPENDED;
+        set_io_events(client, client->evio.events & EV_WRITE);
+
+        ev_timer_set(&client->evresume, delay, 0.);
+        ev_timer_start(client->loop, &client->evresume);
 }
 
 
@@ -918,14 +1538,23 @@ int server_generic_process_requests(server_generic_t *server, server_generic_cli
 {
         client->server = server;
 
+        /*
+         * Clients not handed to an I/O thread belong to the main loop.
+         */
+        if ( ! client->loop )
+                client->loop = current_loop ? current_loop : manager_event_loop;
+
         ev_io_init(&client->evio, libev_notification_cb, (int) prelude_io_get_fd(client->fd), EV_READ);
-        ev_io_start(manager_event_loop, &client->evio);
+        ev_io_start(client->loop, &client->evio);
+
+        ev_timer_init(&client->evresume, libev_resume_cb, 0, 0);
+        client->evresume.data = client;
 
         if ( ! (client->state & SERVER_GENERIC_CLIENT_STATE_ACCEPTED) ) {
                 ev_timer_init(&client->evtimer, libev_timer_cb, 0, config.connection_timeout);
                 client->evtimer.data = client;
 
-                ev_timer_again(manager_event_loop, &client->evtimer);
+                ev_timer_again(client->loop, &client->evtimer);
         }
 
         return 0;
@@ -934,8 +1563,9 @@ int server_generic_process_requests(server_generic_t *server, server_generic_cli
 
 void server_generic_remove_client(server_generic_t *server, server_generic_client_t *client)
 {
-        ev_io_stop(manager_event_loop, &client->evio);
-        ev_timer_stop(manager_event_loop, &client->evtimer);
+        ev_io_stop(client->loop, &client->evio);
+        ev_timer_stop(client->loop, &client->evtimer);
+        ev_timer_stop(client->loop, &client->evresume);
 }
 
 
@@ -1018,3 +1648,54 @@ int server_generic_client_set_permission(server_generic_client_t *client, prelud
         client->permission = permission;
         return 0;
 }
+
+
+
+void server_generic_set_io_threads(unsigned int nthread)
+{
+        io_threads = nthread;
+}
+
+
+
+void server_generic_set_listen_backlog(int backlog)
+{
+        listen_backlog = backlog;
+}
+
+
+
+void server_generic_set_handshake_threads(unsigned int nthread)
+{
+        handshake_threads = nthread;
+}
+
+
+
+/*
+ * Whether client is owned by the calling thread event loop.
+ */
+prelude_bool_t server_generic_client_is_local(server_generic_client_t *client)
+{
+        if ( ! loops_started || ! io_threads )
+                return TRUE;
+
+        return client->loop == current_loop;
+}
+
+
+
+/*
+ * Call func from the thread owning client, right away if this is the
+ * calling thread. Since client might be gone once func is called, data
+ * should identify it rather than point to it.
+ */
+int server_generic_client_call(server_generic_client_t *client, server_generic_call_func_t *func, void *data)
+{
+        if ( server_generic_client_is_local(client) ) {
+                func(data);
+                return 0;
+        }
+
+        return loop_call(ev_userdata(client->loop), func, data);
+}
@@ -0,0 +1,183 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2008 PreludeIDS Technologies. All Rights Reserved.
+#
+# This file is part of the Prelude-Manager program.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; see the file COPYING.  If not, write to
+# the Free Software Foundation, 675 Mass Ave, Cambridge, MA 02139, USA.
+#
+
+"""
+Reconnect many clients at once to a listening prelude-manager, the way
+sensors do after a manager restart, and report how the listen queue
+coped with it.
+
+Only the TCP connection is established: the manager accept it, then
+drop it once the authentication timeout expire. A SYN dropped because
+the accept queue is full is retransmitted by the client one second
+later, then three, so connections that took a second or more are the
+ones that overflowed the queue.
+
+When run on the manager host, the kernel ListenOverflows and ListenDrops
+counters are also reported.
+
+Usage: accept-storm.py [-n clients] [-t timeout] [host] [port]
+
+Compare a manager built before and after the accept queue draining, for
+example with "listen-backlog = 10" against the default, each time
+right after the manager started:
+
+    ulimit -n 16384
+    tools/accept-storm.py -n 5000 127.0.0.1 4690
+
+The manager own file descriptor limit must allow that many clients too.
+"""
+
+import errno
+import getopt
+import resource
+import select
+import socket
+import sys
+import time
+
+
+def get_listen_counters():
+        try:
+                lines = open("/proc/net/netstat").read().splitlines()
+        except IOError:
+                return None
+
+        for i in range(0, len(lines) - 1, 2):
+                keys = lines[i].split()
+                values = lines[i + 1].split()
+
+                if keys[0] == "TcpExt:":
+                        stats = dict(zip(keys[1:], [int(v) for v in values[1:]]))
+                        return (stats.get("ListenOverflows", 0), stats.get("ListenDrops", 0))
+
+        return None
+
+
+def percentile(values, pct):
+        if not values:
+                return 0.0
+
+        return values[min(len(values) - 1, int(len(values) * pct / 100.0))]
+
+
+def storm(host, port, count, timeout):
+        soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+        if soft < count + 16:
+                try:
+                        resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, count + 16), hard))
+                except ValueError:
+                        pass
+
+        poller = select.epoll()
+        pending = {}
+        failed = 0
+        latency = []
+
+        counters = get_listen_counters()
+        start = time.time()
+
+        for i in range(count):
+                try:
+                        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                except socket.error as e:
+                        sys.stderr.write("could not create socket %d: %s.\n" % (i, e))
+                        break
+
+                sock.setblocking(0)
+
+                ret = sock.connect_ex((host, port))
+                if ret not in (0, errno.EINPROGRESS):
+                        failed += 1
+                        sock.close()
+                        continue
+
+                pending[sock.fileno()] = sock
+                poller.register(sock.fileno(), select.EPOLLOUT)
+
+        sockets = list(pending.values())
+
+        while pending and time.time() - start < timeout:
+                for fd, event in poller.poll(0.1):
+                        sock = pending.pop(fd)
+                        poller.unregister(fd)
+
+                        if sock.getsockopt(socket.SOL_SOCKET, socket.SO_ERROR) != 0:
+                                failed += 1
+                        else:
+                                latency.append(time.time() - start)
+
+        elapsed = time.time() - start
+
+        if counters:
+                after = get_listen_counters()
+                counters = (after[0] - counters[0], after[1] - counters[1])
+
+        for sock in sockets:
+                sock.close()
+
+        latency.sort()
+
+        print("clients:          %d" % count)
+        print("connected:        %d" % len(latency))
+        print("failed:           %d" % failed)
+        print("timed out:        %d" % len(pending))
+        print("over 1 second:    %d" % len([l for l in latency if l >= 1.0]))
+        print("connect p50/p99/max: %.3f/%.3f/%.3f seconds" % (percentile(latency, 50), percentile(latency, 99), latency[-1] if latency else 0.0))
+        print("elapsed:          %.3f seconds" % elapsed)
+
+        if counters:
+                print("ListenOverflows:  %d" % counters[0])
+                print("ListenDrops:      %d" % counters[1])
+
+
+def usage():
+        sys.stderr.write("Usage: %s [-n clients] [-t timeout] [host] [port]\n" % sys.argv[0])
+        sys.exit(1)
+
+
+def main():
+        count = 5000
+        timeout = 30.0
+
+        try:
+                opts, args = getopt.getopt(sys.argv[1:], "n:t:h")
+        except getopt.GetoptError:
+                usage()
+
+        for opt, arg in opts:
+                if opt == "-n":
+                        count = int(arg)
+                elif opt == "-t":
+                        timeout = float(arg)
+                else:
+                        usage()
+
+        if len(args) > 2:
+                usage()
+
+        host = args[0] if len(args) > 0 else "127.0.0.1"
+        port = int(args[1]) if len(args) > 1 else 4690
+
+        storm(host, port, count, timeout)
+
+
+if __name__ == "__main__":
+        main()